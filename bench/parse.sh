@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# This is part of the source code of the carteur state machine generator.
+# The code is under the BSD-3 license (see LICENSE).
+#
+# Compare the run time of carteur on a 1M-transition machine, between the
+# working tree and an older revision (by default, the last one parsing with
+# inih). Usage: bench/parse.sh [revision]. CC and CFLAGS can be overridden,
+# e.g. CC=gcc CFLAGS="-I/path/to/m-lib -std=c11 -O2" bench/parse.sh
+#
+
+set -e
+
+BEFORE=${1:-$(git log -n 1 --format=%h -S ini_parse -- src/main.c)^}
+ROOT=$(pwd)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+CC=${CC:-clang}
+CFLAGS=${CFLAGS:-"-Wall -I$HOME/.local/include -std=c11 -O2"}
+git show "$BEFORE:src/main.c" > "$DIR/before.c"
+$CC $CFLAGS "$DIR/before.c" -linih -o "$DIR/before"
+$CC $CFLAGS src/main.c -pthread -o "$DIR/after"
+
+# The older revisions always read test.ini from the current directory.
+python3 bench/synth.py --states 5000 --events 2000 --transitions 1000000 \
+    --callbacks 20000 "$DIR/test.ini"
+
+cd "$DIR"
+for binary in before after; do
+    printf '%s: ' "$binary"
+    /usr/bin/time -f '%e s, %M KiB' "./$binary" test.ini 2>&1 >/dev/null | tail -n 1
+done
+cd "$ROOT"
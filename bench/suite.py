@@ -0,0 +1,352 @@
+#!/usr/bin/env python3
+#
+# This is part of the source code of the carteur state machine generator.
+# The code is under the BSD-3 license (see LICENSE).
+#
+# Benchmark carteur and the code it generates, on synthetic machines of
+# several sizes and shapes. For each machine, the time, allocations and peak
+# memory of carteur are measured stage by stage (--stats=json), then the
+# machine is generated with each backend, compiled, and its dispatch
+# throughput and memory per instance are measured. The results are written
+# as JSON. Usage: bench/suite.py [--quick] [-o results.json]
+#
+
+import argparse
+import json
+import os
+import re
+import shlex
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import synth
+
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# name, states, events, density, fan-out, skew, callbacks
+MACHINES = [
+    ("small-dense", 16, 8, 0.8, 0, 0.0, 16),
+    ("medium-sparse", 500, 100, 0.05, 0, 0.0, 64),
+    ("medium-skewed", 500, 100, 0.05, 0, 1.0, 64),
+    ("wide-fan-out", 100, 2000, 0.2, 400, 0.0, 64),
+    ("large-sparse", 5000, 500, 0.004, 0, 0.0, 256),
+]
+
+QUICK_MACHINES = [
+    ("small-dense", 16, 8, 0.8, 0, 0.0, 16),
+    ("medium-sparse", 200, 50, 0.05, 0, 0.0, 32),
+]
+
+# name, options added to the description, and the largest machine (states x
+# events) it is measured on. The direct-threaded run has a jump table per
+# state, which takes the compiler ages beyond some tens of thousands of cells.
+BACKENDS = [
+    ("switch", ["backend = switch"], None),
+    ("dense", ["backend = dense"], None),
+    ("compressed", ["backend = compressed"], None),
+    ("run", ["backend = dense", "run = true"], 50000),
+    ("packed", ["backend = dense", "packed = true"], None),
+    ("binary", ["language = binary"], None),
+]
+
+
+# The driver feeds two streams of events to an instance: events drawn
+# uniformly, most of them without a transition in sparse machines, and a
+# walk of events having one, found beforehand by trying random events. Each
+# callback counts its calls, so that they cannot be optimised away.
+DRIVER = r"""
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+%(includes)s
+
+static uint64_t calls ;
+%(callbacks)s
+
+static uint64_t seed = 88172645463325252ull ;
+static uint32_t next_random(void) {
+	seed ^= seed << 13 ; seed ^= seed >> 7 ; seed ^= seed << 17 ;
+	return (uint32_t) (seed >> 32) ;
+}
+
+static double now(void) {
+	struct timespec t ;
+	clock_gettime(CLOCK_MONOTONIC, &t) ;
+	return (double) t.tv_sec + (double) t.tv_nsec * 1e-9 ;
+}
+
+%(setup)s
+
+static double best(const event_t* events, size_t n, int repeats) {
+	double fastest = 1e30 ;
+	for (int r = 0; r < repeats; ++ r) {
+		state_t state = initial() ;
+		const double start = now() ;
+		%(dispatch_all)s
+		const double elapsed = now() - start ;
+		if (elapsed < fastest)
+			fastest = elapsed ;
+	}
+	return fastest ;
+}
+
+int main(void) {
+	%(load)s
+	const size_t n = %(n)d ;
+	event_t* random_events = malloc(n * sizeof(event_t)) ;
+	event_t* walk = malloc(n * sizeof(event_t)) ;
+	for (size_t i = 0; i < n; ++ i) {
+		random_events[i] = (event_t) (next_random() %% N_EVENTS) ;
+	}
+	state_t state = initial() ;
+	for (size_t i = 0; i < n; ++ i) {
+		event_t event = (event_t) (next_random() %% N_EVENTS) ;
+		for (int tries = 0; tries < 256; ++ tries) {
+			const uint64_t before = calls ;
+			state_t probe = state ;
+			dispatch(&probe, event) ;
+			if (calls != before) {
+				state = probe ;
+				break ;
+			}
+			event = (event_t) (next_random() %% N_EVENTS) ;
+		}
+		walk[i] = event ;
+	}
+	const double random_time = best(random_events, n, %(repeats)d) ;
+	const double walk_time = best(walk, n, %(repeats)d) ;
+	printf("{\"random\": %%.1f, \"walk\": %%.1f, \"bytes_per_instance\": %%.3f, "
+	       "\"calls\": %%llu}\n", n / random_time, n / walk_time, %(bytes_per_instance)s,
+	       (unsigned long long) calls) ;
+	free(random_events) ;
+	free(walk) ;
+	return 0 ;
+}
+"""
+
+
+def enum_names(header, name):
+    match = re.search(r"typedef enum \{([^}]*)\} %s ;" % name, header)
+    return re.findall(r"^\s*(\w+)\s*[,=]", match.group(1), re.M) if match else []
+
+
+def driver_source(backend, directory, n, repeats):
+    """C source of the driver of a generated machine."""
+    parts = {"n": n, "repeats": repeats}
+    if backend == "binary":
+        parts["includes"] = '#include "carteur_runtime.h"'
+        parts["callbacks"] = ("static void count(void* user) {\n"
+                              "\t(void) user ; ++ calls ;\n}\n")
+        parts["setup"] = (
+            "typedef uint32_t event_t ;\ntypedef uint32_t state_t ;\n"
+            "static carteur_machine machine ;\n"
+            "static carteur_callback* table ;\n"
+            "static uint32_t N_EVENTS ;\n"
+            "static state_t initial(void) { return machine.start ; }\n"
+            "static void dispatch(state_t* state, event_t event) {\n"
+            "\tcarteur_dispatch(&machine, state, event, table, NULL) ;\n}\n")
+        parts["load"] = (
+            'if (carteur_map(&machine, "generated_synthetic.bin") != CARTEUR_OK)\n'
+            "\t\treturn 1 ;\n"
+            "\tN_EVENTS = machine.n_events ;\n"
+            "\ttable = malloc((machine.n_callbacks + 1) * sizeof(carteur_callback)) ;\n"
+            "\tfor (uint32_t i = 0; i < machine.n_callbacks; ++ i) {\n"
+            "\t\ttable[i] = count ;\n\t}")
+        parts["dispatch_all"] = ("for (size_t i = 0; i < n; ++ i) {\n"
+                                 "\t\t\tdispatch(&state, events[i]) ;\n\t\t}")
+        parts["bytes_per_instance"] = "(double) sizeof(state_t)"
+        return DRIVER % parts
+
+    with open(os.path.join(directory, "generated_synthetic.h")) as f:
+        header = f.read()
+    events = enum_names(header, "synthetic_event_t")
+    callbacks = re.findall(r"^void (\w+)\(void\* user\) ;", header, re.M)
+    parts["includes"] = '#include "generated_synthetic.h"'
+    parts["callbacks"] = "".join(
+        "void %s(void* user) {\n\t(void) user ; ++ calls ;\n}\n" % c
+        for c in callbacks)
+    # A packed instance is stepped in its word, state 0 being all zeros.
+    setup = ("typedef synthetic_event_t event_t ;\n"
+             "typedef %s state_t ;\n"
+             "#define N_EVENTS %d\n"
+             "static state_t initial(void) { return (state_t) 0 ; }\n"
+             % ("uint64_t" if backend == "packed" else "synthetic_state_t",
+                len(events)))
+    if backend == "packed":
+        setup += ("static void dispatch(state_t* word, event_t event) {\n"
+                  "\tsynthetic_packed_step(word, 0, event, NULL) ;\n}\n")
+    elif backend == "switch":
+        setup += ("static void (* const handlers[])(state_t*, void*) = {\n%s} ;\n"
+                  "static void dispatch(state_t* state, event_t event) {\n"
+                  "\thandlers[event](state, NULL) ;\n}\n"
+                  % "".join("\tsynthetic_handle_%s,\n" % e for e in events))
+    else:
+        setup += ("static void dispatch(state_t* state, event_t event) {\n"
+                  "\tsynthetic_dispatch(state, event, NULL) ;\n}\n")
+    parts["setup"] = setup
+    parts["load"] = ""
+    if backend == "run":
+        parts["dispatch_all"] = "synthetic_run(&state, events, n, NULL) ;"
+    else:
+        parts["dispatch_all"] = ("for (size_t i = 0; i < n; ++ i) {\n"
+                                 "\t\t\tdispatch(&state, events[i]) ;\n\t\t}")
+    if backend == "packed":
+        parts["bytes_per_instance"] = (
+            "synthetic_packed_words(1 << 20) * 8.0 / (1 << 20)")
+    else:
+        parts["bytes_per_instance"] = "(double) sizeof(state_t)"
+    return DRIVER % parts
+
+
+def code_size(path):
+    """Text and data sizes of an object file, from size(1), if available."""
+    try:
+        out = subprocess.run(["size", path], capture_output=True, text=True,
+                             check=True).stdout.splitlines()
+        text, data, bss = (int(x) for x in out[1].split()[:3])
+        return {"text": text, "data": data, "bss": bss}
+    except (OSError, subprocess.CalledProcessError, IndexError, ValueError):
+        return None
+
+
+def run(command, directory):
+    result = subprocess.run(command, cwd=directory, capture_output=True,
+                            text=True)
+    if result.returncode != 0:
+        raise RuntimeError("%s failed:\n%s" % (" ".join(command),
+                                               result.stderr))
+    return result
+
+
+def carteur_stats(carteur, directory, repeats):
+    """Statistics of carteur (--stats=json) on the machine, keeping the
+    fastest wall and CPU time of each stage over the runs."""
+    stats = None
+    for _ in range(repeats):
+        result = run([carteur, "-f", "--stats=json", "machine.ini"], directory)
+        try:
+            current = json.loads(result.stdout)
+        except ValueError:
+            raise RuntimeError("no --stats=json output in:\n" + result.stdout)
+        if stats is None:
+            stats = current
+            continue
+        for name, stage in current["stages"].items():
+            for clock in ("wall", "cpu"):
+                stats["stages"][name][clock] = min(stats["stages"][name][clock],
+                                                   stage[clock])
+        stats["peak_rss"] = max(stats["peak_rss"], current["peak_rss"])
+    return {key: stats[key] for key in ("stages", "peak_rss", "shape")}
+
+
+def bench_backend(args, directory, machine, backend, options):
+    path = os.path.join(directory, backend)
+    os.makedirs(path)
+    name, states, events, density, fan_out, skew, callbacks = machine
+    with open(os.path.join(path, "machine.ini"), "w") as out:
+        synth.synthesize(out, states, events,
+                         int(round(density * states * events)), callbacks,
+                         args.seed, fan_out, skew, options)
+    run([args.carteur, "machine.ini"], path)
+    with open(os.path.join(path, "driver.c"), "w") as out:
+        out.write(driver_source(backend, path, args.events, args.repeats))
+    cflags = shlex.split(args.cflags)
+    if backend == "binary":
+        runtime = os.path.join(ROOT, "src", "runtime")
+        sources = [os.path.join(runtime, "carteur_runtime.c")]
+        includes = ["-I" + runtime]
+    else:
+        sources = ["generated_synthetic.c"]
+        includes = []
+    run([args.cc] + cflags + includes + ["-c"] + sources
+        + ["-o", "machine.o"], path)
+    run([args.cc] + cflags + includes + ["driver.c", "machine.o",
+                                         "-o", "driver"], path)
+    measures = json.loads(run(["./driver"], path).stdout)
+    result = {
+        "backend": backend,
+        "events_per_second": {"random": measures["random"],
+                              "walk": measures["walk"]},
+        "bytes_per_instance": measures["bytes_per_instance"],
+        "code_bytes": code_size(os.path.join(path, "machine.o")),
+    }
+    if backend == "binary":
+        result["blob_bytes"] = os.path.getsize(
+            os.path.join(path, "generated_synthetic.bin"))
+    return result
+
+
+def bench_machine(args, directory, machine):
+    name, states, events, density, fan_out, skew, callbacks = machine
+    os.makedirs(directory)
+    with open(os.path.join(directory, "machine.ini"), "w") as out:
+        transitions = synth.synthesize(
+            out, states, events, int(round(density * states * events)),
+            callbacks, args.seed, fan_out, skew)
+    result = {
+        "name": name,
+        "shape": {"states": states, "events": events,
+                  "transitions": transitions, "density": density,
+                  "fan_out": fan_out, "skew": skew, "callbacks": callbacks},
+        "carteur": carteur_stats(args.carteur, directory, args.repeats),
+        "backends": [],
+    }
+    for backend, options, max_cells in BACKENDS:
+        if args.backends and backend not in args.backends:
+            continue
+        if (max_cells is not None) and (states * events > max_cells):
+            result["backends"].append({"backend": backend, "skipped":
+                                       "more than %d cells" % max_cells})
+            continue
+        print("%s: %s" % (name, backend), file=sys.stderr)
+        result["backends"].append(
+            bench_backend(args, directory, machine, backend, options))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--carteur", default=os.path.join(ROOT, "carteur"))
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    parser.add_argument("--cflags", default="-O2 -std=c11")
+    parser.add_argument("--events", type=int, default=1 << 22,
+                        help="events fed to an instance per measure")
+    parser.add_argument("--repeats", type=int, default=5)
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--backend", dest="backends", action="append",
+                        choices=[b[0] for b in BACKENDS],
+                        help="only this backend (may be repeated)")
+    parser.add_argument("--quick", action="store_true",
+                        help="fewer, smaller machines and events")
+    parser.add_argument("-o", "--output", help="JSON file (default: stdout)")
+    args = parser.parse_args()
+    args.carteur = os.path.abspath(args.carteur)
+    machines = QUICK_MACHINES if args.quick else MACHINES
+    if args.quick:
+        args.events = min(args.events, 1 << 18)
+        args.repeats = min(args.repeats, 3)
+
+    results = {
+        "carteur": args.carteur,
+        "cc": args.cc,
+        "cflags": args.cflags,
+        "events": args.events,
+        "repeats": args.repeats,
+        "machines": [],
+    }
+    with tempfile.TemporaryDirectory() as directory:
+        for machine in machines:
+            results["machines"].append(bench_machine(
+                args, os.path.join(directory, machine[0]), machine))
+    out = open(args.output, "w") if args.output else sys.stdout
+    json.dump(results, out, indent=2)
+    out.write("\n")
+
+
+if __name__ == "__main__":
+    main()
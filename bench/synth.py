@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# This is part of the source code of the carteur state machine generator.
+# The code is under the BSD-3 license (see LICENSE).
+#
+# Write a synthetic machine description, for benchmarking purposes.
+#
+
+import argparse
+import bisect
+import random
+import sys
+
+
+class Zipf:
+    """Draw integers in [0, n), i with a weight of 1 / (i + 1)^skew."""
+
+    def __init__(self, rng, n, skew):
+        self.rng = rng
+        self.n = n
+        self.cumulated = None
+        if skew > 0:
+            total = 0.0
+            self.cumulated = []
+            for i in range(n):
+                total += 1.0 / (i + 1) ** skew
+                self.cumulated.append(total)
+
+    def draw(self):
+        if self.cumulated is None:
+            return self.rng.randrange(self.n)
+        x = self.rng.random() * self.cumulated[-1]
+        return min(bisect.bisect_right(self.cumulated, x), self.n - 1)
+
+
+def synthesize(out, states, events, transitions, callbacks, seed,
+               fan_out=0, skew=0.0, options=()):
+    rng = random.Random(seed)
+    out.write("machine_name = synthetic\n")
+    out.write("declare_states = true\n")
+    out.write("declare_events = true\n")
+    out.write("states_enum_name = synthetic_state_t\n")
+    out.write("events_enum_name = synthetic_event_t\n")
+    for option in options:
+        out.write("%s\n" % option)
+    out.write("\n")
+    for s in range(states):
+        out.write("state = S%d\n" % s)
+    out.write("\n")
+    # Pairs (from, event) are kept unique, so that the machine stays
+    # deterministic, which bounds the number of transitions, and so does the
+    # fan-out (transitions out of a state). With a skew, a few states and
+    # events get most of the transitions, until they are full.
+    transitions = min(transitions, states * events)
+    if fan_out > 0:
+        transitions = min(transitions, states * min(fan_out, events))
+    pick_state = Zipf(rng, states, skew)
+    pick_event = Zipf(rng, events, skew)
+    seen = set()
+    out_degree = [0] * states
+    misses = 0
+    while len(seen) < transitions:
+        if misses < 64:
+            pair = (pick_state.draw(), pick_event.draw())
+        else:
+            pair = (rng.randrange(states), rng.randrange(events))
+        if (pair in seen) or ((fan_out > 0) and (out_degree[pair[0]] >= fan_out)):
+            misses += 1
+            continue
+        misses = 0
+        seen.add(pair)
+        out_degree[pair[0]] += 1
+        out.write("transition = S%d, S%d, E%d, cb%d\n"
+                  % (pair[0], pick_state.draw(), pair[1],
+                     rng.randrange(callbacks)))
+    return transitions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--states", type=int, default=1000)
+    parser.add_argument("--events", type=int, default=1000)
+    parser.add_argument("--transitions", type=int, default=10000)
+    parser.add_argument("--density", type=float, default=None,
+                        help="fraction of the (state, event) pairs having a "
+                             "transition, instead of --transitions")
+    parser.add_argument("--fan-out", type=int, default=0,
+                        help="maximum number of transitions out of a state")
+    parser.add_argument("--skew", type=float, default=0.0,
+                        help="Zipf exponent of the states and events drawn "
+                             "(0 is uniform)")
+    parser.add_argument("--callbacks", type=int, default=1000)
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--option", action="append", default=[],
+                        help="extra 'name = value' line, e.g. "
+                             "'backend = table'")
+    parser.add_argument("output", nargs="?")
+    args = parser.parse_args()
+    transitions = args.transitions
+    if args.density is not None:
+        transitions = int(round(args.density * args.states * args.events))
+    out = open(args.output, "w") if args.output else sys.stdout
+    synthesize(out, args.states, args.events, transitions, args.callbacks,
+               args.seed, args.fan_out, args.skew, args.option)
+
+
+if __name__ == "__main__":
+    main()
@@ -9,14 +9,76 @@
 // or less common analysis, and, eventually, optimisations. UNSUPPORTED now...
 //#define CARTEUR_GRAPH_ANALYSIS
 
-#include <m-lib/m-string.h>
-#include <m-lib/m-array.h>
-#include <m-lib/m-dict.h>
+// The input is mapped in memory, which is POSIX.
+#define _POSIX_C_SOURCE 200809L
 
-#include <ini.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+//
+// Allocations are counted for --stats, by wrapping malloc and friends before
+// M*LIB is included, so that its containers (whose default M_MEMORY_* macros
+// call them) are counted along with the rest of carteur. The counters are
+// shared by all threads, and relaxed, which keeps them cheap enough to be
+// always on. A reallocation counts as an allocation of its new size.
+//
+static _Atomic uint64_t stats_allocations ;
+static _Atomic uint64_t stats_allocated ;
+static _Atomic uint64_t stats_frees ;
+
+static inline void stats_count(const size_t size)
+{
+    atomic_fetch_add_explicit(&stats_allocations, 1, memory_order_relaxed) ;
+    atomic_fetch_add_explicit(&stats_allocated, size, memory_order_relaxed) ;
+}
+
+static inline void* stats_malloc(const size_t size)
+{
+    stats_count(size) ;
+    return (malloc)(size) ;
+}
+
+static inline void* stats_calloc(const size_t n, const size_t size)
+{
+    stats_count(n * size) ;
+    return (calloc)(n, size) ;
+}
+
+static inline void* stats_realloc(void* ptr, const size_t size)
+{
+    stats_count(size) ;
+    return (realloc)(ptr, size) ;
+}
+
+static inline void stats_free(void* ptr)
+{
+    if (ptr != NULL)
+        atomic_fetch_add_explicit(&stats_frees, 1, memory_order_relaxed) ;
+    (free)(ptr) ;
+}
+
+#define malloc(size) stats_malloc(size)
+#define calloc(n, size) stats_calloc(n, size)
+#define realloc(ptr, size) stats_realloc(ptr, size)
+#define free(ptr) stats_free(ptr)
+
+#include <m-lib/m-string.h>
+#include <m-lib/m-array.h>
+
+#include "runtime/carteur_runtime.h"
 
 #if defined(CARTEUR_GRAPH_ANALYSIS)
 #error "Graph analysis is yet unsupported."
@@ -25,24 +87,80 @@
 #endif
 
 //
-// The program operates in 3 stages. Stage 1 is obviously parsing ; the
-// maintained structures involve a mapping from strings to integers, in
-// order to build the graph easily. Stage 2 is dedicated to transforming
-// (if enabled) the graph. During this stage, the mappings from strings to
-// integers are also reversed, so that stage 3 (generation) can be able to
-// query strings in from corresponding indices in the graph. This last stage
-// is meant to generate code (this stage is done by languages backend).
+// The program operates in 3 stages. Stage 1 is obviously parsing ; names
+// are interned in symbol tables, which give them dense integers in the
+// order they are first seen, in order to build the graph easily. Stage 2 is
+// dedicated to transforming (if enabled) the graph. It takes the arrays of
+// names, already indexed by those integers, out of the symbol tables, so
+// that stage 3 (generation) can query strings from the corresponding
+// indices in the graph. This last stage is meant to generate code (this
+// stage is done by languages backend).
 //
 
 
+///
+/// Code layouts the C backend can produce. The switch backend emits one
+/// handler per event, made of a switch over the current state. The table
+/// backends emit a single dispatcher, reading either a dense (state x event)
+/// table or a row-displacement compressed one. The plain table backend
+/// picks whichever suits the machine.
+///
+typedef enum generation_backend_t {
+    CARTEUR_BACKEND_SWITCH = 0,
+    CARTEUR_BACKEND_TABLE = 1,
+    CARTEUR_BACKEND_DENSE = 2,
+    CARTEUR_BACKEND_COMPRESSED = 3,
+} generation_backend_t ;
+
+///
+/// Languages of the generated code. C++ is a header-only class template,
+/// whose callbacks are members of a user context type.
+///
+typedef enum generation_language_t {
+    CARTEUR_LANGUAGE_C = 0,
+    CARTEUR_LANGUAGE_CPP = 1,
+    CARTEUR_LANGUAGE_BINARY = 2,
+} generation_language_t ;
+
 ///
 /// Here are a few parameters. A state machine (or graph) has a name. It can
 /// - declare the states (enum name_states) or not (default: yes)
-/// - declare the events (enum name_events) or not (default: no)
+/// - declare the events (enum name_events) or not (default: no), which is
+///   forced when the generated API takes events
+/// - be generated in a given language (default: C)
+/// - be generated with a given backend (default: switch)
+/// - provide a batched step over many instances (default: no)
+/// - provide a vectorised step of many instances on one event (default: no)
+/// - provide a bit-packed container of instances (default: no)
+/// - provide a run over a stream of events (default: no)
+/// - provide lookups of events and states by name (default: no)
+/// - provide the events having a transition from each state (default: no)
+/// - provide a thread-safe API for shared instances (default: no), and a
+///   benchmark of it (default: no)
+/// - spread its handlers over several source files (default: 1 file)
+/// - merge equivalent states (default: no), keeping the names of the merged
+///   states as aliases in the states enum (default: no)
+/// - count the transitions taken at runtime (default: no)
+/// - be laid out after such a profile (default: no profile)
 ///
 typedef struct parameters_t {
     bool declare_states ;
     bool declare_events ;
+    bool batch ;
+    bool broadcast ;
+    bool packed ;
+    bool run ;
+    bool from_string ;
+    bool enabled_events ;
+    bool atomic ;
+    bool atomic_benchmark ;
+    bool minimise ;
+    bool state_aliases ;
+    bool instrument ;
+    generation_language_t language ;
+    generation_backend_t backend ;
+    size_t source_shards ;
+    char* profile ;
     char* machine_name ;
     char* states_enum_name ;
     char* events_enum_name ;
@@ -55,6 +173,21 @@ typedef struct parameters_t {
 #define CARTEUR_DEFAULT_PARAMETERS \
     { .declare_states = true \
     , .declare_events = false \
+    , .batch = false \
+    , .broadcast = false \
+    , .packed = false \
+    , .run = false \
+    , .from_string = false \
+    , .enabled_events = false \
+    , .atomic = false \
+    , .atomic_benchmark = false \
+    , .minimise = false \
+    , .state_aliases = false \
+    , .instrument = false \
+    , .language = CARTEUR_LANGUAGE_C \
+    , .backend = CARTEUR_BACKEND_SWITCH \
+    , .source_shards = 1 \
+    , .profile = NULL \
     , .machine_name = CARTEUR_DEFAULT_MACHINE_NAME \
     , .states_enum_name = CARTEUR_DEFAULT_STATES_NAME \
     , .events_enum_name = CARTEUR_DEFAULT_EVENTS_NAME \
@@ -63,6 +196,21 @@ typedef struct parameters_t {
 void parameters_init(parameters_t* params) {
     params->declare_states = true ;
     params->declare_events = false ;
+    params->batch = false ;
+    params->broadcast = false ;
+    params->packed = false ;
+    params->run = false ;
+    params->from_string = false ;
+    params->enabled_events = false ;
+    params->atomic = false ;
+    params->atomic_benchmark = false ;
+    params->minimise = false ;
+    params->state_aliases = false ;
+    params->instrument = false ;
+    params->language = CARTEUR_LANGUAGE_C ;
+    params->backend = CARTEUR_BACKEND_SWITCH ;
+    params->source_shards = 1 ;
+    params->profile = NULL ;
     // Copy names from string litterals, to prevent double-free.
     string_t machine_name_copy ;
     string_t states_enum_name_copy ;
@@ -77,16 +225,25 @@ void parameters_init(parameters_t* params) {
 
 #define CARTEUR_INI_TRUE "true"
 #define CARTEUR_INI_FALSE "false"
+#define CARTEUR_INI_LANGUAGE_C "c"
+#define CARTEUR_INI_LANGUAGE_CPP "cpp"
+#define CARTEUR_INI_LANGUAGE_BINARY "binary"
+#define CARTEUR_INI_BACKEND_SWITCH "switch"
+#define CARTEUR_INI_BACKEND_TABLE "table"
+#define CARTEUR_INI_BACKEND_DENSE "dense"
+#define CARTEUR_INI_BACKEND_COMPRESSED "compressed"
 
 ///
 /// One transition from some state to another state, triggered by an event
-/// and calling a callback.
+/// and calling a callback. The count is the number of times it was taken in
+/// the profile, if one is given.
 ///
 typedef struct transition_t {
     size_t from ;
     size_t to ;
     size_t event ;
     size_t callback ;
+    uint64_t count ;
 } transition_t[1] ;
 
 // NOTE : I tend to avoid using this [1] "trick" myself when I can avoid it.
@@ -98,6 +255,7 @@ void transition_init(transition_t t)
     t->to = 0ul ;
     t->event = 0ul ;
     t->callback = 0ul ;
+    t->count = 0ull ;
 }
 void transition_set(transition_t transition, const transition_t model) {}
 void transition_init_set(transition_t transition, const transition_t model)
@@ -107,11 +265,7 @@ void transition_init_set(transition_t transition, const transition_t model)
 void transition_clear(transition_t transition) {}
 int transition_cmp(transition_t a, transition_t b)
 {
-    return a->event - b->event ;
-}
-int transition_cmp_qsort(transition_t const* a, transition_t const* b)
-{
-    return (*a)->event - (*b)->event ;
+    return (a->event > b->event) - (a->event < b->event) ;
 }
 void transition_swap(transition_t a, transition_t b)
 {
@@ -130,35 +284,562 @@ void transition_swap(transition_t a, transition_t b)
     , SWAP(transition_swap) \
     )
 
-#define M_DELETABLE_PTR_OPLIST \
-    ( INIT(M_INIT_DEFAULT) \
-    , INIT_SET(M_SET_DEFAULT) \
-    , SET(M_SET_DEFAULT) \
-    , CLEAR(free) \
-    , EQUAL(M_EQUAL_DEFAULT) \
-    , INIT_MOVE(M_MOVE_DEFAULT) \
-    , MOVE(M_MOVE_DEFAULT) \
-    , SWAP(M_SWAP_DEFAULT) \
+ARRAY_DEF(array_transition, transition_t)
+ARRAY_DEF(array_size, size_t, M_DEFAULT_OPLIST)
+
+// ................................................................... SYMBOLS
+
+///
+/// Bump allocator. Memory is carved out of big chunks, and is only given
+/// back all at once when the arena is cleared.
+///
+typedef struct arena_chunk_t {
+    struct arena_chunk_t* previous ;
+    size_t size ;
+    size_t used ;
+    char data[] ;
+} arena_chunk_t ;
+
+typedef struct arena_t {
+    arena_chunk_t* chunk ;
+} arena_t ;
+
+#define CARTEUR_ARENA_CHUNK_SIZE ((size_t) 1 << 20)
+
+void arena_init(arena_t* arena)
+{
+    arena->chunk = NULL ;
+}
+
+void* arena_alloc(arena_t* arena, const size_t size)
+{
+    arena_chunk_t* chunk = arena->chunk ;
+    if ((chunk == NULL) || (chunk->size - chunk->used < size)) {
+        const size_t chunk_size = (size > CARTEUR_ARENA_CHUNK_SIZE)
+                                ? size : CARTEUR_ARENA_CHUNK_SIZE ;
+        chunk = malloc(sizeof(arena_chunk_t) + chunk_size) ;
+        chunk->previous = arena->chunk ;
+        chunk->size = chunk_size ;
+        chunk->used = 0 ;
+        arena->chunk = chunk ;
+    }
+    void* memory = &chunk->data[chunk->used] ;
+    chunk->used += size ;
+    return memory ;
+}
+
+///
+/// Take over all the memory of another arena, which ends up empty.
+///
+void arena_adopt(arena_t* arena, arena_t* other)
+{
+    if (other->chunk == NULL)
+        return ;
+    arena_chunk_t* oldest = other->chunk ;
+    while (oldest->previous != NULL)
+        oldest = oldest->previous ;
+    oldest->previous = arena->chunk ;
+    arena->chunk = other->chunk ;
+    other->chunk = NULL ;
+}
+
+void arena_clear(arena_t* arena)
+{
+    while (arena->chunk != NULL) {
+        arena_chunk_t* previous = arena->chunk->previous ;
+        free(arena->chunk) ;
+        arena->chunk = previous ;
+    }
+}
+
+ARRAY_DEF(array_cstr, const char*, M_PTR_OPLIST)
+
+///
+/// Interned names. Each distinct name is copied once into the arena, and
+/// gets the next dense identifier. The names array maps identifiers back to
+/// names, and slots is an open-addressing hash table of identifiers + 1 (0
+/// for empty slots), whose capacity is a power of two.
+///
+typedef struct symbol_table_t {
+    arena_t* arena ;
+    array_cstr_t names ;
+    size_t* slots ;
+    size_t capacity ;
+} symbol_table_t ;
+
+#define CARTEUR_SYMBOL_TABLE_MIN_CAPACITY 64
+
+#define CARTEUR_FNV_OFFSET 14695981039346656037ull
+
+///
+/// Feed length bytes of data to a FNV-1a hash. Start from CARTEUR_FNV_OFFSET.
+///
+static uint64_t fnv1a(uint64_t hash, const void* data, const size_t length)
+{
+    const unsigned char* bytes = (const unsigned char*) data ;
+    for (size_t i = 0; i < length; ++ i) {
+        hash ^= bytes[i] ;
+        hash *= 1099511628211ull ;
+    }
+    return hash ;
+}
+
+static uint64_t symbol_hash(const char* str, const size_t length)
+{
+    return fnv1a(CARTEUR_FNV_OFFSET, str, length) ;
+}
+
+void symbol_table_init(symbol_table_t* table, arena_t* arena)
+{
+    table->arena = arena ;
+    array_cstr_init(table->names) ;
+    table->capacity = CARTEUR_SYMBOL_TABLE_MIN_CAPACITY ;
+    table->slots = calloc(table->capacity, sizeof(size_t)) ;
+}
+
+void symbol_table_clear(symbol_table_t* table)
+{
+    array_cstr_clear(table->names) ;
+    free(table->slots) ;
+    table->slots = NULL ;
+    table->capacity = 0 ;
+}
+
+size_t symbol_table_size(const symbol_table_t* table)
+{
+    return array_cstr_size(table->names) ;
+}
+
+///
+/// Slot holding the given name, or the empty slot where it would go.
+///
+static size_t* symbol_table_slot
+    ( const symbol_table_t* table
+    , const char* str
+    , const size_t length
+    )
+{
+    const size_t mask = table->capacity - 1 ;
+    for (size_t i = symbol_hash(str, length) & mask; ; i = (i + 1) & mask) {
+        size_t* slot = &table->slots[i] ;
+        if (*slot == 0)
+            return slot ;
+        const char* name = *array_cstr_get(table->names, *slot - 1) ;
+        if ((memcmp(name, str, length) == 0) && (name[length] == '\0'))
+            return slot ;
+    }
+}
+
+///
+/// Look a name up, without adding it. Return whether it was found.
+///
+bool symbol_table_find
+    ( const symbol_table_t* table
+    , const char* str
+    , const size_t length
+    , size_t* id
     )
+{
+    const size_t* slot = symbol_table_slot(table, str, length) ;
+    if (*slot == 0)
+        return false ;
+    *id = *slot - 1 ;
+    return true ;
+}
 
-ARRAY_DEF(array_transition, transition_t)
-ARRAY_DEF(array_string, string_t, STRING_OPLIST)
-ARRAY_DEF(array_char_ptr, char*, M_DELETABLE_PTR_OPLIST)
-DICT_DEF2(dict_string, string_t, STRING_OPLIST, size_t, M_DEFAULT_OPLIST)
+///
+/// Identifier of a name, which is added if it was not known yet. Unless
+/// copy is false, in which case the name must already be nul-terminated and
+/// outlive the table, the name is copied into the arena.
+///
+static size_t symbol_table_insert
+    ( symbol_table_t* table
+    , const char* str
+    , const size_t length
+    , const bool copy
+    )
+{
+    size_t* slot = symbol_table_slot(table, str, length) ;
+    if (*slot != 0)
+        return *slot - 1 ;
+
+    if (copy) {
+        char* name = arena_alloc(table->arena, length + 1) ;
+        memcpy(name, str, length) ;
+        name[length] = '\0' ;
+        str = name ;
+    }
+    array_cstr_push_back(table->names, str) ;
+    const size_t n = array_cstr_size(table->names) ;
+    *slot = n ;
+
+    // Keep the load factor under 1/2.
+    if (2 * n > table->capacity) {
+        const size_t old_capacity = table->capacity ;
+        size_t* old_slots = table->slots ;
+        table->capacity = 2 * old_capacity ;
+        table->slots = calloc(table->capacity, sizeof(size_t)) ;
+        for (size_t i = 0; i < old_capacity; ++ i) {
+            if (old_slots[i] == 0)
+                continue ;
+            const char* moved = *array_cstr_get(table->names, old_slots[i] - 1) ;
+            *symbol_table_slot(table, moved, strlen(moved)) = old_slots[i] ;
+        }
+        free(old_slots) ;
+    }
+    return n - 1 ;
+}
+
+size_t symbol_table_intern
+    ( symbol_table_t* table
+    , const char* str
+    , const size_t length
+    )
+{
+    return symbol_table_insert(table, str, length, true) ;
+}
+
+///
+/// Same as intern, for a name already interned in another table whose arena
+/// is adopted by the arena of this table.
+///
+size_t symbol_table_adopt(symbol_table_t* table, const char* name)
+{
+    return symbol_table_insert(table, name, strlen(name), false) ;
+}
+
+///
+/// Hand the names over (as an identifier to name array) and clear the
+/// table. The names themselves stay in the arena.
+///
+void symbol_table_move_names(array_cstr_t names, symbol_table_t* table)
+{
+    array_cstr_init_move(names, table->names) ;
+    array_cstr_init(table->names) ;
+    symbol_table_clear(table) ;
+}
+
+// ................................................................... BUFFERS
+
+///
+/// Growable output buffer. Stage 3 formats everything in memory, possibly
+/// on several threads, and the buffers are written in one go at the end.
+/// Diagnostics are collected the same way, one log per machine, so that
+/// machines processed concurrently do not mix their messages.
+///
+typedef struct buffer_t {
+    char* data ;
+    size_t size ;
+    size_t capacity ;
+} buffer_t ;
+
+ARRAY_DEF(array_buffer, buffer_t, M_POD_OPLIST)
+
+#define CARTEUR_BUFFER_MIN_CAPACITY ((size_t) 256)
+
+void buffer_init(buffer_t* buffer)
+{
+    buffer->data = NULL ;
+    buffer->size = 0 ;
+    buffer->capacity = 0 ;
+}
+
+void buffer_clear(buffer_t* buffer)
+{
+    free(buffer->data) ;
+    buffer_init(buffer) ;
+}
+
+///
+/// Make room for at least extra more bytes.
+///
+void buffer_reserve(buffer_t* buffer, const size_t extra)
+{
+    if (buffer->capacity - buffer->size >= extra)
+        return ;
+    size_t capacity = (buffer->capacity < CARTEUR_BUFFER_MIN_CAPACITY)
+                    ? CARTEUR_BUFFER_MIN_CAPACITY : buffer->capacity ;
+    while (capacity - buffer->size < extra)
+        capacity *= 2 ;
+    buffer->data = realloc(buffer->data, capacity) ;
+    buffer->capacity = capacity ;
+}
+
+void buffer_append(buffer_t* buffer, const char* str, const size_t length)
+{
+    buffer_reserve(buffer, length) ;
+    memcpy(buffer->data + buffer->size, str, length) ;
+    buffer->size += length ;
+}
+
+void buffer_puts(buffer_t* buffer, const char* str)
+{
+    buffer_append(buffer, str, strlen(str)) ;
+}
+
+///
+/// Append an unsigned integer in decimal, without going through printf.
+///
+void buffer_put_uint(buffer_t* buffer, size_t value)
+{
+    char digits[24] ;
+    size_t n = sizeof(digits) ;
+    do {
+        digits[-- n] = (char) ('0' + value % 10) ;
+        value /= 10 ;
+    } while (value != 0) ;
+    buffer_append(buffer, digits + n, sizeof(digits) - n) ;
+}
+
+void buffer_printf(buffer_t* buffer, const char* format, ...)
+{
+    va_list args ;
+    va_start(args, format) ;
+    buffer_reserve(buffer, 1) ;
+    int length = vsnprintf(buffer->data + buffer->size
+                          , buffer->capacity - buffer->size, format, args) ;
+    va_end(args) ;
+    if (length < 0)
+        return ;
+    if ((size_t) length >= buffer->capacity - buffer->size) {
+        buffer_reserve(buffer, (size_t) length + 1) ;
+        va_start(args, format) ;
+        vsnprintf(buffer->data + buffer->size
+                 , buffer->capacity - buffer->size, format, args) ;
+        va_end(args) ;
+    }
+    buffer->size += (size_t) length ;
+}
 
 // ................................................................... STAGE 1
 
 ///
-/// Information at stage 1. This contains storage for the states, events
-/// and callback names, and a dynamic array of transitions.
+/// Characters of an input file. It is mapped in memory when possible, so
+/// that the lexer reads it in place without ever copying lines.
+///
+typedef struct input_t {
+    char* data ;
+    size_t size ;
+    bool mapped ;
+} input_t ;
+
+bool input_open(input_t* input, const char* path)
+{
+    input->data = NULL ;
+    input->size = 0 ;
+    input->mapped = false ;
+    const int fd = open(path, O_RDONLY) ;
+    if (fd < 0)
+        return false ;
+    struct stat st ;
+    if (fstat(fd, &st) != 0) {
+        close(fd) ;
+        return false ;
+    }
+    input->size = (size_t) st.st_size ;
+    if (input->size > 0) {
+        void* map = mmap(NULL, input->size, PROT_READ, MAP_PRIVATE, fd, 0) ;
+        if (map != MAP_FAILED) {
+            posix_madvise(map, input->size, POSIX_MADV_SEQUENTIAL) ;
+            input->data = map ;
+            input->mapped = true ;
+        } else {
+            // Fall back to reading the whole file at once.
+            input->data = malloc(input->size) ;
+            size_t done = 0 ;
+            while (done < input->size) {
+                const ssize_t n = read(fd, input->data + done, input->size - done) ;
+                if (n <= 0)
+                    break ;
+                done += (size_t) n ;
+            }
+            input->size = done ;
+        }
+    }
+    close(fd) ;
+    return true ;
+}
+
+void input_close(input_t* input)
+{
+    if (input->mapped)
+        munmap(input->data, input->size) ;
+    else
+        free(input->data) ;
+}
+
+///
+/// A token is a view on the input, given by its offset and length.
+///
+typedef struct token_t {
+    size_t offset ;
+    size_t length ;
+} token_t ;
+
+///
+/// One 'name = value' line of the input, along with the section it lies in.
+///
+typedef struct entry_t {
+    size_t line ;
+    token_t section ;
+    token_t name ;
+    token_t value ;
+} entry_t ;
+
+///
+/// INI lexer working in place. Comments start with '#' or ';', the latter
+/// also after some blank in the middle of a line. Lines are found with
+/// memchr, which the C library vectorises, so the lexer only really looks
+/// at the characters of meaningful lines.
+///
+typedef struct lexer_t {
+    const char* data ;
+    size_t size ;
+    size_t position ;
+    size_t line ;
+    token_t section ;
+} lexer_t ;
+
+typedef enum lexer_status_t {
+    CARTEUR_LEXER_END = 0,
+    CARTEUR_LEXER_ENTRY = 1,
+    CARTEUR_LEXER_ERROR = 2,
+} lexer_status_t ;
+
+///
+/// Lex data from offset begin to offset end, which must be a line start and
+/// a line end. Tokens are always given as offsets from data.
+///
+void lexer_init
+    ( lexer_t* lexer
+    , const char* data
+    , const size_t begin
+    , const size_t end
+    )
+{
+    lexer->data = data ;
+    lexer->size = end ;
+    lexer->position = begin ;
+    lexer->line = 0 ;
+    lexer->section.offset = 0 ;
+    lexer->section.length = 0 ;
+}
+
+static bool character_is_blank(const char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r')
+        || (c == '\v') || (c == '\f') ;
+}
+
+///
+/// Strip blanks on both ends of [begin, end) and make a token of it.
+///
+static token_t lexer_trim(const char* data, size_t begin, size_t end)
+{
+    while ((begin < end) && character_is_blank(data[begin]))
+        ++ begin ;
+    while ((end > begin) && character_is_blank(data[end - 1]))
+        -- end ;
+    token_t token = { .offset = begin, .length = end - begin } ;
+    return token ;
+}
+
+///
+/// Find the next entry. Sections are remembered, blank lines and comments
+/// are skipped. On error, the entry only holds the faulty line number.
+///
+lexer_status_t lexer_next(lexer_t* lexer, entry_t* entry)
+{
+    const char* data = lexer->data ;
+    while (lexer->position < lexer->size) {
+        const size_t begin = lexer->position ;
+        const char* eol = memchr(data + begin, '\n', lexer->size - begin) ;
+        const size_t end = (eol == NULL) ? lexer->size : (size_t) (eol - data) ;
+        lexer->position = end + 1 ;
+        ++ lexer->line ;
+        entry->line = lexer->line ;
+
+        const token_t line = lexer_trim(data, begin, end) ;
+        const char first = (line.length > 0) ? data[line.offset] : '#' ;
+        if ((first == '#') || (first == ';'))
+            continue ;
+
+        if (first == '[') {
+            const char* close = memchr(data + line.offset, ']', line.length) ;
+            if (close == NULL)
+                return CARTEUR_LEXER_ERROR ;
+            lexer->section = lexer_trim(data, line.offset + 1, (size_t) (close - data)) ;
+            continue ;
+        }
+
+        const char* equal = memchr(data + line.offset, '=', line.length) ;
+        if (equal == NULL)
+            return CARTEUR_LEXER_ERROR ;
+        const size_t separator = (size_t) (equal - data) ;
+        size_t value_end = line.offset + line.length ;
+        for (const char* c = memchr(equal, ';', value_end - separator)
+            ; c != NULL
+            ; c = memchr(c + 1, ';', value_end - (size_t) (c + 1 - data))) {
+            if (character_is_blank(c[-1])) {
+                value_end = (size_t) (c - data) ;
+                break ;
+            }
+        }
+        entry->section = lexer->section ;
+        entry->name = lexer_trim(data, line.offset, separator) ;
+        entry->value = lexer_trim(data, separator + 1, value_end) ;
+        return CARTEUR_LEXER_ENTRY ;
+    }
+    return CARTEUR_LEXER_END ;
+}
+
+static bool token_equal(const char* data, const token_t token, const char* str)
+{
+    const size_t length = strlen(str) ;
+    return (token.length == length)
+        && (memcmp(data + token.offset, str, length) == 0) ;
+}
+
+///
+/// A machine declared in an INI section, to be composed with others. Its
+/// states are its own, whereas the events and callbacks are shared by all
+/// the machines of the file, so that machines react to the same events.
+///
+typedef struct component_t {
+    token_t name ;
+    symbol_table_t states ;
+    array_transition_t transitions ;
+    array_size_t start_states ;
+    array_size_t end_states ;
+} component_t ;
+
+ARRAY_DEF(array_component, component_t, M_POD_OPLIST)
+ARRAY_DEF(array_token, token_t, M_POD_OPLIST)
+
+///
+/// Information at stage 1. This contains symbol tables for the states,
+/// events and callback names, and a dynamic array of transitions. The input
+/// is kept to resolve tokens. Errors are written to log, and fatal ones set
+/// status to the exit code of the machine, which stops the parsing.
+///
+/// The states, transitions, start and end states of a section go to the
+/// component of that name instead, and compose lists the components to
+/// build the machine from, if any (see compose_machines).
 ///
 typedef struct parsing_stage_data_t {
     parameters_t* parameters ;
     //igraph_t graph ;
-    dict_string_t states ;
-    dict_string_t events ;
-    dict_string_t callbacks ;
+    buffer_t* log ;
+    int status ;
+    const char* input ;
+    symbol_table_t states ;
+    symbol_table_t events ;
+    symbol_table_t callbacks ;
     array_transition_t transitions ;
+    array_size_t start_states ;
+    array_size_t end_states ;
+    array_component_t components ;
+    array_token_t compose ;
 } parsing_stage_data_t ;
 
 ///
@@ -173,40 +854,28 @@ static bool character_in_identifier(const char c)
 }
 
 ///
-/// Parse a sequence of identifiers of the form [a-zA-Z0-9_]+, and call the
-/// provided callback for each token.
+/// Parse a sequence of identifiers of the form [a-zA-Z0-9_]+ in the given
+/// span of data, and call the provided callback for each token.
 ///
 static void parse_identifers
-    ( const char* str
-    , const size_t len
-    , void (*callback)(const char* token, void* userdata)
+    ( const char* data
+    , const token_t span
+    , void (*callback)(const char* data, token_t token, void* userdata)
     , void* userdata
     )
 {
-    char* copy = malloc((len+1)*sizeof(char)) ;
-    strncpy(copy, str, len+1) ;
-    size_t i = 0 ;
-    size_t start = i ;
-    size_t end = start ;
-    bool on_identifier = false ;
-    for (; i <= len; ++ i) {
-        if (character_in_identifier(copy[i])) {
-            if (! on_identifier) {
-                start = i ;
-            }
-            on_identifier = true ;
-            ++ end ;
-        } else {
-            copy[i] = '\0' ;
-            if (on_identifier) {
-                on_identifier = false ;
-                callback(&copy[start], userdata) ;
-            }
-            ++ start ;
-            ++ end ;
-        }
+    const size_t end = span.offset + span.length ;
+    size_t i = span.offset ;
+    while (i < end) {
+        while ((i < end) && ! character_in_identifier(data[i]))
+            ++ i ;
+        token_t token = { .offset = i, .length = 0 } ;
+        while ((i < end) && character_in_identifier(data[i]))
+            ++ i ;
+        token.length = i - token.offset ;
+        if (token.length > 0)
+            callback(data, token, userdata) ;
     }
-    free(copy) ;
 }
 
 enum uncomplete_transition_field {
@@ -219,381 +888,5241 @@ enum uncomplete_transition_field {
 typedef struct parser_transition_handler_data_t {
     struct transition_t* transition ;
     enum uncomplete_transition_field current_field ;
+    size_t n_tokens ;
     parsing_stage_data_t* machine ;
+    const symbol_table_t* declared ;
 } parser_transition_handler_data_t ;
 
 ///
 /// Fill an uncomplete transition with the given token.
 ///
 void parser_transition_handler
-    ( const char* token
+    ( const char* data
+    , const token_t token
     , void* userdata
     )
 {
-    size_t temp ;
-    size_t* pos ;
     parser_transition_handler_data_t* t =
         (parser_transition_handler_data_t*) userdata ;
-    string_t name ; // string_t version of token.
-    string_init_set_str(name, token) ;
+    if ((++ t->n_tokens > 4) || (t->machine->status != 0))
+        return ;
+    const char* name = data + token.offset ;
+    const size_t length = token.length ;
     switch (t->current_field) {
         case CARTEUR_TRANSITION_FIELD_FROM:
-            pos = dict_string_get(t->machine->states, name) ;
-            if (pos == NULL) {
-                // FIXME Improve error handling.
-                fprintf(stderr, "Reference to unknown state '%s'.\n", token) ;
-                exit(4) ;
+            if (! symbol_table_find(t->declared, name, length, &t->transition->from)) {
+                buffer_printf(t->machine->log, "Reference to unknown state '%.*s'.\n"
+                             , (int) length, name) ;
+                t->machine->status = 4 ;
+                return ;
             }
             //printf("From: %s (state #%zu)\n", token, *pos) ;
             t->current_field = CARTEUR_TRANSITION_FIELD_TO ;
-            t->transition->from = *pos ;
             break ;
         case CARTEUR_TRANSITION_FIELD_TO:
-            pos = dict_string_get(t->machine->states, name) ;
-            if (pos == NULL) {
-                // FIXME Improve error handling.
-                fprintf(stderr, "Reference to unknown state '%s'.\n", token) ;
-                exit(4) ;
+            if (! symbol_table_find(t->declared, name, length, &t->transition->to)) {
+                buffer_printf(t->machine->log, "Reference to unknown state '%.*s'.\n"
+                             , (int) length, name) ;
+                t->machine->status = 4 ;
+                return ;
             }
             //printf("To: %s (state #%zu)\n", token, *pos) ;
             t->current_field = CARTEUR_TRANSITION_FIELD_EVENT ;
-            t->transition->to = *pos ;
             break ;
         case CARTEUR_TRANSITION_FIELD_EVENT:
-            pos = dict_string_get(t->machine->events, name) ;
-            if (pos == NULL) {
-                size_t n = dict_string_size(t->machine->events) ;
-                dict_string_set_at(t->machine->events, name, n) ;
-                temp = n ;
-                pos = &temp ;
-            }
+            t->transition->event = symbol_table_intern(&t->machine->events, name, length) ;
             //printf("Event: %s\n", token) ;
             t->current_field = CARTEUR_TRANSITION_FIELD_CALLBACK ;
-            t->transition->event = *pos ;
             break ;
         case CARTEUR_TRANSITION_FIELD_CALLBACK:
-            pos = dict_string_get(t->machine->callbacks, name) ;
-            if (pos == NULL) {
-                size_t n = dict_string_size(t->machine->callbacks) ;
-                dict_string_set_at(t->machine->callbacks, name, n) ;
-                temp = n ;
-                pos = &temp ;
-            }
+            t->transition->callback = symbol_table_intern(&t->machine->callbacks, name, length) ;
             //printf("Callback: %s\n", token) ;
             t->current_field = CARTEUR_TRANSITION_FIELD_FROM ;
-            t->transition->callback = *pos ;
             break ;
     }
 }
 
+typedef struct parser_states_handler_data_t {
+    parsing_stage_data_t* machine ;
+    const symbol_table_t* declared ;
+    array_size_t* states ;
+} parser_states_handler_data_t ;
+
 ///
-/// General handler for the INI parser. This will distinguish names 'state'
-/// and 'transition'. On name 'state' it will add a state to the dictionnary.
-/// On name 'transition', it will check that the states exist, and, if they
-/// do, find or register the event and callback.
+/// Add the given (declared) state to a list of states.
 ///
-static int parser_handler
-    ( void* user
-    , const char* section
-    , const char* name
-    , const char* value
+void parser_states_handler
+    ( const char* data
+    , const token_t token
+    , void* userdata
     )
 {
-    transition_t transition ;
-    parsing_stage_data_t* machine = (parsing_stage_data_t*) user ;
-    parser_transition_handler_data_t todo =
-        { .transition = &transition[0]
-        , .current_field = CARTEUR_TRANSITION_FIELD_FROM
-        , .machine = machine
-        } ;
-
-    // Add state.
-    if (strcmp(name, "state") == 0) {
-        string_t value_copy ;
-        string_init_set_str(value_copy, value) ;
-        const size_t n = dict_string_size(machine->states) ;
-        dict_string_set_at(machine->states, value_copy, n) ;
-#if defined(CARTEUR_GRAPH_ANALYSIS)
-#endif
-    }
-
-    // Add transition.
-    else if (strcmp(name, "transition") == 0) {
-        parse_identifers(value, strlen(value), parser_transition_handler, &todo) ;
-        array_transition_push_back(machine->transitions, transition) ;
-#if defined(CARTEUR_GRAPH_ANALYSIS)
-        //igraph_add_edge(graph, from, to).
-#endif
+    parser_states_handler_data_t* t = (parser_states_handler_data_t*) userdata ;
+    if (t->machine->status != 0)
+        return ;
+    size_t state ;
+    if (! symbol_table_find(t->declared, data + token.offset, token.length, &state)) {
+        buffer_printf(t->machine->log, "Reference to unknown state '%.*s'.\n"
+                     , (int) token.length, data + token.offset) ;
+        t->machine->status = 4 ;
+        return ;
     }
+    array_size_push_back(*t->states, state) ;
+}
 
-    // Parameters.
-    else if (strcmp(name, "declare_states") == 0) {
-        if (strcmp(value, CARTEUR_INI_TRUE) == 0)
-            machine->parameters->declare_states = true ;
-        else if (strcmp(value, CARTEUR_INI_FALSE) == 0)
-            machine->parameters->declare_states = false ;
-        //else
-        //    error
-    }
+///
+/// Add the given machine to the list of the machines to compose.
+///
+void parser_compose_handler
+    ( const char* data
+    , const token_t token
+    , void* userdata
+    )
+{
+    (void) data ;
+    parsing_stage_data_t* machine = (parsing_stage_data_t*) userdata ;
+    array_token_push_back(machine->compose, token) ;
+}
 
-    else if (strcmp(name, "declare_events") == 0) {
-        if (strcmp(value, CARTEUR_INI_TRUE) == 0)
-            machine->parameters->declare_events = true ;
-        else if (strcmp(value, CARTEUR_INI_FALSE) == 0)
-            machine->parameters->declare_events = false ;
-        // else
-        //    error
-    }
+static bool token_same(const char* data, const token_t a, const token_t b)
+{
+    return (a.length == b.length)
+        && (memcmp(data + a.offset, data + b.offset, a.length) == 0) ;
+}
 
-    else if (strcmp(name, "machine_name") == 0) {
-        string_t copy ;
-        string_init_set(copy, value) ;
-        free(machine->parameters->machine_name) ;
-        machine->parameters->machine_name = string_clear_get_str(copy) ;
+///
+/// The component of the given section, which is added if it was not known
+/// yet, or NULL outside of any section.
+///
+static component_t* parser_component(parsing_stage_data_t* machine, const token_t section)
+{
+    if (section.length == 0)
+        return NULL ;
+    const size_t n_components = array_component_size(machine->components) ;
+    for (size_t c = 0; c < n_components; ++ c) {
+        component_t* component = array_component_get(machine->components, c) ;
+        if (token_same(machine->input, component->name, section))
+            return component ;
     }
+    component_t component ;
+    component.name = section ;
+    symbol_table_init(&component.states, machine->states.arena) ;
+    array_transition_init(component.transitions) ;
+    array_size_init(component.start_states) ;
+    array_size_init(component.end_states) ;
+    array_component_push_back(machine->components, component) ;
+    return array_component_get(machine->components, n_components) ;
+}
 
-    else if (strcmp(name, "states_enum_name") == 0) {
-        string_t copy ;
-        string_init_set(copy, value) ;
-        free(machine->parameters->states_enum_name) ;
-        machine->parameters->states_enum_name = string_clear_get_str(copy) ;
+///
+/// Parse a 'true' or 'false' value into flag. Return false on other values.
+///
+static bool parser_boolean(const char* data, const token_t value, bool* flag)
+{
+    if (token_equal(data, value, CARTEUR_INI_TRUE))
+        *flag = true ;
+    else if (token_equal(data, value, CARTEUR_INI_FALSE))
+        *flag = false ;
+    else
+        return false ;
+    return true ;
+}
+
+///
+/// Parse a positive decimal value into number. Return false on other values.
+///
+static bool parser_positive(const char* data, const token_t value, size_t* number)
+{
+    size_t result = 0 ;
+    for (size_t i = 0; i < value.length; ++ i) {
+        const char c = data[value.offset + i] ;
+        if ((c < '0') || (c > '9') || (result > (SIZE_MAX - 9) / 10))
+            return false ;
+        result = 10 * result + (size_t) (c - '0') ;
+    }
+    if (result == 0)
+        return false ;
+    *number = result ;
+    return true ;
+}
+
+///
+/// Replace a parameter string with a copy of the value.
+///
+static void parser_string(const char* data, const token_t value, char** str)
+{
+    string_t copy ;
+    string_init(copy) ;
+    string_set_strn(copy, data + value.offset, value.length) ;
+    free(*str) ;
+    *str = string_clear_get_str(copy) ;
+}
+
+///
+/// General handler for the entries. This will distinguish names 'state'
+/// and 'transition'. On name 'state' it will add a state to the dictionnary.
+/// On name 'transition', it will check that the states exist, and, if they
+/// do, find or register the event and callback.
+///
+static int parser_handler
+    ( parsing_stage_data_t* machine
+    , const entry_t* entry
+    )
+{
+    const char* data = machine->input ;
+    const token_t name = entry->name ;
+    const token_t value = entry->value ;
+    transition_t transition ;
+    parser_transition_handler_data_t todo =
+        { .transition = &transition[0]
+        , .current_field = CARTEUR_TRANSITION_FIELD_FROM
+        , .n_tokens = 0
+        , .machine = machine
+        , .declared = &machine->states
+        } ;
+    const bool structural = token_equal(data, name, "state")
+                         || token_equal(data, name, "transition")
+                         || token_equal(data, name, "start")
+                         || token_equal(data, name, "end") ;
+    component_t* component = structural ? parser_component(machine, entry->section) : NULL ;
+    symbol_table_t* states = (component != NULL) ? &component->states : &machine->states ;
+    todo.declared = states ;
+
+    // Add state.
+    if (token_equal(data, name, "state")) {
+        symbol_table_intern(states, data + value.offset, value.length) ;
+#if defined(CARTEUR_GRAPH_ANALYSIS)
+#endif
+    }
+
+    // Add transition.
+    else if (token_equal(data, name, "transition")) {
+        parse_identifers(data, value, parser_transition_handler, &todo) ;
+        if (machine->status != 0)
+            return 1 ;
+        if (todo.n_tokens != 4)
+            return 0 ;
+        transition->count = 0 ;
+        array_transition_push_back((component != NULL) ? component->transitions
+                                                       : machine->transitions, transition) ;
+#if defined(CARTEUR_GRAPH_ANALYSIS)
+        //igraph_add_edge(graph, from, to).
+#endif
+    }
+
+    // Add start or end states.
+    else if (token_equal(data, name, "start") || token_equal(data, name, "end")) {
+        const bool start = token_equal(data, name, "start") ;
+        parser_states_handler_data_t list =
+            { .machine = machine
+            , .declared = states
+            } ;
+        if (component != NULL)
+            list.states = start ? &component->start_states : &component->end_states ;
+        else
+            list.states = start ? &machine->start_states : &machine->end_states ;
+        parse_identifers(data, value, parser_states_handler, &list) ;
+    }
+
+    // Machines to compose.
+    else if (token_equal(data, name, "compose")) {
+        parse_identifers(data, value, parser_compose_handler, machine) ;
+    }
+
+    // Parameters.
+    else if (token_equal(data, name, "declare_states")) {
+        return parser_boolean(data, value, &machine->parameters->declare_states) ;
+    }
+
+    else if (token_equal(data, name, "declare_events")) {
+        return parser_boolean(data, value, &machine->parameters->declare_events) ;
+    }
+
+    else if (token_equal(data, name, "batch")) {
+        return parser_boolean(data, value, &machine->parameters->batch) ;
+    }
+
+    else if (token_equal(data, name, "broadcast")) {
+        return parser_boolean(data, value, &machine->parameters->broadcast) ;
+    }
+
+    else if (token_equal(data, name, "packed")) {
+        return parser_boolean(data, value, &machine->parameters->packed) ;
+    }
+
+    else if (token_equal(data, name, "run")) {
+        return parser_boolean(data, value, &machine->parameters->run) ;
+    }
+
+    else if (token_equal(data, name, "from_string")) {
+        return parser_boolean(data, value, &machine->parameters->from_string) ;
+    }
+
+    else if (token_equal(data, name, "enabled_events")) {
+        return parser_boolean(data, value, &machine->parameters->enabled_events) ;
+    }
+
+    else if (token_equal(data, name, "atomic")) {
+        return parser_boolean(data, value, &machine->parameters->atomic) ;
+    }
+
+    else if (token_equal(data, name, "atomic_benchmark")) {
+        return parser_boolean(data, value, &machine->parameters->atomic_benchmark) ;
+    }
+
+    else if (token_equal(data, name, "minimise")) {
+        return parser_boolean(data, value, &machine->parameters->minimise) ;
+    }
+
+    else if (token_equal(data, name, "state_aliases")) {
+        return parser_boolean(data, value, &machine->parameters->state_aliases) ;
+    }
+
+    else if (token_equal(data, name, "instrument")) {
+        return parser_boolean(data, value, &machine->parameters->instrument) ;
+    }
+
+    else if (token_equal(data, name, "profile")) {
+        parser_string(data, value, &machine->parameters->profile) ;
+    }
+
+    else if (token_equal(data, name, "language")) {
+        if (token_equal(data, value, CARTEUR_INI_LANGUAGE_C))
+            machine->parameters->language = CARTEUR_LANGUAGE_C ;
+        else if (token_equal(data, value, CARTEUR_INI_LANGUAGE_CPP))
+            machine->parameters->language = CARTEUR_LANGUAGE_CPP ;
+        else if (token_equal(data, value, CARTEUR_INI_LANGUAGE_BINARY))
+            machine->parameters->language = CARTEUR_LANGUAGE_BINARY ;
+        else
+            return 0 ;
+    }
+
+    else if (token_equal(data, name, "backend")) {
+        if (token_equal(data, value, CARTEUR_INI_BACKEND_SWITCH))
+            machine->parameters->backend = CARTEUR_BACKEND_SWITCH ;
+        else if (token_equal(data, value, CARTEUR_INI_BACKEND_TABLE))
+            machine->parameters->backend = CARTEUR_BACKEND_TABLE ;
+        else if (token_equal(data, value, CARTEUR_INI_BACKEND_DENSE))
+            machine->parameters->backend = CARTEUR_BACKEND_DENSE ;
+        else if (token_equal(data, value, CARTEUR_INI_BACKEND_COMPRESSED))
+            machine->parameters->backend = CARTEUR_BACKEND_COMPRESSED ;
+        else
+            return 0 ;
+    }
+
+    else if (token_equal(data, name, "source_shards")) {
+        return parser_positive(data, value, &machine->parameters->source_shards) ;
+    }
+
+    else if (token_equal(data, name, "machine_name")) {
+        parser_string(data, value, &machine->parameters->machine_name) ;
+    }
+
+    else if (token_equal(data, name, "states_enum_name")) {
+        parser_string(data, value, &machine->parameters->states_enum_name) ;
+    }
+
+    else if (token_equal(data, name, "events_enum_name")) {
+        parser_string(data, value, &machine->parameters->events_enum_name) ;
+    }
+
+    // Unknown name, error in the file.
+    else {
+        return 0 ;  /* unknown section/name, error */
+    }
+
+    return 1 ;
+}
+
+///
+/// Run the whole stage 1 on an input. Faulty lines are reported and skipped,
+/// and the parsing stops at the first fatal error. Return the number of
+/// faulty lines.
+///
+size_t parse_input(parsing_stage_data_t* machine, const input_t* input)
+{
+    size_t n_errors = 0 ;
+    lexer_t lexer ;
+    entry_t entry ;
+    lexer_status_t status ;
+    lexer_init(&lexer, input->data, 0, input->size) ;
+    machine->input = input->data ;
+    while ((machine->status == 0)
+           && ((status = lexer_next(&lexer, &entry)) != CARTEUR_LEXER_END)) {
+        if ((status == CARTEUR_LEXER_ERROR) || ! parser_handler(machine, &entry)) {
+            buffer_printf(machine->log, "Line %zu: invalid entry.\n", entry.line) ;
+            ++ n_errors ;
+        }
+    }
+    return n_errors ;
+}
+
+///
+/// Parallel parsing. The input is split at line boundaries into one chunk
+/// per job, and runs in three steps:
+/// 1. workers lex their chunk, tokenize the transitions, and number events
+///    and callbacks in their own symbol tables. Other entries are kept aside.
+/// 2. the other entries are replayed in order through parser_handler, which
+///    declares the states and sets the parameters. The events and callbacks
+///    of each chunk are then renumbered, in chunk order.
+/// 3. workers resolve the states of their transitions, a state having to be
+///    declared before the transition line, as in a sequential run.
+/// Since chunks are merged in order at each step, names get the same
+/// identifiers, transitions come in the same order, and errors are reported
+/// the same way as in a sequential run. Inputs with sections, that is with
+/// machines to compose, are parsed sequentially after step 1.
+///
+typedef struct pending_transition_t {
+    size_t offset ;
+    size_t line ;
+    size_t n_tokens ;
+    token_t from ;
+    token_t to ;
+    size_t event ;
+    size_t callback ;
+} pending_transition_t ;
+
+ARRAY_DEF(array_pending_transition, pending_transition_t, M_POD_OPLIST)
+ARRAY_DEF(array_entry, entry_t, M_POD_OPLIST)
+
+typedef struct parse_chunk_t {
+    const char* data ;
+    size_t begin ;
+    size_t end ;
+    size_t first_line ;
+    size_t n_lines ;
+    // Step 1.
+    arena_t names ;
+    symbol_table_t events ;
+    symbol_table_t callbacks ;
+    array_entry_t entries ;
+    array_pending_transition_t pending ;
+    array_size_t errors ;
+    bool sections ;
+    // Step 3.
+    const symbol_table_t* states ;
+    const size_t* state_offsets ;
+    size_t* event_ids ;
+    size_t* callback_ids ;
+    array_transition_t transitions ;
+    size_t fatal_line ;
+    token_t fatal_token ;
+} parse_chunk_t ;
+
+#define CARTEUR_PARALLEL_PARSE_MIN_SIZE ((size_t) 1 << 16)
+
+typedef struct parse_chunk_token_data_t {
+    parse_chunk_t* chunk ;
+    pending_transition_t* transition ;
+} parse_chunk_token_data_t ;
+
+///
+/// Fill a pending transition with the given token.
+///
+static void parse_chunk_token
+    ( const char* data
+    , const token_t token
+    , void* userdata
+    )
+{
+    parse_chunk_token_data_t* t = (parse_chunk_token_data_t*) userdata ;
+    pending_transition_t* transition = t->transition ;
+    switch (++ transition->n_tokens) {
+    case 1:
+        transition->from = token ;
+        break ;
+    case 2:
+        transition->to = token ;
+        break ;
+    case 3:
+        transition->event = symbol_table_intern(&t->chunk->events
+                                               , data + token.offset, token.length) ;
+        break ;
+    case 4:
+        transition->callback = symbol_table_intern(&t->chunk->callbacks
+                                                  , data + token.offset, token.length) ;
+        break ;
+    default:
+        break ;
+    }
+}
+
+///
+/// Step 1, run by workers.
+///
+static void* parse_chunk_tokenize(void* userdata)
+{
+    parse_chunk_t* chunk = (parse_chunk_t*) userdata ;
+    const char* data = chunk->data ;
+    lexer_t lexer ;
+    entry_t entry ;
+    lexer_status_t status ;
+    lexer_init(&lexer, data, chunk->begin, chunk->end) ;
+    while ((status = lexer_next(&lexer, &entry)) != CARTEUR_LEXER_END) {
+        chunk->sections = chunk->sections || (lexer.section.length > 0) ;
+        if (status == CARTEUR_LEXER_ERROR) {
+            array_size_push_back(chunk->errors, entry.line) ;
+        } else if (token_equal(data, entry.name, "transition")) {
+            pending_transition_t transition =
+                { .offset = entry.name.offset
+                , .line = entry.line
+                , .n_tokens = 0
+                } ;
+            parse_chunk_token_data_t todo =
+                { .chunk = chunk
+                , .transition = &transition
+                } ;
+            parse_identifers(data, entry.value, parse_chunk_token, &todo) ;
+            array_pending_transition_push_back(chunk->pending, transition) ;
+        } else {
+            array_entry_push_back(chunk->entries, entry) ;
+        }
+    }
+    chunk->n_lines = lexer.line ;
+    return NULL ;
+}
+
+static bool parse_chunk_state
+    ( parse_chunk_t* chunk
+    , const pending_transition_t* transition
+    , const token_t token
+    , size_t* state
+    )
+{
+    if (symbol_table_find(chunk->states, chunk->data + token.offset, token.length, state)
+        && (chunk->state_offsets[*state] < transition->offset))
+        return true ;
+    chunk->fatal_line = transition->line ;
+    chunk->fatal_token = token ;
+    return false ;
+}
+
+///
+/// Step 3, run by workers.
+///
+static void* parse_chunk_resolve(void* userdata)
+{
+    parse_chunk_t* chunk = (parse_chunk_t*) userdata ;
+    const size_t n = array_pending_transition_size(chunk->pending) ;
+    for (size_t i = 0; i < n; ++ i) {
+        const pending_transition_t* pending =
+            array_pending_transition_cget(chunk->pending, i) ;
+        transition_t transition ;
+        if ((pending->n_tokens >= 1)
+            && ! parse_chunk_state(chunk, pending, pending->from, &transition->from))
+            break ;
+        if ((pending->n_tokens >= 2)
+            && ! parse_chunk_state(chunk, pending, pending->to, &transition->to))
+            break ;
+        if (pending->n_tokens != 4) {
+            array_size_push_back(chunk->errors, pending->line) ;
+            continue ;
+        }
+        transition->event = chunk->event_ids[pending->event] ;
+        transition->callback = chunk->callback_ids[pending->callback] ;
+        transition->count = 0 ;
+        array_transition_push_back(chunk->transitions, transition) ;
+    }
+    return NULL ;
+}
+
+///
+/// Run step on n_tasks tasks stored task_size bytes apart, the first one on
+/// the calling thread and the others on threads of their own.
+///
+static void threads_run
+    ( void* tasks
+    , const size_t task_size
+    , const size_t n_tasks
+    , void* (*step)(void*)
+    )
+{
+    char* task = (char*) tasks ;
+    pthread_t* threads = malloc(n_tasks * sizeof(pthread_t)) ;
+    for (size_t t = 1; t < n_tasks; ++ t) {
+        if (pthread_create(&threads[t], NULL, step, task + t * task_size) != 0) {
+            // Do it ourselves.
+            step(task + t * task_size) ;
+            threads[t] = pthread_self() ;
+        }
+    }
+    if (n_tasks > 0)
+        step(task) ;
+    for (size_t t = 1; t < n_tasks; ++ t) {
+        if (! pthread_equal(threads[t], pthread_self()))
+            pthread_join(threads[t], NULL) ;
+    }
+    free(threads) ;
+}
+
+static int size_cmp_qsort(const void* a, const void* b)
+{
+    const size_t sa = *(const size_t*) a ;
+    const size_t sb = *(const size_t*) b ;
+    return (sa > sb) - (sa < sb) ;
+}
+
+///
+/// Run the whole stage 1 on an input, with the given number of jobs. Small
+/// inputs are parsed sequentially.
+///
+size_t parse_input_parallel
+    ( parsing_stage_data_t* machine
+    , const input_t* input
+    , const size_t jobs
+    )
+{
+    if ((jobs <= 1) || (input->size < CARTEUR_PARALLEL_PARSE_MIN_SIZE))
+        return parse_input(machine, input) ;
+
+    const char* data = input->data ;
+    machine->input = data ;
+    parse_chunk_t* chunks = calloc(jobs, sizeof(parse_chunk_t)) ;
+    size_t begin = 0 ;
+    for (size_t c = 0; c < jobs; ++ c) {
+        parse_chunk_t* chunk = &chunks[c] ;
+        size_t end = (c + 1 == jobs) ? input->size : (input->size / jobs) * (c + 1) ;
+        if (end < begin)
+            end = begin ;
+        const char* eol = memchr(data + end, '\n', input->size - end) ;
+        end = ((eol == NULL) || (c + 1 == jobs)) ? input->size : (size_t) (eol - data) + 1 ;
+        chunk->data = data ;
+        chunk->begin = begin ;
+        chunk->end = end ;
+        chunk->fatal_line = SIZE_MAX ;
+        chunk->states = &machine->states ;
+        arena_init(&chunk->names) ;
+        symbol_table_init(&chunk->events, &chunk->names) ;
+        symbol_table_init(&chunk->callbacks, &chunk->names) ;
+        array_entry_init(chunk->entries) ;
+        array_pending_transition_init(chunk->pending) ;
+        array_size_init(chunk->errors) ;
+        array_transition_init(chunk->transitions) ;
+        begin = end ;
+    }
+
+    // Step 1.
+    threads_run(chunks, sizeof(parse_chunk_t), jobs, parse_chunk_tokenize) ;
+    bool sections = false ;
+    for (size_t c = 0; c < jobs; ++ c) {
+        sections = sections || chunks[c].sections ;
+    }
+    if (sections) {
+        for (size_t c = 0; c < jobs; ++ c) {
+            parse_chunk_t* chunk = &chunks[c] ;
+            symbol_table_clear(&chunk->events) ;
+            symbol_table_clear(&chunk->callbacks) ;
+            arena_clear(&chunk->names) ;
+            array_entry_clear(chunk->entries) ;
+            array_pending_transition_clear(chunk->pending) ;
+            array_size_clear(chunk->errors) ;
+            array_transition_clear(chunk->transitions) ;
+        }
+        free(chunks) ;
+        return parse_input(machine, input) ;
+    }
+
+    // Step 2.
+    array_size_t state_offsets ;
+    array_size_init(state_offsets) ;
+    size_t first_line = 0 ;
+    for (size_t c = 0; c < jobs; ++ c) {
+        parse_chunk_t* chunk = &chunks[c] ;
+        chunk->first_line = first_line ;
+        first_line += chunk->n_lines ;
+        const size_t n_entries = array_entry_size(chunk->entries) ;
+        for (size_t i = 0; i < n_entries; ++ i) {
+            const entry_t* entry = array_entry_cget(chunk->entries, i) ;
+            if (! parser_handler(machine, entry))
+                array_size_push_back(chunk->errors, entry->line) ;
+            if (array_size_size(state_offsets) < symbol_table_size(&machine->states))
+                array_size_push_back(state_offsets, entry->name.offset) ;
+        }
+        const size_t n_events = symbol_table_size(&chunk->events) ;
+        const size_t n_callbacks = symbol_table_size(&chunk->callbacks) ;
+        chunk->event_ids = malloc(n_events * sizeof(size_t)) ;
+        chunk->callback_ids = malloc(n_callbacks * sizeof(size_t)) ;
+        for (size_t i = 0; i < n_events; ++ i) {
+            chunk->event_ids[i] = symbol_table_adopt(&machine->events
+                                                    , *array_cstr_get(chunk->events.names, i)) ;
+        }
+        for (size_t i = 0; i < n_callbacks; ++ i) {
+            chunk->callback_ids[i] = symbol_table_adopt(&machine->callbacks
+                                                       , *array_cstr_get(chunk->callbacks.names, i)) ;
+        }
+        symbol_table_clear(&chunk->events) ;
+        symbol_table_clear(&chunk->callbacks) ;
+        arena_adopt(machine->events.arena, &chunk->names) ;
+    }
+    for (size_t c = 0; c < jobs; ++ c) {
+        chunks[c].state_offsets = (array_size_size(state_offsets) > 0)
+                                ? array_size_get(state_offsets, 0) : NULL ;
+    }
+
+    // Step 3.
+    threads_run(chunks, sizeof(parse_chunk_t), jobs, parse_chunk_resolve) ;
+
+    // Merge, and report errors up to the first fatal one.
+    size_t n_errors = 0 ;
+    for (size_t c = 0; c < jobs; ++ c) {
+        parse_chunk_t* chunk = &chunks[c] ;
+        if (! array_size_empty_p(chunk->errors)) {
+            qsort(array_size_get(chunk->errors, 0), array_size_size(chunk->errors)
+                 , sizeof(size_t), size_cmp_qsort) ;
+        }
+        for (size_t i = 0; i < array_size_size(chunk->errors); ++ i) {
+            const size_t line = *array_size_get(chunk->errors, i) ;
+            if (line > chunk->fatal_line)
+                break ;
+            buffer_printf(machine->log, "Line %zu: invalid entry.\n"
+                         , chunk->first_line + line) ;
+            ++ n_errors ;
+        }
+        if (chunk->fatal_line != SIZE_MAX) {
+            buffer_printf(machine->log, "Reference to unknown state '%.*s'.\n"
+                         , (int) chunk->fatal_token.length
+                         , data + chunk->fatal_token.offset) ;
+            machine->status = 4 ;
+            break ;
+        }
+        for (size_t i = 0; i < array_transition_size(chunk->transitions); ++ i) {
+            array_transition_push_back(machine->transitions
+                                      , *array_transition_get(chunk->transitions, i)) ;
+        }
+    }
+
+    for (size_t c = 0; c < jobs; ++ c) {
+        parse_chunk_t* chunk = &chunks[c] ;
+        array_entry_clear(chunk->entries) ;
+        array_pending_transition_clear(chunk->pending) ;
+        array_size_clear(chunk->errors) ;
+        array_transition_clear(chunk->transitions) ;
+        free(chunk->event_ids) ;
+        free(chunk->callback_ids) ;
+    }
+    array_size_clear(state_offsets) ;
+    free(chunks) ;
+    return n_errors ;
+}
+
+// ................................................................... STAGE 2
+
+///
+/// Contains dull stores for states, events and callbacks names. This time,
+/// the mapping is from integer to string. The names themselves live in the
+/// arena they were interned in during stage 1.
+///
+/// This is for stage 3, but the goal of stage 2 is precisely to change the
+/// representation from stage 1 to the one in stage 3.
+///
+/// Transitions are grouped by event, in declaration order within a group.
+/// The transitions of event e are those in [event_offsets[e],
+/// event_offsets[e + 1]). The same goes for states, except that state_index
+/// holds positions in the transitions array rather than transitions, so that
+/// both views share the same storage. Each state row is sorted by event.
+///
+/// States merged by the minimisation keep their name in state_aliases, the
+/// state they were merged into being at the same index in
+/// state_alias_targets.
+///
+/// The start and end states, if any, are kept up to date by the passes that
+/// renumber the states. The profile total is the sum of the counts of the
+/// transitions, 0 without a profile.
+///
+/// The callbacks of a composed machine may run several callbacks of its
+/// components in a row: callback c runs the callbacks in callback_parts,
+/// from callback_part_offsets[c] to callback_part_offsets[c + 1] excluded.
+/// The callbacks of the components, which the user provides, are their own
+/// single part. Both are empty for other machines.
+///
+typedef struct generation_stage_data_t {
+    parameters_t* parameters ;
+    buffer_t* log ;
+    array_cstr_t states ;
+    array_cstr_t events ;
+    array_cstr_t callbacks ;
+    array_transition_t transitions ;
+    array_size_t event_offsets ;
+    array_size_t state_offsets ;
+    array_size_t state_index ;
+    array_cstr_t state_aliases ;
+    array_size_t state_alias_targets ;
+    array_size_t start_states ;
+    array_size_t end_states ;
+    array_size_t callback_part_offsets ;
+    array_size_t callback_parts ;
+    uint64_t profile_total ;
+} generation_stage_data_t ;
+
+///
+/// Counting sort of the transitions by event, then build the per-event and
+/// per-state offsets. IDs are dense, so this is linear and, unlike qsort,
+/// keeps the declaration order among transitions of the same event. Passes
+/// that rewrite the transitions must call it again.
+///
+void generation_index(generation_stage_data_t* generation)
+{
+    const size_t n_states = array_cstr_size(generation->states) ;
+    const size_t n_events = array_cstr_size(generation->events) ;
+    const size_t n_transitions = array_transition_size(generation->transitions) ;
+
+    // Events.
+    array_size_reset(generation->event_offsets) ;
+    array_size_resize(generation->event_offsets, n_events + 1) ;
+    size_t* event_offsets = array_size_get(generation->event_offsets, 0) ;
+    for (size_t i = 0; i <= n_events; ++ i) {
+        event_offsets[i] = 0 ;
+    }
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        ++ event_offsets[(*array_transition_cget(generation->transitions, i))->event + 1] ;
+    }
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        event_offsets[ev + 1] += event_offsets[ev] ;
+    }
+    array_transition_t sorted ;
+    array_transition_init(sorted) ;
+    array_transition_resize(sorted, n_transitions) ;
+    size_t* fill = calloc(n_events + 1, sizeof(size_t)) ;
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        const transition_t* ref = array_transition_cget(generation->transitions, i) ;
+        const size_t ev = (*ref)->event ;
+        transition_init_set(*array_transition_get(sorted, event_offsets[ev] + fill[ev] ++), *ref) ;
+    }
+    free(fill) ;
+    array_transition_swap(sorted, generation->transitions) ;
+    array_transition_clear(sorted) ;
+
+    // States. Walking the transitions in event order keeps rows sorted.
+    array_size_reset(generation->state_offsets) ;
+    array_size_resize(generation->state_offsets, n_states + 1) ;
+    array_size_reset(generation->state_index) ;
+    array_size_resize(generation->state_index, n_transitions) ;
+    size_t* state_offsets = array_size_get(generation->state_offsets, 0) ;
+    size_t* state_index = (n_transitions > 0)
+                        ? array_size_get(generation->state_index, 0) : NULL ;
+    for (size_t i = 0; i <= n_states; ++ i) {
+        state_offsets[i] = 0 ;
+    }
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        ++ state_offsets[(*array_transition_cget(generation->transitions, i))->from + 1] ;
+    }
+    for (size_t s = 0; s < n_states; ++ s) {
+        state_offsets[s + 1] += state_offsets[s] ;
+    }
+    fill = calloc(n_states + 1, sizeof(size_t)) ;
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        const size_t from = (*array_transition_cget(generation->transitions, i))->from ;
+        state_index[state_offsets[from] + fill[from] ++] = i ;
+    }
+    free(fill) ;
+}
+
+///
+/// Report the pairs (state, event) having several transitions. All the
+/// backends keep the first one, so this is a warning, given once here
+/// rather than by each of them.
+///
+static void report_duplicate_pairs(generation_stage_data_t* generation)
+{
+    const size_t n_states = array_cstr_size(generation->states) ;
+    const size_t n_events = array_cstr_size(generation->events) ;
+    const size_t* event_offsets = array_size_cget(generation->event_offsets, 0) ;
+    size_t* last_event = calloc(n_states + 1, sizeof(size_t)) ;
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        for (size_t i = event_offsets[ev]; i < event_offsets[ev + 1]; ++ i) {
+            const size_t from = (*array_transition_cget(generation->transitions, i))->from ;
+            if (last_event[from] == ev + 1)
+                buffer_printf(generation->log, "Transition from '%s' on '%s' is declared twice, "
+                        "keeping the first one.\n"
+                        , *array_cstr_get(generation->states, from)
+                        , *array_cstr_get(generation->events, ev)) ;
+            last_event[from] = ev + 1 ;
+        }
+    }
+    free(last_event) ;
+}
+
+///
+/// Position of the first transition from state on event, or SIZE_MAX. The
+/// index must be up to date.
+///
+static size_t transition_find
+    ( const generation_stage_data_t* generation
+    , const size_t state
+    , const size_t event
+    )
+{
+    const size_t* state_offsets = array_size_cget(generation->state_offsets, 0) ;
+    size_t low = state_offsets[state] ;
+    size_t high = state_offsets[state + 1] ;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2 ;
+        const size_t i = *array_size_cget(generation->state_index, middle) ;
+        if ((*array_transition_cget(generation->transitions, i))->event < event)
+            low = middle + 1 ;
+        else
+            high = middle ;
+    }
+    if (low == state_offsets[state + 1])
+        return SIZE_MAX ;
+    const size_t i = *array_size_cget(generation->state_index, low) ;
+    return ((*array_transition_cget(generation->transitions, i))->event == event) ? i : SIZE_MAX ;
+}
+
+///
+/// Bumped whenever the generated code changes for a same machine, so that
+/// the outputs cached with an older carteur are not kept.
+///
+#define CARTEUR_GENERATOR_VERSION 1
+
+///
+/// Number of names listed in the reports, the others are only counted.
+///
+#define CARTEUR_REPORT_NAMES 8
+
+static uint64_t hash_size(const uint64_t hash, const size_t value)
+{
+    // Byte by byte, so that the hash does not depend on the endianness.
+    unsigned char bytes[8] ;
+    for (size_t i = 0; i < 8; ++ i) {
+        bytes[i] = (unsigned char) ((uint64_t) value >> (8 * i)) ;
+    }
+    return fnv1a(hash, bytes, sizeof(bytes)) ;
+}
+
+static uint64_t hash_name(const uint64_t hash, const char* name)
+{
+    // With the terminator, so that ("ab", "c") and ("a", "bc") differ.
+    return fnv1a(hash, name, strlen(name) + 1) ;
+}
+
+static uint64_t hash_names(uint64_t hash, array_cstr_t names)
+{
+    hash = hash_size(hash, array_cstr_size(names)) ;
+    for (size_t i = 0; i < array_cstr_size(names); ++ i) {
+        hash = hash_name(hash, *array_cstr_get(names, i)) ;
+    }
+    return hash ;
+}
+
+///
+/// Write the number of flagged names, then the first few of them.
+///
+static void report_names
+    ( buffer_t* log
+    , const char* machine_name
+    , const char* what
+    , array_cstr_t names
+    , const bool* flagged
+    )
+{
+    const size_t n_names = array_cstr_size(names) ;
+    size_t n_flagged = 0 ;
+    for (size_t i = 0; i < n_names; ++ i) {
+        n_flagged += flagged[i] ;
+    }
+    if (n_flagged == 0)
+        return ;
+    buffer_printf(log, "Machine '%s': %zu %s:", machine_name, n_flagged, what) ;
+    size_t n_listed = 0 ;
+    for (size_t i = 0; (i < n_names) && (n_listed < CARTEUR_REPORT_NAMES); ++ i) {
+        if (! flagged[i])
+            continue ;
+        buffer_printf(log, "%s %s", (n_listed ++ > 0) ? "," : "", *array_cstr_cget(names, i)) ;
+    }
+    if (n_flagged > n_listed)
+        buffer_printf(log, " and %zu more", n_flagged - n_listed) ;
+    buffer_puts(log, ".\n") ;
+}
+
+///
+/// Keep the names whose new ID is not SIZE_MAX, in order.
+///
+static void names_renumber(array_cstr_t names, const size_t* new_id)
+{
+    size_t n_kept = 0 ;
+    for (size_t i = 0; i < array_cstr_size(names); ++ i) {
+        if (new_id[i] != SIZE_MAX)
+            *array_cstr_get(names, n_kept ++) = *array_cstr_get(names, i) ;
+    }
+    array_cstr_resize(names, n_kept) ;
+}
+
+///
+/// States of a product of machines, as tuples of states of the components,
+/// stored one after the other. Slots is an open-addressing hash table of
+/// identifiers + 1, as in the symbol tables.
+///
+typedef struct product_t {
+    size_t n_components ;
+    array_size_t tuples ;
+    size_t* slots ;
+    size_t capacity ;
+} product_t ;
+
+static void product_init(product_t* product, const size_t n_components)
+{
+    product->n_components = n_components ;
+    array_size_init(product->tuples) ;
+    product->capacity = CARTEUR_SYMBOL_TABLE_MIN_CAPACITY ;
+    product->slots = calloc(product->capacity, sizeof(size_t)) ;
+}
+
+static void product_clear(product_t* product)
+{
+    array_size_clear(product->tuples) ;
+    free(product->slots) ;
+}
+
+static size_t product_size(const product_t* product)
+{
+    return array_size_size(product->tuples) / product->n_components ;
+}
+
+static const size_t* product_tuple(const product_t* product, const size_t state)
+{
+    return array_size_cget(product->tuples, state * product->n_components) ;
+}
+
+static size_t* product_slot(const product_t* product, const size_t* tuple)
+{
+    const size_t tuple_size = product->n_components * sizeof(size_t) ;
+    const size_t mask = product->capacity - 1 ;
+    for (size_t i = fnv1a(CARTEUR_FNV_OFFSET, tuple, tuple_size) & mask; ; i = (i + 1) & mask) {
+        size_t* slot = &product->slots[i] ;
+        if ((*slot == 0) || (memcmp(product_tuple(product, *slot - 1), tuple, tuple_size) == 0))
+            return slot ;
+    }
+}
+
+///
+/// Identifier of a tuple, which is added if it was not known yet. The tuple
+/// must not lie in the product itself.
+///
+static size_t product_add(product_t* product, const size_t* tuple)
+{
+    size_t* slot = product_slot(product, tuple) ;
+    if (*slot != 0)
+        return *slot - 1 ;
+    for (size_t c = 0; c < product->n_components; ++ c) {
+        array_size_push_back(product->tuples, tuple[c]) ;
+    }
+    const size_t n = product_size(product) ;
+    *slot = n ;
+
+    // Keep the load factor under 1/2.
+    if (2 * n > product->capacity) {
+        free(product->slots) ;
+        product->capacity *= 2 ;
+        product->slots = calloc(product->capacity, sizeof(size_t)) ;
+        for (size_t s = 0; s < n; ++ s) {
+            *product_slot(product, product_tuple(product, s)) = s + 1 ;
+        }
+    }
+    return n - 1 ;
+}
+
+///
+/// Above that many states, a composition is given up.
+///
+#define CARTEUR_COMPOSE_MAX_STATES ((size_t) 1 << 20)
+
+///
+/// Identifier of a product state, named after the states of its tuple when
+/// it is new. Names that clash are reported.
+///
+static size_t compose_state
+    ( parsing_stage_data_t* parsing
+    , product_t* product
+    , component_t** composed
+    , const size_t* tuple
+    , buffer_t* name
+    )
+{
+    const size_t n = product_size(product) ;
+    const size_t s = product_add(product, tuple) ;
+    if (s < n)
+        return s ;
+    name->size = 0 ;
+    for (size_t i = 0; i < product->n_components; ++ i) {
+        buffer_printf(name, "%s%s", (i > 0) ? "_" : ""
+                     , *array_cstr_cget(composed[i]->states.names, tuple[i])) ;
+    }
+    if (symbol_table_intern(&parsing->states, name->data, name->size) != s) {
+        buffer_printf(parsing->log, "Machine '%s': composed state name '%.*s' is ambiguous.\n"
+                     , parsing->parameters->machine_name, (int) name->size, name->data) ;
+        parsing->status = 4 ;
+    }
+    return s ;
+}
+
+///
+/// Identifier of the callback running the given ones in a row, named
+/// <machine>_<first>_and_<second>... and added with its parts if it is new.
+/// Names that clash are reported.
+///
+static size_t compose_callback
+    ( parsing_stage_data_t* parsing
+    , array_size_t part_offsets
+    , array_size_t parts
+    , const size_t* moved
+    , const size_t n_moved
+    , buffer_t* name
+    )
+{
+    name->size = 0 ;
+    buffer_puts(name, parsing->parameters->machine_name) ;
+    for (size_t i = 0; i < n_moved; ++ i) {
+        buffer_printf(name, "_%s%s", (i > 0) ? "and_" : ""
+                     , *array_cstr_cget(parsing->callbacks.names, moved[i])) ;
+    }
+    const size_t n = symbol_table_size(&parsing->callbacks) ;
+    const size_t cb = symbol_table_intern(&parsing->callbacks, name->data, name->size) ;
+    if (cb == n) {
+        for (size_t i = 0; i < n_moved; ++ i) {
+            array_size_push_back(parts, moved[i]) ;
+        }
+        array_size_push_back(part_offsets, array_size_size(parts)) ;
+        return cb ;
+    }
+    const size_t begin = *array_size_cget(part_offsets, cb) ;
+    bool same = (*array_size_cget(part_offsets, cb + 1) - begin == n_moved) ;
+    for (size_t i = 0; same && (i < n_moved); ++ i) {
+        same = (*array_size_cget(parts, begin + i) == moved[i]) ;
+    }
+    if (! same) {
+        buffer_printf(parsing->log, "Machine '%s': composed callback name '%.*s' is ambiguous.\n"
+                     , parsing->parameters->machine_name, (int) name->size, name->data) ;
+        parsing->status = 4 ;
+    }
+    return cb ;
+}
+
+///
+/// Build the machine as the synchronous product of the machines listed in
+/// compose, in place of the states and transitions outside of any section.
+/// A state of the product is a tuple of states of the components, named
+/// after them, joined by '_'. On an event, the components that have a
+/// transition on it from their state take it (the first one declared, as
+/// the generated dispatchers do), the others stay where they are. There is
+/// a transition when at least one of them moves.
+///
+/// The product is explored breadth-first from its start states, which are
+/// the combinations of those of the components (of their first state when
+/// they have none), so that only the reachable states are ever built. A
+/// state is an end state when all the components having end states are in
+/// one of them.
+///
+/// A transition moving several components runs their callbacks in the order
+/// of compose. Those callbacks are added, and their parts given in
+/// part_offsets and parts (see generation_stage_data_t).
+///
+void compose_machines
+    ( parsing_stage_data_t* parsing
+    , array_size_t part_offsets
+    , array_size_t parts
+    )
+{
+    const char* data = parsing->input ;
+    const char* machine_name = parsing->parameters->machine_name ;
+    const size_t n_components = array_component_size(parsing->components) ;
+    const size_t k = array_token_size(parsing->compose) ;
+
+    // Resolve the names, and report the machines left out.
+    component_t** composed = malloc((k + 1) * sizeof(component_t*)) ;
+    bool* used = calloc(n_components + 1, sizeof(bool)) ;
+    for (size_t i = 0; i < k; ++ i) {
+        const token_t name = *array_token_cget(parsing->compose, i) ;
+        composed[i] = NULL ;
+        for (size_t c = 0; (c < n_components) && (composed[i] == NULL); ++ c) {
+            component_t* component = array_component_get(parsing->components, c) ;
+            if (token_same(data, component->name, name)) {
+                composed[i] = component ;
+                used[c] = true ;
+            }
+        }
+        if (composed[i] == NULL) {
+            buffer_printf(parsing->log, "Machine '%s': unknown machine '%.*s' to compose.\n"
+                         , machine_name, (int) name.length, data + name.offset) ;
+            parsing->status = 4 ;
+        } else if (symbol_table_size(&composed[i]->states) == 0) {
+            buffer_printf(parsing->log, "Machine '%s': machine '%.*s' has no states.\n"
+                         , machine_name, (int) name.length, data + name.offset) ;
+            parsing->status = 4 ;
+        }
+    }
+    for (size_t c = 0; c < n_components; ++ c) {
+        const token_t name = array_component_get(parsing->components, c)->name ;
+        if (! used[c])
+            buffer_printf(parsing->log, "Machine '%s': machine '%.*s' is not composed, ignoring it.\n"
+                         , machine_name, (int) name.length, data + name.offset) ;
+    }
+    free(used) ;
+    if ((k == 0) || (parsing->status != 0)) {
+        free(composed) ;
+        return ;
+    }
+
+    // The product replaces the machine outside of the sections.
+    if ((symbol_table_size(&parsing->states) > 0) || ! array_transition_empty_p(parsing->transitions))
+        buffer_printf(parsing->log, "Machine '%s': states and transitions outside of the "
+                      "composed machines are ignored.\n", machine_name) ;
+    arena_t* arena = parsing->states.arena ;
+    symbol_table_clear(&parsing->states) ;
+    symbol_table_init(&parsing->states, arena) ;
+    array_transition_reset(parsing->transitions) ;
+    array_size_reset(parsing->start_states) ;
+    array_size_reset(parsing->end_states) ;
+
+    // First transition of each (state, event) pair, and end states, of each
+    // component.
+    const size_t n_events = symbol_table_size(&parsing->events) ;
+    size_t** first = malloc(k * sizeof(size_t*)) ;
+    bool** end = malloc(k * sizeof(bool*)) ;
+    bool has_end = false ;
+    for (size_t i = 0; i < k; ++ i) {
+        const component_t* component = composed[i] ;
+        const size_t n_states = symbol_table_size(&component->states) ;
+        first[i] = malloc((n_states * n_events + 1) * sizeof(size_t)) ;
+        for (size_t j = 0; j < n_states * n_events; ++ j) {
+            first[i][j] = SIZE_MAX ;
+        }
+        for (size_t t = 0; t < array_transition_size(component->transitions); ++ t) {
+            const transition_t* ref = array_transition_cget(component->transitions, t) ;
+            size_t* cell = &first[i][(*ref)->from * n_events + (*ref)->event] ;
+            if (*cell == SIZE_MAX)
+                *cell = t ;
+        }
+        end[i] = NULL ;
+        if (! array_size_empty_p(component->end_states)) {
+            end[i] = calloc(n_states, sizeof(bool)) ;
+            for (size_t j = 0; j < array_size_size(component->end_states); ++ j) {
+                end[i][*array_size_cget(component->end_states, j)] = true ;
+            }
+            has_end = true ;
+        }
+    }
+
+    // The callbacks of the components are their own part.
+    const size_t n_callbacks = symbol_table_size(&parsing->callbacks) ;
+    array_size_reset(part_offsets) ;
+    array_size_reset(parts) ;
+    for (size_t cb = 0; cb < n_callbacks; ++ cb) {
+        array_size_push_back(part_offsets, cb) ;
+        array_size_push_back(parts, cb) ;
+    }
+    array_size_push_back(part_offsets, n_callbacks) ;
+
+    product_t product ;
+    product_init(&product, k) ;
+    size_t* tuple = malloc(k * sizeof(size_t)) ;
+    size_t* target = malloc(k * sizeof(size_t)) ;
+    size_t* moved = malloc(k * sizeof(size_t)) ;
+    size_t* position = calloc(k, sizeof(size_t)) ;
+    buffer_t name ;
+    buffer_init(&name) ;
+
+    // Start states, in the order of the combinations of those of the
+    // components, the first component changing fastest.
+    for (;;) {
+        for (size_t i = 0; i < k; ++ i) {
+            tuple[i] = array_size_empty_p(composed[i]->start_states)
+                     ? 0 : *array_size_cget(composed[i]->start_states, position[i]) ;
+        }
+        const size_t n = product_size(&product) ;
+        const size_t s = compose_state(parsing, &product, composed, tuple, &name) ;
+        if (s == n)
+            array_size_push_back(parsing->start_states, s) ;
+        size_t i = 0 ;
+        while ((i < k) && (++ position[i] >= array_size_size(composed[i]->start_states))) {
+            position[i ++] = 0 ;
+        }
+        if (i == k)
+            break ;
+    }
+
+    // Breadth-first search, the identifiers being given in order.
+    for (size_t s = 0; (s < product_size(&product)) && (parsing->status == 0); ++ s) {
+        memcpy(tuple, product_tuple(&product, s), k * sizeof(size_t)) ;
+        for (size_t ev = 0; ev < n_events; ++ ev) {
+            size_t n_moved = 0 ;
+            for (size_t i = 0; i < k; ++ i) {
+                const size_t t = first[i][tuple[i] * n_events + ev] ;
+                target[i] = tuple[i] ;
+                if (t == SIZE_MAX)
+                    continue ;
+                const transition_t* ref = array_transition_cget(composed[i]->transitions, t) ;
+                target[i] = (*ref)->to ;
+                moved[n_moved ++] = (*ref)->callback ;
+            }
+            if (n_moved == 0)
+                continue ;
+            transition_t transition ;
+            transition->from = s ;
+            transition->to = compose_state(parsing, &product, composed, target, &name) ;
+            transition->event = ev ;
+            transition->callback = (n_moved == 1)
+                                 ? moved[0]
+                                 : compose_callback(parsing, part_offsets, parts, moved, n_moved, &name) ;
+            transition->count = 0 ;
+            array_transition_push_back(parsing->transitions, transition) ;
+        }
+        if (product_size(&product) > CARTEUR_COMPOSE_MAX_STATES) {
+            buffer_printf(parsing->log, "Machine '%s': the product has more than %zu states, "
+                          "giving up.\n", machine_name, CARTEUR_COMPOSE_MAX_STATES) ;
+            parsing->status = 4 ;
+        }
+    }
+
+    // End states.
+    const size_t n_states = product_size(&product) ;
+    for (size_t s = 0; has_end && (s < n_states); ++ s) {
+        const size_t* states = product_tuple(&product, s) ;
+        bool final = true ;
+        for (size_t i = 0; final && (i < k); ++ i) {
+            final = (end[i] == NULL) || end[i][states[i]] ;
+        }
+        if (final)
+            array_size_push_back(parsing->end_states, s) ;
+    }
+    if (parsing->status == 0) {
+        buffer_printf(parsing->log, "Machine '%s': product of %zu machines, %zu states, "
+                      "%zu transitions.\n", machine_name, k, n_states
+                     , array_transition_size(parsing->transitions)) ;
+    } else {
+        // The product may name fewer states than it has, drop it altogether.
+        array_transition_reset(parsing->transitions) ;
+        array_size_reset(parsing->start_states) ;
+        array_size_reset(parsing->end_states) ;
+    }
+
+    buffer_clear(&name) ;
+    free(position) ;
+    free(moved) ;
+    free(target) ;
+    free(tuple) ;
+    product_clear(&product) ;
+    for (size_t i = 0; i < k; ++ i) {
+        free(first[i]) ;
+        free(end[i]) ;
+    }
+    free(first) ;
+    free(end) ;
+    free(composed) ;
+}
+
+///
+/// The components are not needed once composed.
+///
+static void components_clear(parsing_stage_data_t* parsing)
+{
+    for (size_t c = 0; c < array_component_size(parsing->components); ++ c) {
+        component_t* component = array_component_get(parsing->components, c) ;
+        symbol_table_clear(&component->states) ;
+        array_transition_clear(component->transitions) ;
+        array_size_clear(component->start_states) ;
+        array_size_clear(component->end_states) ;
+    }
+    array_component_clear(parsing->components) ;
+    array_token_clear(parsing->compose) ;
+}
+
+///
+/// Keep the parts of the callbacks whose new ID is not SIZE_MAX, in order,
+/// with their new IDs.
+///
+static void callback_parts_renumber
+    ( generation_stage_data_t* generation
+    , const size_t* new_callback
+    , const size_t n_callbacks
+    )
+{
+    size_t* offsets = array_size_get(generation->callback_part_offsets, 0) ;
+    size_t n_kept = 0 ;
+    size_t n_parts = 0 ;
+    for (size_t c = 0; c < n_callbacks; ++ c) {
+        const size_t begin = offsets[c] ;
+        const size_t end = offsets[c + 1] ;
+        if (new_callback[c] == SIZE_MAX)
+            continue ;
+        offsets[n_kept ++] = n_parts ;
+        for (size_t p = begin; p < end; ++ p) {
+            const size_t part = *array_size_cget(generation->callback_parts, p) ;
+            *array_size_get(generation->callback_parts, n_parts ++) = new_callback[part] ;
+        }
+    }
+    offsets[n_kept] = n_parts ;
+    array_size_resize(generation->callback_part_offsets, n_kept + 1) ;
+    array_size_resize(generation->callback_parts, n_parts) ;
+}
+
+///
+/// Drop the states that cannot be reached from a start state, with their
+/// transitions, then the events and callbacks no longer used by any
+/// transition. The remaining ones keep their order. A report of what was
+/// dropped is written to the log, along with the reachable states from which
+/// no end state can be reached, if end states are given. Those are kept.
+///
+void prune_unreachable(generation_stage_data_t* generation)
+{
+    const char* machine_name = generation->parameters->machine_name ;
+    const size_t n_states = array_cstr_size(generation->states) ;
+    const size_t n_events = array_cstr_size(generation->events) ;
+    const size_t n_callbacks = array_cstr_size(generation->callbacks) ;
+    const size_t n_transitions = array_transition_size(generation->transitions) ;
+    const size_t* state_offsets = array_size_cget(generation->state_offsets, 0) ;
+    const size_t* state_index = (n_transitions > 0)
+                              ? array_size_cget(generation->state_index, 0) : NULL ;
+
+    // Breadth-first search from the start states.
+    bool* reached = calloc(n_states, sizeof(bool)) ;
+    size_t* queue = malloc((n_states + 1) * sizeof(size_t)) ;
+    size_t queue_end = 0 ;
+    for (size_t i = 0; i < array_size_size(generation->start_states); ++ i) {
+        const size_t s = *array_size_cget(generation->start_states, i) ;
+        if (! reached[s]) {
+            reached[s] = true ;
+            queue[queue_end ++] = s ;
+        }
+    }
+    for (size_t q = 0; q < queue_end; ++ q) {
+        const size_t s = queue[q] ;
+        for (size_t i = state_offsets[s]; i < state_offsets[s + 1]; ++ i) {
+            const size_t to = (*array_transition_cget(generation->transitions, state_index[i]))->to ;
+            if (! reached[to]) {
+                reached[to] = true ;
+                queue[queue_end ++] = to ;
+            }
+        }
+    }
+
+    // Backward search from the end states, among the reached ones.
+    if (! array_size_empty_p(generation->end_states)) {
+        size_t* in_offsets = calloc(n_states + 1, sizeof(size_t)) ;
+        size_t* in = malloc((n_transitions + 1) * sizeof(size_t)) ;
+        for (size_t i = 0; i < n_transitions; ++ i) {
+            ++ in_offsets[(*array_transition_cget(generation->transitions, i))->to + 1] ;
+        }
+        for (size_t s = 0; s < n_states; ++ s) {
+            in_offsets[s + 1] += in_offsets[s] ;
+        }
+        size_t* fill = calloc(n_states, sizeof(size_t)) ;
+        for (size_t i = 0; i < n_transitions; ++ i) {
+            const transition_t* ref = array_transition_cget(generation->transitions, i) ;
+            in[in_offsets[(*ref)->to] + fill[(*ref)->to] ++] = (*ref)->from ;
+        }
+        free(fill) ;
+        bool* trapped = malloc(n_states * sizeof(bool)) ;
+        for (size_t s = 0; s < n_states; ++ s) {
+            trapped[s] = reached[s] ;
+        }
+        queue_end = 0 ;
+        for (size_t i = 0; i < array_size_size(generation->end_states); ++ i) {
+            const size_t s = *array_size_cget(generation->end_states, i) ;
+            if (trapped[s]) {
+                trapped[s] = false ;
+                queue[queue_end ++] = s ;
+            }
+        }
+        for (size_t q = 0; q < queue_end; ++ q) {
+            const size_t s = queue[q] ;
+            for (size_t i = in_offsets[s]; i < in_offsets[s + 1]; ++ i) {
+                if (trapped[in[i]]) {
+                    trapped[in[i]] = false ;
+                    queue[queue_end ++] = in[i] ;
+                }
+            }
+        }
+        report_names(generation->log, machine_name
+                    , "states cannot reach an end state", generation->states, trapped) ;
+        free(trapped) ;
+        free(in_offsets) ;
+        free(in) ;
+    }
+    free(queue) ;
+
+    // Flag what is still used.
+    bool* used_event = calloc(n_events + 1, sizeof(bool)) ;
+    bool* used_callback = calloc(n_callbacks + 1, sizeof(bool)) ;
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        const transition_t* ref = array_transition_cget(generation->transitions, i) ;
+        if (reached[(*ref)->from]) {
+            used_event[(*ref)->event] = true ;
+            used_callback[(*ref)->callback] = true ;
+        }
+    }
+    const bool composed = ! array_size_empty_p(generation->callback_part_offsets) ;
+    for (size_t c = 0; composed && (c < n_callbacks); ++ c) {
+        const size_t* offsets = array_size_cget(generation->callback_part_offsets, 0) ;
+        for (size_t p = offsets[c]; used_callback[c] && (p < offsets[c + 1]); ++ p) {
+            used_callback[*array_size_cget(generation->callback_parts, p)] = true ;
+        }
+    }
+
+    // Report, then renumber.
+    bool* dropped = malloc((n_states + n_events + n_callbacks + 1) * sizeof(bool)) ;
+    size_t* new_id = malloc((n_states + n_events + n_callbacks + 1) * sizeof(size_t)) ;
+    size_t* new_state = new_id ;
+    size_t* new_event = new_id + n_states ;
+    size_t* new_callback = new_event + n_events ;
+    size_t n_kept = 0 ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        dropped[s] = ! reached[s] ;
+        new_state[s] = reached[s] ? n_kept ++ : SIZE_MAX ;
+    }
+    const size_t n_kept_states = n_kept ;
+    report_names(generation->log, machine_name
+                , "unreachable states dropped", generation->states, dropped) ;
+    n_kept = 0 ;
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        dropped[ev] = ! used_event[ev] ;
+        new_event[ev] = used_event[ev] ? n_kept ++ : SIZE_MAX ;
+    }
+    const size_t n_kept_events = n_kept ;
+    report_names(generation->log, machine_name
+                , "unused events dropped", generation->events, dropped) ;
+    n_kept = 0 ;
+    for (size_t c = 0; c < n_callbacks; ++ c) {
+        dropped[c] = ! used_callback[c] ;
+        new_callback[c] = used_callback[c] ? n_kept ++ : SIZE_MAX ;
+    }
+    const size_t n_kept_callbacks = n_kept ;
+    report_names(generation->log, machine_name
+                , "unused callbacks dropped", generation->callbacks, dropped) ;
+
+    if ((n_kept_states < n_states) || (n_kept_events < n_events) || (n_kept_callbacks < n_callbacks)) {
+        names_renumber(generation->states, new_state) ;
+        names_renumber(generation->events, new_event) ;
+        names_renumber(generation->callbacks, new_callback) ;
+        if (composed)
+            callback_parts_renumber(generation, new_callback, n_callbacks) ;
+        size_t n_kept_transitions = 0 ;
+        for (size_t i = 0; i < n_transitions; ++ i) {
+            transition_t* ref = array_transition_get(generation->transitions, i) ;
+            if (! reached[(*ref)->from])
+                continue ;
+            transition_t* kept = array_transition_get(generation->transitions, n_kept_transitions ++) ;
+            (*kept)->count = (*ref)->count ;
+            (*kept)->from = new_state[(*ref)->from] ;
+            (*kept)->to = new_state[(*ref)->to] ;
+            (*kept)->event = new_event[(*ref)->event] ;
+            (*kept)->callback = new_callback[(*ref)->callback] ;
+        }
+        array_transition_resize(generation->transitions, n_kept_transitions) ;
+        for (size_t i = 0; i < array_size_size(generation->start_states); ++ i) {
+            size_t* s = array_size_get(generation->start_states, i) ;
+            *s = new_state[*s] ;
+        }
+        // End states out of reach are simply forgotten.
+        size_t n_kept_ends = 0 ;
+        for (size_t i = 0; i < array_size_size(generation->end_states); ++ i) {
+            const size_t s = new_state[*array_size_cget(generation->end_states, i)] ;
+            if (s != SIZE_MAX)
+                *array_size_get(generation->end_states, n_kept_ends ++) = s ;
+        }
+        array_size_resize(generation->end_states, n_kept_ends) ;
+        generation_index(generation) ;
+    }
+    free(reached) ;
+    free(used_event) ;
+    free(used_callback) ;
+    free(dropped) ;
+    free(new_id) ;
+}
+
+///
+/// Refinable partition of the states, for the minimisation. The states of
+/// block b are elements[first[b]] to elements[end[b] - 1], and those marked
+/// by the current splitter come first, marked[b] of them.
+///
+typedef struct partition_t {
+    size_t n_blocks ;
+    size_t* elements ;
+    size_t* location ;
+    size_t* block ;
+    size_t* first ;
+    size_t* end ;
+    size_t* marked ;
+} partition_t ;
+
+static void partition_mark(partition_t* partition, const size_t state, array_size_t touched)
+{
+    const size_t b = partition->block[state] ;
+    const size_t position = partition->location[state] ;
+    const size_t boundary = partition->first[b] + partition->marked[b] ;
+    if (position < boundary)
+        return ;
+    if (partition->marked[b] == 0)
+        array_size_push_back(touched, b) ;
+    const size_t other = partition->elements[boundary] ;
+    partition->elements[boundary] = state ;
+    partition->elements[position] = other ;
+    partition->location[state] = boundary ;
+    partition->location[other] = position ;
+    ++ partition->marked[b] ;
+}
+
+///
+/// Split the touched blocks into their marked and unmarked states. The new
+/// block is always the smaller part, and is the one returned in split.
+///
+static void partition_split
+    ( partition_t* partition
+    , array_size_t touched
+    , array_size_t split
+    )
+{
+    for (size_t i = 0; i < array_size_size(touched); ++ i) {
+        const size_t b = *array_size_cget(touched, i) ;
+        const size_t n_marked = partition->marked[b] ;
+        const size_t n_unmarked = partition->end[b] - partition->first[b] - n_marked ;
+        partition->marked[b] = 0 ;
+        if (n_unmarked == 0)
+            continue ;
+        const size_t z = partition->n_blocks ++ ;
+        partition->marked[z] = 0 ;
+        if (n_marked <= n_unmarked) {
+            partition->first[z] = partition->first[b] ;
+            partition->end[z] = partition->first[b] + n_marked ;
+            partition->first[b] = partition->end[z] ;
+        } else {
+            partition->first[z] = partition->first[b] + n_marked ;
+            partition->end[z] = partition->end[b] ;
+            partition->end[b] = partition->first[z] ;
+        }
+        for (size_t e = partition->first[z]; e < partition->end[z]; ++ e) {
+            partition->block[partition->elements[e]] = z ;
+        }
+        array_size_push_back(split, z) ;
+    }
+    array_size_reset(touched) ;
+}
+
+typedef struct signature_t {
+    uint64_t hash ;
+    size_t state ;
+} signature_t ;
+
+static int signature_cmp_qsort(const void* a, const void* b)
+{
+    const signature_t* sa = (const signature_t*) a ;
+    const signature_t* sb = (const signature_t*) b ;
+    if (sa->hash != sb->hash)
+        return (sa->hash > sb->hash) - (sa->hash < sb->hash) ;
+    return (sa->state > sb->state) - (sa->state < sb->state) ;
+}
+
+///
+/// Whether two states have the same outgoing (event, callback) pairs. Rows
+/// hold the first transition of each (state, event) pair, sorted by event.
+///
+static bool signature_equal
+    ( const generation_stage_data_t* generation
+    , const size_t* row_offsets
+    , const size_t* rows
+    , const size_t a
+    , const size_t b
+    )
+{
+    if (row_offsets[a + 1] - row_offsets[a] != row_offsets[b + 1] - row_offsets[b])
+        return false ;
+    for (size_t i = row_offsets[a], j = row_offsets[b]; i < row_offsets[a + 1]; ++ i, ++ j) {
+        const transition_t* ta = array_transition_cget(generation->transitions, rows[i]) ;
+        const transition_t* tb = array_transition_cget(generation->transitions, rows[j]) ;
+        if (((*ta)->event != (*tb)->event) || ((*ta)->callback != (*tb)->callback))
+            return false ;
+    }
+    return true ;
+}
+
+///
+/// Merge equivalent states, with Hopcroft's partition refinement. Two states
+/// are equivalent when, on every event, both fire the same callback and go
+/// to equivalent states, or both ignore the event. Ignored events are
+/// self-loops without callback; they never split a block, since the states
+/// of a block always ignore the same events, so only the declared
+/// transitions are walked. When a pair is declared twice, the first
+/// transition counts, as in the generated code. End states are never merged
+/// with other states.
+///
+/// Each class is represented by its first declared state, and classes keep
+/// the order of their representatives. Only the transitions of the
+/// representatives are kept.
+///
+void minimise_states(generation_stage_data_t* generation)
+{
+    const size_t n_states = array_cstr_size(generation->states) ;
+    const size_t n_events = array_cstr_size(generation->events) ;
+    const size_t n_transitions = array_transition_size(generation->transitions) ;
+    if (n_states < 2)
+        return ;
+    const size_t* state_offsets = array_size_cget(generation->state_offsets, 0) ;
+    const size_t* state_index = (n_transitions > 0)
+                              ? array_size_cget(generation->state_index, 0) : NULL ;
+
+    // Rows without the pairs declared twice, and the incoming transitions.
+    size_t* row_offsets = malloc((n_states + 1) * sizeof(size_t)) ;
+    size_t* rows = malloc((n_transitions + 1) * sizeof(size_t)) ;
+    size_t* in_offsets = calloc(n_states + 1, sizeof(size_t)) ;
+    size_t* in = malloc((n_transitions + 1) * sizeof(size_t)) ;
+    size_t n_rows = 0 ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        row_offsets[s] = n_rows ;
+        for (size_t i = state_offsets[s]; i < state_offsets[s + 1]; ++ i) {
+            const transition_t* ref = array_transition_cget(generation->transitions, state_index[i]) ;
+            if ((n_rows > row_offsets[s])
+                && ((*array_transition_cget(generation->transitions, rows[n_rows - 1]))->event
+                    == (*ref)->event))
+                continue ;
+            rows[n_rows ++] = state_index[i] ;
+            ++ in_offsets[(*ref)->to + 1] ;
+        }
+    }
+    row_offsets[n_states] = n_rows ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        in_offsets[s + 1] += in_offsets[s] ;
+    }
+    size_t* fill = calloc(n_states, sizeof(size_t)) ;
+    for (size_t r = 0; r < n_rows; ++ r) {
+        const size_t to = (*array_transition_cget(generation->transitions, rows[r]))->to ;
+        in[in_offsets[to] + fill[to] ++] = rows[r] ;
+    }
+    free(fill) ;
+
+    // Initial partition, by outgoing (event, callback) pairs. End states are
+    // only equivalent to end states.
+    bool* final = calloc(n_states, sizeof(bool)) ;
+    for (size_t i = 0; i < array_size_size(generation->end_states); ++ i) {
+        final[*array_size_cget(generation->end_states, i)] = true ;
+    }
+    partition_t partition ;
+    partition.n_blocks = 0 ;
+    partition.elements = malloc(n_states * sizeof(size_t)) ;
+    partition.location = malloc(n_states * sizeof(size_t)) ;
+    partition.block = malloc(n_states * sizeof(size_t)) ;
+    partition.first = malloc(n_states * sizeof(size_t)) ;
+    partition.end = malloc(n_states * sizeof(size_t)) ;
+    partition.marked = calloc(n_states, sizeof(size_t)) ;
+    signature_t* signatures = malloc(n_states * sizeof(signature_t)) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        uint64_t hash = hash_size(CARTEUR_FNV_OFFSET, final[s]) ;
+        for (size_t r = row_offsets[s]; r < row_offsets[s + 1]; ++ r) {
+            const transition_t* ref = array_transition_cget(generation->transitions, rows[r]) ;
+            hash = hash_size(hash, (*ref)->event) ;
+            hash = hash_size(hash, (*ref)->callback) ;
+        }
+        signatures[s].hash = hash ;
+        signatures[s].state = s ;
+    }
+    qsort(signatures, n_states, sizeof(signature_t), signature_cmp_qsort) ;
+    size_t n_placed = 0 ;
+    for (size_t run = 0; run < n_states; ) {
+        size_t run_end = run ;
+        while ((run_end < n_states) && (signatures[run_end].hash == signatures[run].hash))
+            ++ run_end ;
+        // Hash collisions aside, a run is a block. Peel off one block at a
+        // time, made of the states equal to the first remaining one.
+        for (size_t left = run; left < run_end; ) {
+            const size_t b = partition.n_blocks ++ ;
+            const size_t model = signatures[left].state ;
+            partition.first[b] = n_placed ;
+            for (size_t i = left; i < run_end; ++ i) {
+                const size_t s = signatures[i].state ;
+                if ((s != model)
+                    && ((final[s] != final[model])
+                        || ! signature_equal(generation, row_offsets, rows, model, s)))
+                    continue ;
+                partition.elements[n_placed] = s ;
+                partition.location[s] = n_placed ;
+                partition.block[s] = b ;
+                ++ n_placed ;
+                // Move it out of the remaining ones.
+                const signature_t moved = signatures[i] ;
+                signatures[i] = signatures[left] ;
+                signatures[left] = moved ;
+                ++ left ;
+            }
+            partition.end[b] = n_placed ;
+        }
+        run = run_end ;
+    }
+    free(signatures) ;
+    free(final) ;
+
+    // Waiting blocks. All the initial ones but the largest will do, the
+    // largest being the complement of the others among the states defining
+    // each event.
+    array_size_t waiting ;
+    array_size_init(waiting) ;
+    size_t largest = 0 ;
+    for (size_t b = 1; b < partition.n_blocks; ++ b) {
+        if (partition.end[b] - partition.first[b] > partition.end[largest] - partition.first[largest])
+            largest = b ;
+    }
+    for (size_t b = 0; b < partition.n_blocks; ++ b) {
+        if (b != largest)
+            array_size_push_back(waiting, b) ;
+    }
+
+    // Refine. The incoming transitions of the splitter are chained per
+    // event, then each event marks its sources and splits their blocks.
+    size_t* splitter = malloc(n_states * sizeof(size_t)) ;
+    size_t* head = malloc((n_events + 1) * sizeof(size_t)) ;
+    size_t* next = malloc((n_transitions + 1) * sizeof(size_t)) ;
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        head[ev] = SIZE_MAX ;
+    }
+    array_size_t events ;
+    array_size_t touched ;
+    array_size_init(events) ;
+    array_size_init(touched) ;
+    while (! array_size_empty_p(waiting)) {
+        const size_t a = *array_size_back(waiting) ;
+        array_size_pop_back(NULL, waiting) ;
+        const size_t n_splitter = partition.end[a] - partition.first[a] ;
+        memcpy(splitter, &partition.elements[partition.first[a]], n_splitter * sizeof(size_t)) ;
+        for (size_t i = 0; i < n_splitter; ++ i) {
+            const size_t t = splitter[i] ;
+            for (size_t e = in_offsets[t]; e < in_offsets[t + 1]; ++ e) {
+                const size_t ev = (*array_transition_cget(generation->transitions, in[e]))->event ;
+                if (head[ev] == SIZE_MAX)
+                    array_size_push_back(events, ev) ;
+                next[in[e]] = head[ev] ;
+                head[ev] = in[e] ;
+            }
+        }
+        for (size_t i = 0; i < array_size_size(events); ++ i) {
+            const size_t ev = *array_size_cget(events, i) ;
+            for (size_t e = head[ev]; e != SIZE_MAX; e = next[e]) {
+                partition_mark(&partition
+                              , (*array_transition_cget(generation->transitions, e))->from
+                              , touched) ;
+            }
+            head[ev] = SIZE_MAX ;
+            partition_split(&partition, touched, waiting) ;
+        }
+        array_size_reset(events) ;
+    }
+    array_size_clear(events) ;
+    array_size_clear(touched) ;
+    array_size_clear(waiting) ;
+    free(splitter) ;
+    free(head) ;
+    free(next) ;
+    free(row_offsets) ;
+    free(rows) ;
+    free(in_offsets) ;
+    free(in) ;
+
+    const size_t n_classes = partition.n_blocks ;
+    if (n_classes == n_states)
+        buffer_printf(generation->log, "Machine '%s': minimisation found no equivalent states.\n"
+                     , generation->parameters->machine_name) ;
+    else
+        buffer_printf(generation->log, "Machine '%s': minimisation merged %zu states into %zu.\n"
+                     , generation->parameters->machine_name, n_states, n_classes) ;
+    if (n_classes < n_states) {
+        // Number the classes in the order of their first state.
+        size_t* class_of_block = malloc(n_classes * sizeof(size_t)) ;
+        size_t* class_of = malloc(n_states * sizeof(size_t)) ;
+        bool* representative = calloc(n_states, sizeof(bool)) ;
+        for (size_t b = 0; b < n_classes; ++ b) {
+            class_of_block[b] = SIZE_MAX ;
+        }
+        array_cstr_t states ;
+        array_cstr_init(states) ;
+        size_t n_seen = 0 ;
+        for (size_t s = 0; s < n_states; ++ s) {
+            const size_t b = partition.block[s] ;
+            const char* name = *array_cstr_get(generation->states, s) ;
+            if (class_of_block[b] == SIZE_MAX) {
+                class_of_block[b] = n_seen ++ ;
+                representative[s] = true ;
+                array_cstr_push_back(states, name) ;
+            } else {
+                array_cstr_push_back(generation->state_aliases, name) ;
+                array_size_push_back(generation->state_alias_targets, class_of_block[b]) ;
+            }
+            class_of[s] = class_of_block[b] ;
+        }
+        array_cstr_swap(states, generation->states) ;
+        array_cstr_clear(states) ;
+
+        array_transition_t transitions ;
+        array_transition_init(transitions) ;
+        for (size_t i = 0; i < n_transitions; ++ i) {
+            const transition_t* ref = array_transition_cget(generation->transitions, i) ;
+            if (! representative[(*ref)->from])
+                continue ;
+            transition_t transition ;
+            transition_init_set(transition, *ref) ;
+            transition->from = class_of[(*ref)->from] ;
+            transition->to = class_of[(*ref)->to] ;
+            array_transition_push_back(transitions, transition) ;
+        }
+        array_transition_swap(transitions, generation->transitions) ;
+        for (size_t i = 0; i < array_size_size(generation->start_states); ++ i) {
+            size_t* state = array_size_get(generation->start_states, i) ;
+            *state = class_of[*state] ;
+        }
+        for (size_t i = 0; i < array_size_size(generation->end_states); ++ i) {
+            size_t* state = array_size_get(generation->end_states, i) ;
+            *state = class_of[*state] ;
+        }
+        generation_index(generation) ;
+
+        // The profile counts of the merged states go to their class.
+        if (generation->profile_total > 0) {
+            for (size_t i = 0; i < n_transitions; ++ i) {
+                const transition_t* ref = array_transition_cget(transitions, i) ;
+                if (representative[(*ref)->from] || ((*ref)->count == 0))
+                    continue ;
+                const size_t kept = transition_find(generation, class_of[(*ref)->from], (*ref)->event) ;
+                (*array_transition_get(generation->transitions, kept))->count += (*ref)->count ;
+            }
+        }
+        array_transition_clear(transitions) ;
+
+        free(class_of_block) ;
+        free(class_of) ;
+        free(representative) ;
+    }
+    free(partition.elements) ;
+    free(partition.location) ;
+    free(partition.block) ;
+    free(partition.first) ;
+    free(partition.end) ;
+    free(partition.marked) ;
+}
+
+///
+/// Read a profile, as written by the instrumented code: one "state event
+/// count" line per transition taken. The samples are stored as transitions
+/// whose to and callback fields are unused, the names being resolved with
+/// the symbol tables of stage 1. Unknown names and malformed lines are
+/// counted in ignored. A missing profile is not an error, since the first
+/// instrumented run has yet to write it.
+///
+static bool profile_read
+    ( const parsing_stage_data_t* parsing
+    , const char* path
+    , array_transition_t samples
+    , size_t* ignored
+    )
+{
+    input_t input ;
+    if (! input_open(&input, path))
+        return false ;
+    const char* data = input.data ;
+    size_t i = 0 ;
+    *ignored = 0 ;
+    while (i < input.size) {
+        size_t end = i ;
+        while ((end < input.size) && (data[end] != '\n'))
+            ++ end ;
+        token_t tokens[3] ;
+        size_t n_tokens = 0 ;
+        for (size_t j = i; j < end; ) {
+            while ((j < end) && character_is_blank(data[j]))
+                ++ j ;
+            if ((j == end) || (data[j] == '#'))
+                break ;
+            token_t token = { .offset = j, .length = 0 } ;
+            while ((j < end) && ! character_is_blank(data[j]))
+                ++ j ;
+            token.length = j - token.offset ;
+            if (n_tokens < 3)
+                tokens[n_tokens] = token ;
+            ++ n_tokens ;
+        }
+        i = end + 1 ;
+        if (n_tokens == 0)
+            continue ;
+        transition_t sample ;
+        transition_init(sample) ;
+        bool valid = (n_tokens == 3)
+            && symbol_table_find(&parsing->states, data + tokens[0].offset, tokens[0].length, &sample->from)
+            && symbol_table_find(&parsing->events, data + tokens[1].offset, tokens[1].length, &sample->event) ;
+        for (size_t j = 0; valid && (j < tokens[2].length); ++ j) {
+            const char c = data[tokens[2].offset + j] ;
+            valid = (c >= '0') && (c <= '9') ;
+            sample->count = 10 * sample->count + (uint64_t) (c - '0') ;
+        }
+        if (valid)
+            array_transition_push_back(samples, sample) ;
+        else
+            ++ *ignored ;
+    }
+    input_close(&input) ;
+    return true ;
+}
+
+///
+/// Add the samples to the counts of the transitions they were taken on.
+/// Samples of pairs without transition (or dropped since) are ignored.
+///
+static void profile_apply
+    ( generation_stage_data_t* generation
+    , array_transition_t samples
+    , size_t* ignored
+    )
+{
+    for (size_t i = 0; i < array_transition_size(samples); ++ i) {
+        const transition_t* sample = array_transition_cget(samples, i) ;
+        const size_t t = transition_find(generation, (*sample)->from, (*sample)->event) ;
+        if (t == SIZE_MAX) {
+            ++ *ignored ;
+            continue ;
+        }
+        (*array_transition_get(generation->transitions, t))->count += (*sample)->count ;
+        generation->profile_total += (*sample)->count ;
+    }
+}
+
+typedef struct heat_t {
+    uint64_t count ;
+    size_t state ;
+} heat_t ;
+
+static int heat_cmp_qsort(const void* a, const void* b)
+{
+    const heat_t* ha = (const heat_t*) a ;
+    const heat_t* hb = (const heat_t*) b ;
+    // Hottest first, then in declaration order.
+    if (ha->count != hb->count)
+        return (ha->count < hb->count) ? 1 : -1 ;
+    return (ha->state > hb->state) - (ha->state < hb->state) ;
+}
+
+typedef struct ranked_transition_t {
+    size_t event ;
+    uint64_t count ;
+    size_t position ;
+} ranked_transition_t ;
+
+static int ranked_transition_cmp_qsort(const void* a, const void* b)
+{
+    const ranked_transition_t* ra = (const ranked_transition_t*) a ;
+    const ranked_transition_t* rb = (const ranked_transition_t*) b ;
+    if (ra->event != rb->event)
+        return (ra->event > rb->event) - (ra->event < rb->event) ;
+    if (ra->count != rb->count)
+        return (ra->count < rb->count) ? 1 : -1 ;
+    return (ra->position > rb->position) - (ra->position < rb->position) ;
+}
+
+///
+/// Lay the machine out after the profile. States are renumbered from the
+/// most to the least often left, so that the hot rows of the tables sit
+/// together, and the transitions of each event are sorted from the most to
+/// the least taken, so that the hot cases come first. Ties keep the current
+/// order, hence a pair declared twice still resolves to its first
+/// transition, which is the one holding the count.
+///
+void profile_layout(generation_stage_data_t* generation)
+{
+    const size_t n_states = array_cstr_size(generation->states) ;
+    const size_t n_transitions = array_transition_size(generation->transitions) ;
+
+    // States.
+    heat_t* heat = malloc((n_states + 1) * sizeof(heat_t)) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        heat[s].count = 0 ;
+        heat[s].state = s ;
+    }
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        const transition_t* ref = array_transition_cget(generation->transitions, i) ;
+        heat[(*ref)->from].count += (*ref)->count ;
+    }
+    qsort(heat, n_states, sizeof(heat_t), heat_cmp_qsort) ;
+    size_t* new_state = malloc((n_states + 1) * sizeof(size_t)) ;
+    array_cstr_t states ;
+    array_cstr_init(states) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        new_state[heat[s].state] = s ;
+        array_cstr_push_back(states, *array_cstr_cget(generation->states, heat[s].state)) ;
+    }
+    array_cstr_swap(states, generation->states) ;
+    array_cstr_clear(states) ;
+    free(heat) ;
+    for (size_t i = 0; i < array_size_size(generation->state_alias_targets); ++ i) {
+        size_t* state = array_size_get(generation->state_alias_targets, i) ;
+        *state = new_state[*state] ;
+    }
+    for (size_t i = 0; i < array_size_size(generation->start_states); ++ i) {
+        size_t* state = array_size_get(generation->start_states, i) ;
+        *state = new_state[*state] ;
+    }
+    for (size_t i = 0; i < array_size_size(generation->end_states); ++ i) {
+        size_t* state = array_size_get(generation->end_states, i) ;
+        *state = new_state[*state] ;
+    }
+
+    // Transitions, which the index then keeps in this order.
+    ranked_transition_t* ranks = malloc((n_transitions + 1) * sizeof(ranked_transition_t)) ;
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        const transition_t* ref = array_transition_cget(generation->transitions, i) ;
+        ranks[i].event = (*ref)->event ;
+        ranks[i].count = (*ref)->count ;
+        ranks[i].position = i ;
+    }
+    qsort(ranks, n_transitions, sizeof(ranked_transition_t), ranked_transition_cmp_qsort) ;
+    array_transition_t transitions ;
+    array_transition_init(transitions) ;
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        transition_t transition ;
+        transition_init_set(transition, *array_transition_cget(generation->transitions, ranks[i].position)) ;
+        transition->from = new_state[transition->from] ;
+        transition->to = new_state[transition->to] ;
+        array_transition_push_back(transitions, transition) ;
+    }
+    array_transition_swap(transitions, generation->transitions) ;
+    array_transition_clear(transitions) ;
+    free(ranks) ;
+    free(new_state) ;
+    generation_index(generation) ;
+}
+
+///
+/// Hash of everything the generated code depends on: the normalised machine
+/// and the generator options. Options added to parameters_t that change the
+/// output must be added here too.
+///
+uint64_t generation_hash(generation_stage_data_t* generation)
+{
+    const parameters_t* parameters = generation->parameters ;
+    uint64_t hash = hash_size(CARTEUR_FNV_OFFSET, CARTEUR_GENERATOR_VERSION) ;
+    hash = hash_size(hash, parameters->declare_states) ;
+    hash = hash_size(hash, parameters->declare_events) ;
+    hash = hash_size(hash, parameters->batch) ;
+    hash = hash_size(hash, parameters->broadcast) ;
+    hash = hash_size(hash, parameters->packed) ;
+    hash = hash_size(hash, parameters->run) ;
+    hash = hash_size(hash, parameters->from_string) ;
+    hash = hash_size(hash, parameters->enabled_events) ;
+    hash = hash_size(hash, parameters->atomic) ;
+    hash = hash_size(hash, parameters->atomic_benchmark) ;
+    hash = hash_size(hash, parameters->minimise) ;
+    hash = hash_size(hash, parameters->state_aliases) ;
+    hash = hash_size(hash, parameters->instrument) ;
+    hash = hash_size(hash, parameters->language) ;
+    hash = hash_size(hash, parameters->backend) ;
+    hash = hash_size(hash, parameters->source_shards) ;
+    hash = hash_name(hash, parameters->machine_name) ;
+    hash = hash_name(hash, parameters->states_enum_name) ;
+    hash = hash_name(hash, parameters->events_enum_name) ;
+    hash = hash_names(hash, generation->states) ;
+    hash = hash_names(hash, generation->events) ;
+    hash = hash_names(hash, generation->callbacks) ;
+    hash = hash_names(hash, generation->state_aliases) ;
+    for (size_t i = 0; i < array_size_size(generation->state_alias_targets); ++ i) {
+        hash = hash_size(hash, *array_size_cget(generation->state_alias_targets, i)) ;
+    }
+    // The C++ class and the blob start in the first start state, and the
+    // blob holds the end states.
+    hash = hash_size(hash, array_size_size(generation->start_states)) ;
+    for (size_t i = 0; i < array_size_size(generation->start_states); ++ i) {
+        hash = hash_size(hash, *array_size_cget(generation->start_states, i)) ;
+    }
+    hash = hash_size(hash, array_size_size(generation->end_states)) ;
+    for (size_t i = 0; i < array_size_size(generation->end_states); ++ i) {
+        hash = hash_size(hash, *array_size_cget(generation->end_states, i)) ;
+    }
+    hash = hash_size(hash, array_size_size(generation->callback_part_offsets)) ;
+    for (size_t i = 0; i < array_size_size(generation->callback_part_offsets); ++ i) {
+        hash = hash_size(hash, *array_size_cget(generation->callback_part_offsets, i)) ;
+    }
+    for (size_t i = 0; i < array_size_size(generation->callback_parts); ++ i) {
+        hash = hash_size(hash, *array_size_cget(generation->callback_parts, i)) ;
+    }
+    const size_t n_transitions = array_transition_size(generation->transitions) ;
+    hash = hash_size(hash, n_transitions) ;
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        const transition_t* ref = array_transition_cget(generation->transitions, i) ;
+        hash = hash_size(hash, (*ref)->from) ;
+        hash = hash_size(hash, (*ref)->to) ;
+        hash = hash_size(hash, (*ref)->event) ;
+        hash = hash_size(hash, (*ref)->callback) ;
+        hash = hash_size(hash, (*ref)->count) ;
+    }
+    return hash ;
+}
+
+void generation_stage_data_clear(generation_stage_data_t* generation)
+{
+    array_transition_clear(generation->transitions) ;
+    array_size_clear(generation->event_offsets) ;
+    array_size_clear(generation->state_offsets) ;
+    array_size_clear(generation->state_index) ;
+    array_cstr_clear(generation->state_aliases) ;
+    array_size_clear(generation->state_alias_targets) ;
+    array_size_clear(generation->start_states) ;
+    array_size_clear(generation->end_states) ;
+    array_size_clear(generation->callback_part_offsets) ;
+    array_size_clear(generation->callback_parts) ;
+    array_cstr_clear(generation->states) ;
+    array_cstr_clear(generation->events) ;
+    array_cstr_clear(generation->callbacks) ;
+}
+
+///
+/// General function that embodies the whole second stage. It builds the
+/// product of the machines to compose, if any, takes the names out of the
+/// symbol tables for stage 3, drops what cannot be reached when start states
+/// are given, possibly merges equivalent states, and lays the result out
+/// after the profile, if any.
+///
+void transform_graph
+    ( parsing_stage_data_t* parsing
+    , generation_stage_data_t* generation
+    )
+{
+    array_size_init(generation->callback_part_offsets) ;
+    array_size_init(generation->callback_parts) ;
+    if (parsing->status == 0)
+        compose_machines(parsing, generation->callback_part_offsets, generation->callback_parts) ;
+    components_clear(parsing) ;
+
+    // The profile names are resolved before the symbol tables go.
+    const char* profile = generation->parameters->profile ;
+    array_transition_t samples ;
+    array_transition_init(samples) ;
+    size_t ignored = 0 ;
+    if ((profile != NULL) && ! profile_read(parsing, profile, samples, &ignored))
+        buffer_printf(generation->log, "Cannot read profile '%s', ignoring it.\n", profile) ;
+
+    symbol_table_move_names(generation->states, &parsing->states) ;
+    symbol_table_move_names(generation->events, &parsing->events) ;
+    symbol_table_move_names(generation->callbacks, &parsing->callbacks) ;
+    array_transition_init_move(generation->transitions, parsing->transitions) ;
+    array_size_init(generation->event_offsets) ;
+    array_size_init(generation->state_offsets) ;
+    array_size_init(generation->state_index) ;
+    array_cstr_init(generation->state_aliases) ;
+    array_size_init(generation->state_alias_targets) ;
+    array_size_init_move(generation->start_states, parsing->start_states) ;
+    array_size_init_move(generation->end_states, parsing->end_states) ;
+    generation->profile_total = 0 ;
+    generation_index(generation) ;
+    report_duplicate_pairs(generation) ;
+    profile_apply(generation, samples, &ignored) ;
+    array_transition_clear(samples) ;
+    if (ignored > 0)
+        buffer_printf(generation->log, "Machine '%s': %zu profile entries ignored.\n"
+                     , generation->parameters->machine_name, ignored) ;
+    if (! array_size_empty_p(generation->start_states))
+        prune_unreachable(generation) ;
+    if (generation->parameters->minimise)
+        minimise_states(generation) ;
+    if (generation->profile_total > 0)
+        profile_layout(generation) ;
+}
+
+// ................................................................... STAGE 3
+
+#define CARTEUR_WRITEV_MAX 1024
+
+///
+/// Whether the file at path holds exactly the concatenation of the buffers.
+///
+static bool buffers_match_file
+    ( const char* path
+    , const buffer_t* const* buffers
+    , const size_t n
+    )
+{
+    input_t file ;
+    if (! input_open(&file, path))
+        return false ;
+    size_t offset = 0 ;
+    bool same = true ;
+    for (size_t i = 0; same && (i < n); ++ i) {
+        const size_t size = buffers[i]->size ;
+        same = (size <= file.size - offset)
+            && ((size == 0) || (memcmp(file.data + offset, buffers[i]->data, size) == 0)) ;
+        offset += size ;
+    }
+    same = same && (offset == file.size) ;
+    input_close(&file) ;
+    return same ;
+}
+
+///
+/// Write the pointed buffers, in order, to the file at path, with as few
+/// system calls as possible, unless the file already holds these bytes.
+/// Returns false (and reports to log) on failure.
+///
+bool buffers_write
+    ( buffer_t* log
+    , const char* path
+    , const buffer_t* const* buffers
+    , const size_t n
+    )
+{
+    // Leave identical files alone, so that their modification time does not
+    // trigger rebuilds.
+    if (buffers_match_file(path, buffers, n))
+        return true ;
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) ;
+    if (fd < 0) {
+        buffer_printf(log, "Cannot write '%s'.\n", path) ;
+        return false ;
+    }
+    struct iovec iov[CARTEUR_WRITEV_MAX] ;
+    size_t b = 0 ;
+    size_t skip = 0 ;
+    bool ok = true ;
+    while (ok && (b < n)) {
+        // Gather the next batch, starting skip bytes into buffer b.
+        int count = 0 ;
+        for (size_t i = b; (i < n) && (count < CARTEUR_WRITEV_MAX); ++ i) {
+            const size_t offset = (i == b) ? skip : 0 ;
+            if (buffers[i]->size == offset)
+                continue ;
+            iov[count].iov_base = buffers[i]->data + offset ;
+            iov[count].iov_len = buffers[i]->size - offset ;
+            ++ count ;
+        }
+        if (count == 0)
+            break ;
+        ssize_t written = writev(fd, iov, count) ;
+        if (written < 0) {
+            ok = false ;
+            break ;
+        }
+        // Move past what was written, which may stop in the middle of a buffer.
+        size_t left = (size_t) written ;
+        while ((b < n) && (left >= buffers[b]->size - skip)) {
+            left -= buffers[b]->size - skip ;
+            skip = 0 ;
+            ++ b ;
+        }
+        skip += left ;
+    }
+    if (close(fd) != 0)
+        ok = false ;
+    if (! ok)
+        buffer_printf(log, "Cannot write '%s'.\n", path) ;
+    return ok ;
+}
+
+///
+/// Dense (state x event) view of the transitions, shared by the table-based
+/// backends. Impossible pairs keep the current state and have no callback.
+/// Callbacks are stored shifted by one, so that 0 means "no transition".
+///
+typedef struct dense_table_t {
+    size_t n_states ;
+    size_t n_events ;
+    size_t* next ;
+    size_t* callback ;
+} dense_table_t ;
+
+void dense_table_init(dense_table_t* table, generation_stage_data_t* stage_data)
+{
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    table->n_states = n_states ;
+    table->n_events = n_events ;
+    table->next = malloc(n_states * n_events * sizeof(size_t)) ;
+    table->callback = calloc(n_states * n_events, sizeof(size_t)) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        for (size_t ev = 0; ev < n_events; ++ ev) {
+            table->next[s * n_events + ev] = s ;
+        }
+    }
+    const size_t n_transitions = array_transition_size(stage_data->transitions) ;
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        const transition_t* ref = array_transition_cget(stage_data->transitions, i) ;
+        const size_t cell = (*ref)->from * n_events + (*ref)->event ;
+        // Pairs declared twice were reported in stage 2.
+        if (table->callback[cell] != 0)
+            continue ;
+        table->next[cell] = (*ref)->to ;
+        table->callback[cell] = (*ref)->callback + 1 ;
+    }
+}
+
+void dense_table_clear(dense_table_t* table)
+{
+    free(table->next) ;
+    free(table->callback) ;
+}
+
+///
+/// Row-displacement ("comb vector") packing of the same information, as done
+/// by yacc and bison. Each state row is shifted by base[state] into shared
+/// next/callback vectors so that rows interleave in each other's holes, and
+/// check[slot] tells which state owns a slot (n_states for free slots). The
+/// vectors are padded by n_events, so that base + event never overflows.
+///
+typedef struct compressed_table_t {
+    size_t n_states ;
+    size_t n_events ;
+    size_t length ;
+    size_t max_base ;
+    size_t* base ;
+    size_t* check ;
+    size_t* next ;
+    size_t* callback ;
+} compressed_table_t ;
+
+typedef struct compressed_row_t {
+    size_t size ;
+    size_t state ;
+} compressed_row_t ;
+
+static int compressed_row_cmp_qsort(const void* a, const void* b)
+{
+    const compressed_row_t* ra = (const compressed_row_t*) a ;
+    const compressed_row_t* rb = (const compressed_row_t*) b ;
+    // Longest rows first, as they are the hardest to place.
+    if (ra->size != rb->size)
+        return (ra->size < rb->size) ? 1 : -1 ;
+    return (ra->state > rb->state) - (ra->state < rb->state) ;
+}
+
+///
+/// Build the compressed table straight from the per-state index, without
+/// ever building the dense one.
+///
+void compressed_table_init
+    ( compressed_table_t* table
+    , generation_stage_data_t* stage_data
+    )
+{
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_transitions = array_transition_size(stage_data->transitions) ;
+    table->n_states = n_states ;
+    table->n_events = n_events ;
+    table->max_base = 0 ;
+
+    // Rows come from the per-state index, already sorted by event.
+    const size_t* row_start = array_size_cget(stage_data->state_offsets, 0) ;
+    const size_t* rows = (n_transitions > 0)
+                       ? array_size_cget(stage_data->state_index, 0) : NULL ;
+
+    // Place rows one by one, at the first base where all their slots are
+    // free. The vectors grow as needed.
+    compressed_row_t* order = malloc(n_states * sizeof(compressed_row_t)) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        order[s].size = row_start[s + 1] - row_start[s] ;
+        order[s].state = s ;
+    }
+    qsort(order, n_states, sizeof(compressed_row_t), compressed_row_cmp_qsort) ;
+
+    size_t capacity = n_events + 1 ;
+    table->base = calloc(n_states, sizeof(size_t)) ;
+    table->check = malloc(capacity * sizeof(size_t)) ;
+    table->next = calloc(capacity, sizeof(size_t)) ;
+    table->callback = calloc(capacity, sizeof(size_t)) ;
+    for (size_t i = 0; i < capacity; ++ i) {
+        table->check[i] = n_states ;
+    }
+    for (size_t o = 0; o < n_states; ++ o) {
+        const size_t s = order[o].state ;
+        const size_t row_size = row_start[s + 1] - row_start[s] ;
+        const size_t* row = (row_size > 0) ? &rows[row_start[s]] : NULL ;
+        size_t base = 0 ;
+        for (bool placed = (row_size == 0); ! placed; ++ base) {
+            if (base + n_events > capacity) {
+                const size_t old_capacity = capacity ;
+                capacity = 2 * capacity ;
+                table->check = realloc(table->check, capacity * sizeof(size_t)) ;
+                table->next = realloc(table->next, capacity * sizeof(size_t)) ;
+                table->callback = realloc(table->callback, capacity * sizeof(size_t)) ;
+                for (size_t i = old_capacity; i < capacity; ++ i) {
+                    table->check[i] = n_states ;
+                    table->next[i] = 0 ;
+                    table->callback[i] = 0 ;
+                }
+            }
+            placed = true ;
+            for (size_t r = 0; placed && (r < row_size); ++ r) {
+                const size_t ev = (*array_transition_cget(stage_data->transitions, row[r]))->event ;
+                placed = (table->check[base + ev] == n_states) ;
+            }
+            if (! placed)
+                continue ;
+            for (size_t r = 0; r < row_size; ++ r) {
+                const transition_t* ref = array_transition_cget(stage_data->transitions, row[r]) ;
+                const size_t slot = base + (*ref)->event ;
+                // Pairs declared twice were reported in stage 2.
+                if (table->check[slot] == s)
+                    continue ;
+                table->check[slot] = s ;
+                table->next[slot] = (*ref)->to ;
+                table->callback[slot] = (*ref)->callback + 1 ;
+            }
+            table->base[s] = base ;
+            if (base > table->max_base)
+                table->max_base = base ;
+            break ;
+        }
+    }
+    table->length = table->max_base + n_events ;
+
+    free(order) ;
+}
+
+void compressed_table_clear(compressed_table_t* table)
+{
+    free(table->base) ;
+    free(table->check) ;
+    free(table->next) ;
+    free(table->callback) ;
+}
+
+///
+/// Size in bytes of the smallest standard unsigned integer holding max_value.
+///
+static size_t smallest_uint_size(const size_t max_value)
+{
+    if (max_value <= UINT8_MAX)
+        return 1 ;
+    if (max_value <= UINT16_MAX)
+        return 2 ;
+    if (max_value <= UINT32_MAX)
+        return 4 ;
+    return 8 ;
+}
+
+///
+/// Smallest standard unsigned integer type able to hold max_value.
+///
+static const char* C_smallest_uint(const size_t max_value)
+{
+    switch (smallest_uint_size(max_value)) {
+    case 1:
+        return "uint8_t" ;
+    case 2:
+        return "uint16_t" ;
+    case 4:
+        return "uint32_t" ;
+    default:
+        return "uint64_t" ;
+    }
+}
+
+///
+/// Broadcast packs states in 8 or 16 bits.
+///
+#define CARTEUR_BROADCAST_MAX_STATES 65536
+
+///
+/// Slots in the callback ring of ordered thread-safe instances.
+///
+#define CARTEUR_ATOMIC_RING 256
+
+///
+/// Number of bits a packed instance takes, ceil(log2(n_states)) but at least
+/// one. Instances never straddle two 64-bit words.
+///
+static size_t packed_state_bits(const size_t n_states)
+{
+    size_t bits = 1 ;
+    while ((bits < 64) && (((size_t) 1 << bits) < n_states))
+        ++ bits ;
+    return bits ;
+}
+
+///
+/// Whether the tables and the lookup are required, either by the backend
+/// itself or by one of the APIs built on top of them.
+///
+static bool C_needs_tables(const parameters_t* parameters)
+{
+    return (parameters->backend != CARTEUR_BACKEND_SWITCH)
+        || parameters->atomic
+        || parameters->batch
+        || parameters->broadcast
+        || parameters->packed ;
+}
+
+///
+/// Whether the events enum is emitted: when asked for, or when some of the
+/// API takes events (the dispatchers and what is built on them), which would
+/// not compile without it.
+///
+static bool C_declares_events(const parameters_t* parameters)
+{
+    return parameters->declare_events
+        || C_needs_tables(parameters)
+        || parameters->run
+        || parameters->enabled_events ;
+}
+
+///
+/// Emit a [n_rows][n_columns] array of integers named after the machine,
+/// each row being commented with its name.
+///
+static void generate_C_table
+    ( buffer_t* out
+    , generation_stage_data_t* stage_data
+    , const char* table_name
+    , const char* type
+    , const size_t* values
+    , const size_t n_rows
+    , const size_t n_columns
+    , array_cstr_t row_names
+    )
+{
+    buffer_printf(out, "static const %s %s_%s[%zu][%zu] = {\n"
+            , type, stage_data->parameters->machine_name, table_name
+            , n_rows, n_columns) ;
+    for (size_t r = 0; r < n_rows; ++ r) {
+        buffer_puts(out, "\t{") ;
+        for (size_t c = 0; c < n_columns; ++ c) {
+            buffer_puts(out, (c == 0) ? " " : ", ") ;
+            buffer_put_uint(out, values[r * n_columns + c]) ;
+        }
+        buffer_puts(out, " }, // ") ;
+        buffer_puts(out, *array_cstr_get(row_names, r)) ;
+        buffer_puts(out, "\n") ;
+    }
+    buffer_printf(out, "} ;\n\n") ;
+}
+
+///
+/// Whether a callback runs several callbacks of composed machines, rather
+/// than being provided by the user.
+///
+static bool callback_composite(const generation_stage_data_t* stage_data, const size_t cb)
+{
+    if (array_size_empty_p(stage_data->callback_part_offsets))
+        return false ;
+    const size_t* offsets = array_size_cget(stage_data->callback_part_offsets, 0) ;
+    return offsets[cb + 1] - offsets[cb] > 1 ;
+}
+
+///
+/// Number of 64-bit words of a bitset of events, at least one.
+///
+static size_t enabled_events_words(const size_t n_events)
+{
+    return (n_events > 0) ? (n_events + 63) / 64 : 1 ;
+}
+
+///
+/// Events having a transition from each state, n_words per state, event e
+/// being bit e % 64 of word e / 64. To be freed.
+///
+static uint64_t* enabled_events_bitsets(generation_stage_data_t* stage_data, const size_t n_words)
+{
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    uint64_t* words = calloc(n_states * n_words + 1, sizeof(uint64_t)) ;
+    for (size_t i = 0; i < array_transition_size(stage_data->transitions); ++ i) {
+        const transition_t* ref = array_transition_cget(stage_data->transitions, i) ;
+        words[(*ref)->from * n_words + (*ref)->event / 64] |= (uint64_t) 1 << ((*ref)->event % 64) ;
+    }
+    return words ;
+}
+
+///
+/// ...
+///
+void generate_C_header(buffer_t* out, generation_stage_data_t* stage_data) {
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const char* states_enum_name = stage_data->parameters->states_enum_name ;
+    const char* events_enum_name = stage_data->parameters->events_enum_name ;
+    buffer_printf(out, "// File generated by carteur.\n\n") ;
+    buffer_printf(out, "#pragma once\n\n") ;
+    buffer_printf(out, "#include <stddef.h>\n#include <stdint.h>\n") ;
+    if (stage_data->parameters->instrument)
+        buffer_printf(out, "#include <stdio.h>\n") ;
+    if (stage_data->parameters->atomic)
+        buffer_printf(out, "#include <stdatomic.h>\n") ;
+    buffer_printf(out, "\n") ;
+
+    // Emit an enum of all states.
+    if (stage_data->parameters->declare_states) {
+        buffer_printf(out, "typedef enum {\n") ;
+        const size_t n_states = array_cstr_size(stage_data->states) ;
+        for (size_t s = 0; s < n_states; ++ s) {
+            buffer_printf(out, "\t%s,\n", *array_cstr_get(stage_data->states, s));
+        }
+        // Merged states, as aliases of the state they were merged into.
+        if (stage_data->parameters->state_aliases) {
+            const size_t n_aliases = array_cstr_size(stage_data->state_aliases) ;
+            for (size_t a = 0; a < n_aliases; ++ a) {
+                const size_t target = *array_size_cget(stage_data->state_alias_targets, a) ;
+                buffer_printf(out, "\t%s = %s,\n"
+                             , *array_cstr_get(stage_data->state_aliases, a)
+                             , *array_cstr_get(stage_data->states, target)) ;
+            }
+        }
+        buffer_printf(out, "} %s ;\n\n", stage_data->parameters->states_enum_name) ;
+    }
+
+    // Emit an enum of all events.
+    if (C_declares_events(stage_data->parameters)) {
+        buffer_printf(out, "typedef enum {\n") ;
+        const size_t n_events = array_cstr_size(stage_data->events) ;
+        for (size_t s = 0; s < n_events; ++ s) {
+            buffer_printf(out, "\t%s,\n", *array_cstr_get(stage_data->events, s));
+        }
+        buffer_printf(out, "} %s ;\n\n", stage_data->parameters->events_enum_name) ;
+    }
+
+    // Emit the callbacks the user has to provide.
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    for (size_t cb = 0; cb < n_callbacks; ++ cb) {
+        if (! callback_composite(stage_data, cb))
+            buffer_printf(out, "void %s(void* user) ;\n"
+                    , *array_cstr_get(stage_data->callbacks, cb)) ;
+    }
+    buffer_printf(out, "\n") ;
+
+    switch (stage_data->parameters->backend) {
+    case CARTEUR_BACKEND_SWITCH: {
+        // Emit one signature per event.
+        const size_t n_events = array_cstr_size(stage_data->events) ;
+        for (size_t ev = 0; ev < n_events; ++ ev) {
+            const char* ev_name = *array_cstr_get(stage_data->events, ev) ;
+            buffer_printf(out, "void %s_handle_%s(%s* state, void* user) ;\n"
+                    , machine_name, ev_name, states_enum_name) ;
+        }
+        break ;
+    }
+    case CARTEUR_BACKEND_TABLE:
+    case CARTEUR_BACKEND_DENSE:
+    case CARTEUR_BACKEND_COMPRESSED:
+        // Emit the single entry point.
+        buffer_printf(out, "void %s_dispatch(%s* state, %s event, void* user) ;\n"
+                , machine_name, states_enum_name, events_enum_name) ;
+        break ;
+    }
+    buffer_printf(out, "\n") ;
+
+    // Emit the profile dump.
+    if (stage_data->parameters->instrument) {
+        buffer_printf(out, "// Write one \"state event count\" line per transition taken so far,\n"
+                      "// to be given back to carteur with the profile option.\n") ;
+        buffer_printf(out, "void %s_dump_profile(FILE* out) ;\n\n", machine_name) ;
+    }
+
+    // Emit the batched step over many instances.
+    if (stage_data->parameters->batch) {
+        buffer_printf(out, "// Step n instances, instance i receiving events[i]. All next states\n"
+                      "// are looked up first, then callbacks run in a second pass, so they\n"
+                      "// see the already updated states. users may be NULL.\n") ;
+        buffer_printf(out, "void %s_step_batch(%s* states, const %s* events, "
+                "void** users, size_t n) ;\n\n"
+                , machine_name, states_enum_name, events_enum_name) ;
+    }
+
+    // Emit the run over a stream of events.
+    if (stage_data->parameters->run) {
+        buffer_printf(out, "// Feed the n events to the machine, in order. The callbacks are the\n"
+                      "// same, in the same order, as when handling the events one by one.\n") ;
+        buffer_printf(out, "void %s_run(%s* state, const %s* events, size_t n, void* user) ;\n\n"
+                , machine_name, states_enum_name, events_enum_name) ;
+    }
+
+    // Emit the thread-safe API.
+    if (stage_data->parameters->atomic) {
+        const char* state_type = C_smallest_uint(array_cstr_size(stage_data->states)) ;
+        buffer_printf(out, "// An instance shared by several threads. Posting an event takes its\n"
+                      "// transition with a compare-and-swap, then runs its callback on the\n"
+                      "// calling thread, after the state changed. Callbacks of concurrent posts\n"
+                      "// may run concurrently, in any order. Returns whether a transition was\n"
+                      "// taken. Initialise with atomic_init.\n") ;
+        buffer_printf(out, "typedef _Atomic(%s) %s_atomic_state ;\n\n", state_type, machine_name) ;
+        buffer_printf(out, "int %s_post(%s_atomic_state* state, %s event, void* user) ;\n\n"
+                , machine_name, machine_name, events_enum_name) ;
+        buffer_printf(out, "// The same, callbacks being deferred to a ring and run one at a time, in\n"
+                      "// the order of the transitions, by the threads that won them (not\n"
+                      "// necessarily their own). A post waits only when the ring is full.\n") ;
+        buffer_printf(out, "#define %s_RING %d\n\n", machine_name, CARTEUR_ATOMIC_RING) ;
+        buffer_printf(out, "typedef struct %s_ordered_slot {\n"
+                      "\t_Atomic uint32_t tag ;\n"
+                      "\tuint32_t callback ;\n"
+                      "\tvoid* user ;\n"
+                      "} %s_ordered_slot ;\n\n", machine_name, machine_name) ;
+        buffer_printf(out, "typedef struct %s_ordered {\n"
+                      "\t_Atomic uint64_t word ;\n"
+                      "\t_Atomic uint32_t drained ;\n"
+                      "\t_Atomic int draining ;\n"
+                      "\t%s_ordered_slot ring[%s_RING] ;\n"
+                      "} %s_ordered ;\n\n", machine_name, machine_name, machine_name, machine_name) ;
+        buffer_printf(out, "void %s_ordered_init(%s_ordered* shared, %s state) ;\n"
+                , machine_name, machine_name, states_enum_name) ;
+        buffer_printf(out, "%s %s_ordered_state(%s_ordered* shared) ;\n"
+                , states_enum_name, machine_name, machine_name) ;
+        buffer_printf(out, "int %s_post_ordered(%s_ordered* shared, %s event, void* user) ;\n\n"
+                , machine_name, machine_name, events_enum_name) ;
+    }
+
+    // Emit the lookups by name.
+    if (stage_data->parameters->from_string) {
+        buffer_printf(out, "// Event or state of the given name (length bytes, not necessarily\n"
+                      "// nul-terminated), or -1 if there is none.\n") ;
+        buffer_printf(out, "int %s_event_from_string(const char* name, size_t length) ;\n"
+                , machine_name) ;
+        buffer_printf(out, "int %s_state_from_string(const char* name, size_t length) ;\n\n"
+                , machine_name) ;
+    }
+
+    // Emit the events enabled in each state.
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    if (stage_data->parameters->enabled_events) {
+        const size_t n_words = enabled_events_words(array_cstr_size(stage_data->events)) ;
+        buffer_printf(out, "// Events having a transition from each state, event e being bit e %% 64\n"
+                      "// of word e / 64.\n") ;
+        buffer_printf(out, "#define %s_EVENT_WORDS %zu\n\n", machine_name, n_words) ;
+        buffer_printf(out, "extern const uint64_t %s_enabled_events_table[%zu][%zu] ;\n\n"
+                , machine_name, (n_states > 0) ? n_states : 1, n_words) ;
+        buffer_printf(out, "static inline const uint64_t* %s_enabled_events(%s state) {\n"
+                      "\treturn %s_enabled_events_table[(size_t) state] ;\n}\n\n"
+                , machine_name, states_enum_name, machine_name) ;
+        buffer_printf(out, "static inline int %s_can_handle(%s state, %s event) {\n"
+                      "\treturn (int) ((%s_enabled_events_table[(size_t) state][(size_t) event / 64]\n"
+                      "\t\t>> ((size_t) event %% 64)) & 1) ;\n}\n\n"
+                , machine_name, states_enum_name, events_enum_name, machine_name) ;
+    }
+
+    // Emit the vectorised step of packed instances on a single event.
+    if (stage_data->parameters->broadcast && (n_states <= CARTEUR_BROADCAST_MAX_STATES)) {
+        buffer_printf(out, "typedef %s %s_packed_state_t ;\n\n"
+                , C_smallest_uint(n_states - 1), machine_name) ;
+        buffer_printf(out, "// Step the n instances packed in from, which all receive event, into\n"
+                      "// to. Bit i of fired, ceil(n / 64) words, is set when instance i has\n"
+                      "// a callback to run. Returns their number. to may be from only when\n"
+                      "// the callbacks are not run, as they are found from the old states.\n") ;
+        buffer_printf(out, "size_t %s_broadcast(%s event, const %s_packed_state_t* from, "
+                "%s_packed_state_t* to, size_t n, uint64_t* fired) ;\n\n"
+                , machine_name, events_enum_name, machine_name, machine_name) ;
+        buffer_printf(out, "// Run the callbacks flagged by %s_broadcast, given from, the states\n"
+                      "// before the step, which must not have been overwritten by it. users\n"
+                      "// may be NULL.\n", machine_name) ;
+        buffer_printf(out, "void %s_broadcast_callbacks(%s event, const %s_packed_state_t* from, "
+                "const uint64_t* fired, void** users, size_t n) ;\n\n"
+                , machine_name, events_enum_name, machine_name) ;
+    }
+
+    // Emit the bit-packed container.
+    if (stage_data->parameters->packed) {
+        const size_t bits = packed_state_bits(n_states) ;
+        const size_t per_word = 64 / bits ;
+        buffer_printf(out, "// Instances packed in %zu bits each, %zu per 64-bit word.\n"
+                , bits, per_word) ;
+        buffer_printf(out, "static inline size_t %s_packed_words(size_t n) {\n"
+                      "\treturn (n + %zu) / %zu ;\n}\n\n"
+                , machine_name, per_word - 1, per_word) ;
+        buffer_printf(out, "%s %s_packed_get(const uint64_t* words, size_t i) ;\n"
+                , states_enum_name, machine_name) ;
+        buffer_printf(out, "void %s_packed_set(uint64_t* words, size_t i, %s state) ;\n"
+                , machine_name, states_enum_name) ;
+        buffer_printf(out, "void %s_packed_step(uint64_t* words, size_t i, %s event, "
+                "void* user) ;\n", machine_name, events_enum_name) ;
+        buffer_printf(out, "// Step the n first instances, all receiving event. users may be NULL.\n") ;
+        buffer_printf(out, "void %s_packed_step_all(uint64_t* words, size_t n, %s event, "
+                "void** users) ;\n", machine_name, events_enum_name) ;
+        buffer_printf(out, "// Step the n first instances, instance i receiving events[i].\n") ;
+        buffer_printf(out, "void %s_packed_step_batch(uint64_t* words, const %s* events, "
+                "void** users, size_t n) ;\n\n", machine_name, events_enum_name) ;
+    }
+}
+
+///
+/// With a profile, a switch expects its most taken case when it accounts for
+/// at least this share of the event.
+///
+#define CARTEUR_PROFILE_DOMINANT_PERCENT 90
+
+///
+/// Switch backend: one function per event, switching on the current state.
+/// This is where big machines spend their generation time, so the cases are
+/// assembled without printf.
+///
+static void generate_C_handler
+    ( buffer_t* out
+    , generation_stage_data_t* stage_data
+    , const size_t ev
+    )
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const size_t* event_offsets = array_size_cget(stage_data->event_offsets, 0) ;
+    if (event_offsets[ev] == event_offsets[ev + 1])
+        return ;
+
+    // With a profile, handlers of events never received are cold, and the
+    // first case, the most taken one, is expected when it dominates.
+    const transition_t* hottest = array_transition_cget(stage_data->transitions, event_offsets[ev]) ;
+    uint64_t event_count = 0 ;
+    for (size_t i = event_offsets[ev]; i < event_offsets[ev + 1]; ++ i) {
+        event_count += (*array_transition_cget(stage_data->transitions, i))->count ;
+    }
+    const bool cold = (stage_data->profile_total > 0) && (event_count == 0) ;
+    const bool expect = (event_count > 0)
+        && (100.0 * (double) (*hottest)->count
+            >= (double) CARTEUR_PROFILE_DOMINANT_PERCENT * (double) event_count) ;
+
+    // Emit top of function.
+    buffer_printf(out, "%svoid %s_handle_%s(%s* state, void* user) {\n"
+                 , cold ? "CARTEUR_COLD " : ""
+                 , machine_name
+                 , *array_cstr_get(stage_data->events, ev)
+                 , stage_data->parameters->states_enum_name) ;
+    if (expect) {
+        buffer_printf(out, "\tswitch (CARTEUR_EXPECT(*state, %s)) {\n"
+                     , *array_cstr_get(stage_data->states, (*hottest)->from)) ;
+    } else {
+        buffer_puts(out, "\tswitch (*state) {\n") ;
+    }
+
+    // Emit cases. A pair declared twice keeps its first transition, the one
+    // the index finds, as its other ones would be duplicate cases.
+    for (size_t i = event_offsets[ev]; i < event_offsets[ev + 1]; ++ i) {
+        const transition_t* ref = array_transition_cget(stage_data->transitions, i) ;
+        if (transition_find(stage_data, (*ref)->from, ev) != i)
+            continue ;
+        buffer_puts(out, "\tcase ") ;
+        buffer_puts(out, *array_cstr_get(stage_data->states, (*ref)->from)) ;
+        buffer_puts(out, ":\n\t\t") ;
+        if (stage_data->parameters->instrument) {
+            buffer_puts(out, "++ ") ;
+            buffer_puts(out, machine_name) ;
+            buffer_puts(out, "_profile_counts[") ;
+            buffer_put_uint(out, i) ;
+            buffer_puts(out, "] ;\n\t\t") ;
+        }
+        buffer_puts(out, *array_cstr_get(stage_data->callbacks, (*ref)->callback)) ;
+        buffer_puts(out, "(user) ;\n\t\t*state = ") ;
+        buffer_puts(out, *array_cstr_get(stage_data->states, (*ref)->to)) ;
+        buffer_puts(out, " ;\n\t\tbreak ;\n") ;
+    }
+
+    // Emit bottom of function.
+    // TODO Give the (default) option to raise an error.
+    buffer_puts(out, "\tdefault:\n\t\t// IMPOSSIBLE\n\t\tbreak ;\n") ;
+    buffer_puts(out, "\t}\n}\n\n") ;
+}
+
+///
+/// Handlers are formatted on several threads, each into the buffer of its
+/// event, so that the output does not depend on the scheduling. Threads take
+/// the events with a stride, which spreads big handlers among them.
+///
+#define CARTEUR_PARALLEL_EMIT_MIN_TRANSITIONS ((size_t) 1 << 14)
+
+typedef struct handlers_task_t {
+    generation_stage_data_t* stage_data ;
+    buffer_t* handlers ;
+    size_t first ;
+    size_t stride ;
+} handlers_task_t ;
+
+static void* generate_C_handlers_task(void* userdata)
+{
+    handlers_task_t* task = (handlers_task_t*) userdata ;
+    const size_t n_events = array_cstr_size(task->stage_data->events) ;
+    for (size_t ev = task->first; ev < n_events; ev += task->stride) {
+        generate_C_handler(&task->handlers[ev], task->stage_data, ev) ;
+    }
+    return NULL ;
+}
+
+///
+/// Fill handlers, which holds one buffer per event, with the given number of
+/// jobs. Small machines are done sequentially.
+///
+void generate_C_source_switch
+    ( buffer_t* handlers
+    , generation_stage_data_t* stage_data
+    , size_t jobs
+    )
+{
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    if (array_transition_size(stage_data->transitions) < CARTEUR_PARALLEL_EMIT_MIN_TRANSITIONS)
+        jobs = 1 ;
+    if (jobs > n_events)
+        jobs = n_events ;
+    if (jobs == 0)
+        return ;
+    handlers_task_t* tasks = malloc(jobs * sizeof(handlers_task_t)) ;
+    for (size_t t = 0; t < jobs; ++ t) {
+        tasks[t].stage_data = stage_data ;
+        tasks[t].handlers = handlers ;
+        tasks[t].first = t ;
+        tasks[t].stride = jobs ;
+    }
+    threads_run(tasks, sizeof(handlers_task_t), jobs, generate_C_handlers_task) ;
+    free(tasks) ;
+}
+
+///
+/// Emit a one-dimensional array of integers named after the machine.
+///
+static void generate_C_vector
+    ( buffer_t* out
+    , generation_stage_data_t* stage_data
+    , const char* vector_name
+    , const char* type
+    , const size_t* values
+    , const size_t n
+    )
+{
+    buffer_printf(out, "static const %s %s_%s[%zu] = {"
+            , type, stage_data->parameters->machine_name, vector_name, n) ;
+    for (size_t i = 0; i < n; ++ i) {
+        buffer_puts(out, (i % 16 == 0) ? "\n\t" : " ") ;
+        buffer_put_uint(out, values[i]) ;
+        buffer_puts(out, ",") ;
+    }
+    buffer_printf(out, "\n} ;\n\n") ;
+}
+
+///
+/// Emit an array of names, as string literals, named after the machine.
+///
+static void generate_C_names
+    ( buffer_t* out
+    , generation_stage_data_t* stage_data
+    , const char* array_name
+    , array_cstr_t names
+    )
+{
+    buffer_printf(out, "static const char* const %s_%s[] = {\n"
+            , stage_data->parameters->machine_name, array_name) ;
+    for (size_t i = 0; i < array_cstr_size(names); ++ i) {
+        buffer_printf(out, "\t\"%s\",\n", *array_cstr_get(names, i)) ;
+    }
+    buffer_printf(out, "\tNULL,\n} ;\n\n") ;
+}
+
+///
+/// Emit the profile counters, n_counts of them, and the dump. The backend
+/// emits the counting itself, and a profile_slot function before this, giving
+/// the state and event of a counter.
+///
+static void generate_C_profile
+    ( buffer_t* out
+    , generation_stage_data_t* stage_data
+    , const size_t n_counts
+    )
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    generate_C_names(out, stage_data, "state_names", stage_data->states) ;
+    generate_C_names(out, stage_data, "event_names", stage_data->events) ;
+    buffer_printf(out, "uint64_t %s_profile_counts[%zu] ;\n\n"
+            , machine_name, (n_counts > 0) ? n_counts : 1) ;
+    buffer_printf(out, "void %s_dump_profile(FILE* out) {\n", machine_name) ;
+    buffer_printf(out, "\tfor (size_t slot = 0; slot < %zu; ++ slot) {\n", n_counts) ;
+    buffer_printf(out, "\t\tif (%s_profile_counts[slot] == 0)\n\t\t\tcontinue ;\n"
+            , machine_name) ;
+    buffer_printf(out, "\t\tsize_t state, event ;\n") ;
+    buffer_printf(out, "\t\t%s_profile_slot(slot, &state, &event) ;\n", machine_name) ;
+    buffer_printf(out, "\t\tfprintf(out, \"%%s %%s %%llu\\n\", %s_state_names[state], "
+            "%s_event_names[event]\n\t\t       , (unsigned long long) %s_profile_counts[slot]) ;\n"
+            , machine_name, machine_name, machine_name) ;
+    buffer_printf(out, "\t}\n}\n\n") ;
+}
+
+///
+/// Switch backend counters, one per transition. The handlers may be spread
+/// over several files, so the counters are not static.
+///
+static void generate_C_profile_switch(buffer_t* out, generation_stage_data_t* stage_data)
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_transitions = array_transition_size(stage_data->transitions) ;
+    size_t* from = malloc((n_transitions + 1) * sizeof(size_t)) ;
+    size_t* event = malloc((n_transitions + 1) * sizeof(size_t)) ;
+    for (size_t i = 0; i < n_transitions; ++ i) {
+        const transition_t* ref = array_transition_cget(stage_data->transitions, i) ;
+        from[i] = (*ref)->from ;
+        event[i] = (*ref)->event ;
+    }
+    generate_C_vector(out, stage_data, "profile_from", C_smallest_uint(n_states)
+                     , from, n_transitions) ;
+    generate_C_vector(out, stage_data, "profile_event", C_smallest_uint(n_events)
+                     , event, n_transitions) ;
+    free(from) ;
+    free(event) ;
+    buffer_printf(out, "static inline void %s_profile_slot(size_t slot, size_t* state, "
+            "size_t* event) {\n", machine_name) ;
+    buffer_printf(out, "\t*state = %s_profile_from[slot] ;\n", machine_name) ;
+    buffer_printf(out, "\t*event = %s_profile_event[slot] ;\n}\n\n", machine_name) ;
+    generate_C_profile(out, stage_data, n_transitions) ;
+}
+
+///
+/// Table backends: a (state x event) table of next states, another one of
+/// callback indices, and one dispatcher doing a couple of loads. The integer
+/// widths are the smallest fitting the number of states and callbacks.
+///
+/// Sparse machines get the row-displacement compressed table instead, which
+/// costs one more load and a comparison. The table backend reports both sizes
+/// and keeps the compressed one when it is at most half the dense one.
+///
+#define CARTEUR_COMPRESSION_THRESHOLD 0.5
+#define CARTEUR_BATCH_CHUNK 256
+
+///
+/// Whether the tables should be compressed, as chosen by the backend, and
+/// report both sizes.
+///
+static bool table_use_compressed
+    ( generation_stage_data_t* stage_data
+    , const compressed_table_t* compressed
+    )
+{
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    const size_t cell_size = smallest_uint_size(n_states)
+                           + smallest_uint_size(n_callbacks) ;
+    const size_t dense_bytes = n_states * n_events * cell_size ;
+    const size_t compressed_bytes = n_states * smallest_uint_size(compressed->max_base)
+        + compressed->length * (cell_size + smallest_uint_size(n_states)) ;
+    const double ratio = (compressed_bytes == 0) ? 1.0
+                       : (double) dense_bytes / (double) compressed_bytes ;
+    bool use_compressed = false ;
+    switch (stage_data->parameters->backend) {
+    case CARTEUR_BACKEND_COMPRESSED:
+        use_compressed = true ;
+        break ;
+    case CARTEUR_BACKEND_DENSE:
+        use_compressed = false ;
+        break ;
+    default:
+        use_compressed = (compressed_bytes
+                <= CARTEUR_COMPRESSION_THRESHOLD * dense_bytes) ;
+        break ;
+    }
+    buffer_printf(stage_data->log, "Machine '%s': dense table %zu bytes, compressed table "
+            "%zu bytes (ratio %.2f), using the %s one.\n"
+            , stage_data->parameters->machine_name, dense_bytes, compressed_bytes, ratio
+            , use_compressed ? "compressed" : "dense") ;
+    return use_compressed ;
+}
+
+///
+/// Emit the callbacks array, the tables, and a static inline lookup giving
+/// the next state and the callback index (0 when impossible) of a pair.
+/// Both the dispatcher and the batched API are written on top of it.
+///
+void generate_C_source_table(buffer_t* out, generation_stage_data_t* stage_data) {
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const char* states_enum_name = stage_data->parameters->states_enum_name ;
+    const char* events_enum_name = stage_data->parameters->events_enum_name ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    const char* state_type = C_smallest_uint(n_states) ;
+    const char* callback_type = C_smallest_uint(n_callbacks) ;
+
+    compressed_table_t compressed ;
+    compressed_table_init(&compressed, stage_data) ;
+    const char* base_type = C_smallest_uint(compressed.max_base) ;
+    const bool use_compressed = table_use_compressed(stage_data, &compressed) ;
+
+    buffer_printf(out, "#include <stddef.h>\n#include <stdint.h>\n\n") ;
+
+    // Emit the callbacks, indexed from 1 in the tables.
+    buffer_printf(out, "static void (* const %s_callbacks[])(void* user) = {\n"
+            , machine_name) ;
+    for (size_t cb = 0; cb < n_callbacks; ++ cb) {
+        buffer_printf(out, "\t%s,\n", *array_cstr_get(stage_data->callbacks, cb)) ;
+    }
+    buffer_printf(out, "} ;\n\n") ;
+
+    if (use_compressed) {
+        generate_C_vector(out, stage_data, "base", base_type
+                         , compressed.base, n_states) ;
+        generate_C_vector(out, stage_data, "check", state_type
+                         , compressed.check, compressed.length) ;
+        generate_C_vector(out, stage_data, "next_state", state_type
+                         , compressed.next, compressed.length) ;
+        generate_C_vector(out, stage_data, "callback_index", callback_type
+                         , compressed.callback, compressed.length) ;
+    } else {
+        dense_table_t table ;
+        dense_table_init(&table, stage_data) ;
+        generate_C_table(out, stage_data, "next_state", state_type
+                        , table.next, table.n_states, table.n_events
+                        , stage_data->states) ;
+        generate_C_table(out, stage_data, "callback_index", callback_type
+                        , table.callback, table.n_states, table.n_events
+                        , stage_data->states) ;
+        dense_table_clear(&table) ;
+    }
+
+    // Emit the profile counters of the dispatcher, one per table cell.
+    const bool instrument = stage_data->parameters->instrument
+                         && (stage_data->parameters->backend != CARTEUR_BACKEND_SWITCH) ;
+    if (instrument) {
+        buffer_printf(out, "static inline void %s_profile_slot(size_t slot, size_t* state, "
+                "size_t* event) {\n", machine_name) ;
+        if (use_compressed) {
+            buffer_printf(out, "\t*state = %s_check[slot] ;\n", machine_name) ;
+            buffer_printf(out, "\t*event = slot - %s_base[*state] ;\n}\n\n", machine_name) ;
+        } else {
+            buffer_printf(out, "\t*state = slot / %zu ;\n", n_events) ;
+            buffer_printf(out, "\t*event = slot %% %zu ;\n}\n\n", n_events) ;
+        }
+        generate_C_profile(out, stage_data
+                          , use_compressed ? compressed.length : n_states * n_events) ;
+    }
+    compressed_table_clear(&compressed) ;
+
+    // Emit the lookup.
+    buffer_printf(out, "static inline %s %s_lookup(%s state, %s event, %s* next) {\n"
+            , callback_type, machine_name, states_enum_name, events_enum_name
+            , states_enum_name) ;
+    if (use_compressed) {
+        buffer_printf(out, "\tconst size_t slot = (size_t) %s_base[state] + event ;\n"
+                , machine_name) ;
+        buffer_printf(out, "\tconst int hit = (%s_check[slot] == state) ;\n"
+                , machine_name) ;
+        buffer_printf(out, "\t*next = hit ? (%s) %s_next_state[slot] : state ;\n"
+                , states_enum_name, machine_name) ;
+        buffer_printf(out, "\treturn hit ? %s_callback_index[slot] : 0 ;\n"
+                , machine_name) ;
+    } else {
+        buffer_printf(out, "\t*next = (%s) %s_next_state[state][event] ;\n"
+                , states_enum_name, machine_name) ;
+        buffer_printf(out, "\treturn %s_callback_index[state][event] ;\n"
+                , machine_name) ;
+    }
+    buffer_printf(out, "}\n\n") ;
+
+    // Emit the dispatcher.
+    if (stage_data->parameters->backend != CARTEUR_BACKEND_SWITCH) {
+        buffer_printf(out, "void %s_dispatch(%s* state, %s event, void* user) {\n"
+                , machine_name, states_enum_name, events_enum_name) ;
+        buffer_printf(out, "\t%s next ;\n", states_enum_name) ;
+        buffer_printf(out, "\tconst %s callback = %s_lookup(*state, event, &next) ;\n"
+                , callback_type, machine_name) ;
+        buffer_printf(out, "\tif (callback != 0) {\n") ;
+        if (instrument && use_compressed) {
+            buffer_printf(out, "\t\t++ %s_profile_counts[(size_t) %s_base[*state] + event] ;\n"
+                    , machine_name, machine_name) ;
+        } else if (instrument) {
+            buffer_printf(out, "\t\t++ %s_profile_counts[(size_t) *state * %zu + event] ;\n"
+                    , machine_name, n_events) ;
+        }
+        buffer_printf(out, "\t\t%s_callbacks[callback - 1](user) ;\n", machine_name) ;
+        buffer_printf(out, "\t\t*state = next ;\n") ;
+        buffer_printf(out, "\t}\n}\n\n") ;
+    }
+
+    // Emit the batched step. Instances are processed by chunks, so that the
+    // callback indices of a chunk stay on the stack and in cache.
+    if (stage_data->parameters->batch) {
+        buffer_printf(out, "void %s_step_batch(%s* states, const %s* events, "
+                "void** users, size_t n) {\n"
+                , machine_name, states_enum_name, events_enum_name) ;
+        buffer_printf(out, "\t%s callbacks[%d] ;\n"
+                , callback_type, CARTEUR_BATCH_CHUNK) ;
+        buffer_printf(out, "\tfor (size_t first = 0; first < n; first += %d) {\n"
+                , CARTEUR_BATCH_CHUNK) ;
+        buffer_printf(out, "\t\tconst size_t count = (n - first < %d) ? n - first : %d ;\n"
+                , CARTEUR_BATCH_CHUNK, CARTEUR_BATCH_CHUNK) ;
+        buffer_printf(out, "\t\tfor (size_t i = 0; i < count; ++ i) {\n") ;
+        buffer_printf(out, "\t\t\tcallbacks[i] = %s_lookup(states[first + i], "
+                "events[first + i], &states[first + i]) ;\n", machine_name) ;
+        buffer_printf(out, "\t\t}\n") ;
+        buffer_printf(out, "\t\tfor (size_t i = 0; i < count; ++ i) {\n") ;
+        buffer_printf(out, "\t\t\tif (callbacks[i] != 0)\n") ;
+        buffer_printf(out, "\t\t\t\t%s_callbacks[callbacks[i] - 1]"
+                "(users ? users[first + i] : NULL) ;\n", machine_name) ;
+        buffer_printf(out, "\t\t}\n\t}\n}\n\n") ;
+    }
+}
+
+///
+/// Broadcast: step many instances, whose states are packed in 8 or 16 bits,
+/// on the same event. Each event gets a column giving the next state and
+/// whether a callback fires, built from the transitions grouped by event.
+///
+/// On x86, with GCC or Clang, the column is used as a lookup table by vector
+/// code picked at runtime from the CPU features. Machines of at most 16
+/// states fit a column in a register, and use pshufb (SSSE3, or AVX2 for 32
+/// instances at a time). Bigger ones use AVX2 gathers from a column packing
+/// the next state and the firing bit in 32-bit words. Anything else uses the
+/// scalar loop, which also finishes the vector loops.
+///
+void generate_C_source_broadcast(buffer_t* out, generation_stage_data_t* stage_data) {
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const char* states_enum_name = stage_data->parameters->states_enum_name ;
+    const char* events_enum_name = stage_data->parameters->events_enum_name ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    if (n_states > CARTEUR_BROADCAST_MAX_STATES) {
+        buffer_printf(stage_data->log, "Machine '%s' has more than %d states, "
+                "broadcast is not generated.\n"
+                , machine_name, CARTEUR_BROADCAST_MAX_STATES) ;
+        return ;
+    }
+    const bool small = (n_states <= 16) ;
+    const size_t width = small ? 16 : n_states ;
+    const size_t packed_size = smallest_uint_size(n_states - 1) ;
+    const char* packed_type = C_smallest_uint(n_states - 1) ;
+    const char* callback_type = C_smallest_uint(n_callbacks) ;
+
+    // Fill the columns, one event group at a time.
+    size_t* next = malloc(n_events * width * sizeof(size_t)) ;
+    size_t* fire = calloc(n_events * width, sizeof(size_t)) ;
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        for (size_t st = 0; st < width; ++ st) {
+            next[ev * width + st] = (st < n_states) ? st : 0 ;
+        }
+    }
+    const size_t* event_offsets = array_size_cget(stage_data->event_offsets, 0) ;
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        size_t* next_column = &next[ev * width] ;
+        size_t* fire_column = &fire[ev * width] ;
+        for (size_t i = event_offsets[ev]; i < event_offsets[ev + 1]; ++ i) {
+            const transition_t* ref = array_transition_cget(stage_data->transitions, i) ;
+            if (fire_column[(*ref)->from] != 0)
+                continue ;
+            next_column[(*ref)->from] = (*ref)->to ;
+            fire_column[(*ref)->from] = 0x80 ;
+        }
+    }
+
+    generate_C_table(out, stage_data, "column_next", packed_type
+                    , next, n_events, width, stage_data->events) ;
+    generate_C_table(out, stage_data, "column_fire", "uint8_t"
+                    , fire, n_events, width, stage_data->events) ;
+    if (! small) {
+        for (size_t i = 0; i < n_events * width; ++ i) {
+            next[i] |= (fire[i] != 0) ? 0x80000000ul : 0ul ;
+        }
+        generate_C_table(out, stage_data, "column_code", "uint32_t"
+                        , next, n_events, width, stage_data->events) ;
+    }
+    free(next) ;
+    free(fire) ;
+
+    buffer_printf(out,
+        "#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))\n"
+        "#define CARTEUR_X86_SIMD 1\n"
+        "#include <immintrin.h>\n"
+        "#endif\n"
+        "#include <string.h>\n\n") ;
+
+    // Scalar version, also used for the remainder of vector loops.
+    buffer_printf(out,
+        "static size_t %s_broadcast_scalar(%s event, const %s* from, %s* to, "
+        "size_t first, size_t n, uint64_t* fired) {\n"
+        "\tconst %s* next = %s_column_next[event] ;\n"
+        "\tconst uint8_t* fire = %s_column_fire[event] ;\n"
+        "\tsize_t count = 0 ;\n"
+        "\tfor (size_t i = first; i < n; ++ i) {\n"
+        "\t\tconst %s state = from[i] ;\n"
+        "\t\tconst uint64_t bit = fire[state] >> 7 ;\n"
+        "\t\tfired[i / 64] |= bit << (i %% 64) ;\n"
+        "\t\tcount += bit ;\n"
+        "\t\tto[i] = next[state] ;\n"
+        "\t}\n"
+        "\treturn count ;\n"
+        "}\n\n"
+        , machine_name, events_enum_name, packed_type, packed_type
+        , packed_type, machine_name, machine_name, packed_type) ;
+
+    buffer_printf(out, "#if defined(CARTEUR_X86_SIMD)\n\n") ;
+    if (small) {
+        // The column holds in one register, use it as a shuffle.
+        buffer_printf(out,
+            "__attribute__((target(\"ssse3\")))\n"
+            "static size_t %s_broadcast_ssse3(%s event, const uint8_t* from, uint8_t* to, "
+            "size_t n, uint64_t* fired) {\n"
+            "\tconst __m128i next = _mm_loadu_si128((const __m128i*) %s_column_next[event]) ;\n"
+            "\tconst __m128i fire = _mm_loadu_si128((const __m128i*) %s_column_fire[event]) ;\n"
+            "\tsize_t count = 0 ;\n"
+            "\tsize_t i = 0 ;\n"
+            "\tfor (; i + 16 <= n; i += 16) {\n"
+            "\t\tconst __m128i states = _mm_loadu_si128((const __m128i*) &from[i]) ;\n"
+            "\t\tconst uint64_t bits = (uint32_t) _mm_movemask_epi8(_mm_shuffle_epi8(fire, states)) ;\n"
+            "\t\t_mm_storeu_si128((__m128i*) &to[i], _mm_shuffle_epi8(next, states)) ;\n"
+            "\t\tfired[i / 64] |= bits << (i %% 64) ;\n"
+            "\t\tcount += (size_t) __builtin_popcountll(bits) ;\n"
+            "\t}\n"
+            "\treturn count + %s_broadcast_scalar(event, from, to, i, n, fired) ;\n"
+            "}\n\n"
+            , machine_name, events_enum_name, machine_name, machine_name, machine_name) ;
+        buffer_printf(out,
+            "__attribute__((target(\"avx2\")))\n"
+            "static size_t %s_broadcast_avx2(%s event, const uint8_t* from, uint8_t* to, "
+            "size_t n, uint64_t* fired) {\n"
+            "\tconst __m256i next = _mm256_broadcastsi128_si256("
+            "_mm_loadu_si128((const __m128i*) %s_column_next[event])) ;\n"
+            "\tconst __m256i fire = _mm256_broadcastsi128_si256("
+            "_mm_loadu_si128((const __m128i*) %s_column_fire[event])) ;\n"
+            "\tsize_t count = 0 ;\n"
+            "\tsize_t i = 0 ;\n"
+            "\tfor (; i + 32 <= n; i += 32) {\n"
+            "\t\tconst __m256i states = _mm256_loadu_si256((const __m256i*) &from[i]) ;\n"
+            "\t\tconst uint64_t bits = (uint32_t) _mm256_movemask_epi8(_mm256_shuffle_epi8(fire, states)) ;\n"
+            "\t\t_mm256_storeu_si256((__m256i*) &to[i], _mm256_shuffle_epi8(next, states)) ;\n"
+            "\t\tfired[i / 64] |= bits << (i %% 64) ;\n"
+            "\t\tcount += (size_t) __builtin_popcountll(bits) ;\n"
+            "\t}\n"
+            "\treturn count + %s_broadcast_scalar(event, from, to, i, n, fired) ;\n"
+            "}\n\n"
+            , machine_name, events_enum_name, machine_name, machine_name, machine_name) ;
+    } else {
+        // Gather 8 instances at a time from the 32-bit column.
+        buffer_printf(out,
+            "__attribute__((target(\"avx2\")))\n"
+            "static size_t %s_broadcast_avx2(%s event, const %s* from, %s* to, "
+            "size_t n, uint64_t* fired) {\n"
+            "\tconst int* code = (const int*) %s_column_code[event] ;\n"
+            "\tconst __m256i mask = _mm256_set1_epi32(0x7FFFFFFF) ;\n"
+            "\tsize_t count = 0 ;\n"
+            "\tsize_t i = 0 ;\n"
+            "\tfor (; i + 8 <= n; i += 8) {\n"
+            , machine_name, events_enum_name, packed_type, packed_type, machine_name) ;
+        if (packed_size == 1) {
+            buffer_printf(out, "\t\tconst __m256i states = _mm256_cvtepu8_epi32("
+                    "_mm_loadl_epi64((const __m128i*) &from[i])) ;\n") ;
+        } else {
+            buffer_printf(out, "\t\tconst __m256i states = _mm256_cvtepu16_epi32("
+                    "_mm_loadu_si128((const __m128i*) &from[i])) ;\n") ;
+        }
+        buffer_printf(out,
+            "\t\tconst __m256i codes = _mm256_i32gather_epi32(code, states, 4) ;\n"
+            "\t\tconst uint64_t bits = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(codes)) ;\n"
+            "\t\tconst __m256i next = _mm256_and_si256(codes, mask) ;\n"
+            "\t\tconst __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(next), "
+            "_mm256_extracti128_si256(next, 1)) ;\n") ;
+        if (packed_size == 1) {
+            buffer_printf(out, "\t\t_mm_storel_epi64((__m128i*) &to[i], "
+                    "_mm_packus_epi16(packed, packed)) ;\n") ;
+        } else {
+            buffer_printf(out, "\t\t_mm_storeu_si128((__m128i*) &to[i], packed) ;\n") ;
+        }
+        buffer_printf(out,
+            "\t\tfired[i / 64] |= bits << (i %% 64) ;\n"
+            "\t\tcount += (size_t) __builtin_popcountll(bits) ;\n"
+            "\t}\n"
+            "\treturn count + %s_broadcast_scalar(event, from, to, i, n, fired) ;\n"
+            "}\n\n"
+            , machine_name) ;
+    }
+    buffer_printf(out, "#endif\n\n") ;
+
+    // Entry point, picking the best version for the running CPU.
+    buffer_printf(out,
+        "size_t %s_broadcast(%s event, const %s_packed_state_t* from, "
+        "%s_packed_state_t* to, size_t n, uint64_t* fired) {\n"
+        "\tmemset(fired, 0, ((n + 63) / 64) * sizeof(uint64_t)) ;\n"
+        "#if defined(CARTEUR_X86_SIMD)\n"
+        "\tif (__builtin_cpu_supports(\"avx2\"))\n"
+        "\t\treturn %s_broadcast_avx2(event, from, to, n, fired) ;\n"
+        , machine_name, events_enum_name, machine_name, machine_name, machine_name) ;
+    if (small) {
+        buffer_printf(out,
+            "\tif (__builtin_cpu_supports(\"ssse3\"))\n"
+            "\t\treturn %s_broadcast_ssse3(event, from, to, n, fired) ;\n"
+            , machine_name) ;
+    }
+    buffer_printf(out,
+        "#endif\n"
+        "\treturn %s_broadcast_scalar(event, from, to, 0, n, fired) ;\n"
+        "}\n\n"
+        , machine_name) ;
+
+    // Callbacks of the instances flagged above.
+    buffer_printf(out,
+        "void %s_broadcast_callbacks(%s event, const %s_packed_state_t* from, "
+        "const uint64_t* fired, void** users, size_t n) {\n"
+        "\tfor (size_t word = 0; word < (n + 63) / 64; ++ word) {\n"
+        "\t\tfor (uint64_t bits = fired[word]; bits != 0; bits &= bits - 1) {\n"
+        "#if defined(__GNUC__) || defined(__clang__)\n"
+        "\t\t\tconst size_t i = word * 64 + (size_t) __builtin_ctzll(bits) ;\n"
+        "#else\n"
+        "\t\t\tsize_t i = word * 64 ;\n"
+        "\t\t\tfor (uint64_t b = bits; (b & 1) == 0; b >>= 1)\n"
+        "\t\t\t\t++ i ;\n"
+        "#endif\n"
+        "\t\t\t%s next ;\n"
+        "\t\t\tconst %s callback = %s_lookup((%s) from[i], event, &next) ;\n"
+        "\t\t\tif (callback != 0)\n"
+        "\t\t\t\t%s_callbacks[callback - 1](users ? users[i] : NULL) ;\n"
+        "\t\t}\n"
+        "\t}\n"
+        "}\n\n"
+        , machine_name, events_enum_name, machine_name
+        , states_enum_name, callback_type, machine_name, states_enum_name
+        , machine_name) ;
+}
+
+///
+/// Packed container: each instance takes ceil(log2(n_states)) bits in an
+/// array of 64-bit words. The step functions load and store whole words,
+/// and update the instances of a word in a register.
+///
+void generate_C_source_packed(buffer_t* out, generation_stage_data_t* stage_data) {
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const char* states_enum_name = stage_data->parameters->states_enum_name ;
+    const char* events_enum_name = stage_data->parameters->events_enum_name ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    const char* callback_type = C_smallest_uint(n_callbacks) ;
+    const size_t bits = packed_state_bits(n_states) ;
+    const size_t per_word = 64 / bits ;
+    const uint64_t mask = (bits == 64) ? UINT64_MAX : (((uint64_t) 1 << bits) - 1) ;
+
+    buffer_printf(out,
+        "%s %s_packed_get(const uint64_t* words, size_t i) {\n"
+        "\tconst unsigned shift = (unsigned) (i %% %zu) * %zu ;\n"
+        "\treturn (%s) ((words[i / %zu] >> shift) & 0x%llxull) ;\n"
+        "}\n\n"
+        , states_enum_name, machine_name, per_word, bits
+        , states_enum_name, per_word, (unsigned long long) mask) ;
+
+    buffer_printf(out,
+        "void %s_packed_set(uint64_t* words, size_t i, %s state) {\n"
+        "\tconst unsigned shift = (unsigned) (i %% %zu) * %zu ;\n"
+        "\tuint64_t* word = &words[i / %zu] ;\n"
+        "\t*word = (*word & ~(0x%llxull << shift)) | ((uint64_t) state << shift) ;\n"
+        "}\n\n"
+        , machine_name, states_enum_name, per_word, bits, per_word
+        , (unsigned long long) mask) ;
+
+    buffer_printf(out,
+        "void %s_packed_step(uint64_t* words, size_t i, %s event, void* user) {\n"
+        "\t%s next ;\n"
+        "\tconst %s callback = %s_lookup(%s_packed_get(words, i), event, &next) ;\n"
+        "\tif (callback != 0) {\n"
+        "\t\t%s_callbacks[callback - 1](user) ;\n"
+        "\t\t%s_packed_set(words, i, next) ;\n"
+        "\t}\n"
+        "}\n\n"
+        , machine_name, events_enum_name, states_enum_name, callback_type
+        , machine_name, machine_name, machine_name, machine_name) ;
+
+    // Both loops share the same body, but for the event of each instance.
+    char batch_event[64] ;
+    snprintf(batch_event, sizeof(batch_event), "events[w * %zu + j]", per_word) ;
+    for (int all = 1; all >= 0; -- all) {
+        if (all) {
+            buffer_printf(out, "void %s_packed_step_all(uint64_t* words, size_t n, "
+                    "%s event, void** users) {\n", machine_name, events_enum_name) ;
+        } else {
+            buffer_printf(out, "void %s_packed_step_batch(uint64_t* words, const %s* events, "
+                    "void** users, size_t n) {\n", machine_name, events_enum_name) ;
+        }
+        buffer_printf(out,
+            "\tfor (size_t w = 0; w * %zu < n; ++ w) {\n"
+            "\t\tconst uint64_t word = words[w] ;\n"
+            "\t\tuint64_t stepped = word ;\n"
+            "\t\tconst size_t count = (n - w * %zu < %zu) ? n - w * %zu : %zu ;\n"
+            "\t\tfor (size_t j = 0; j < count; ++ j) {\n"
+            "\t\t\tconst unsigned shift = (unsigned) j * %zu ;\n"
+            "\t\t\t%s next ;\n"
+            "\t\t\tconst %s callback = %s_lookup((%s) ((word >> shift) & 0x%llxull), "
+            "%s, &next) ;\n"
+            , per_word, per_word, per_word, per_word, per_word, bits
+            , states_enum_name, callback_type, machine_name, states_enum_name
+            , (unsigned long long) mask, all ? "event" : batch_event) ;
+        buffer_printf(out,
+            "\t\t\tif (callback != 0) {\n"
+            "\t\t\t\t%s_callbacks[callback - 1](users ? users[w * %zu + j] : NULL) ;\n"
+            "\t\t\t\tstepped = (stepped & ~(0x%llxull << shift)) | ((uint64_t) next << shift) ;\n"
+            "\t\t\t}\n"
+            "\t\t}\n"
+            "\t\twords[w] = stepped ;\n"
+            "\t}\n"
+            "}\n\n"
+            , machine_name, per_word, (unsigned long long) mask) ;
+    }
+}
+
+///
+/// The run is direct-threaded with GCC and Clang: each state is a label,
+/// reading the next event and jumping through the event table of the state
+/// to the code of the transition, which jumps to the label of the next
+/// state. Ignored events jump back to the state. Other compilers, or
+/// machines whose event tables would be too big, get a loop over a switch
+/// on the state, then on the event.
+///
+#define CARTEUR_RUN_MAX_CELLS ((size_t) 1 << 22)
+
+void generate_C_source_run(buffer_t* out, generation_stage_data_t* stage_data) {
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const char* states_enum_name = stage_data->parameters->states_enum_name ;
+    const char* events_enum_name = stage_data->parameters->events_enum_name ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_transitions = array_transition_size(stage_data->transitions) ;
+    const size_t* state_offsets = array_size_cget(stage_data->state_offsets, 0) ;
+    const size_t* state_index = (n_transitions > 0)
+                              ? array_size_cget(stage_data->state_index, 0) : NULL ;
+    const bool threaded = (n_events > 0) && (n_states * n_events <= CARTEUR_RUN_MAX_CELLS) ;
+    if ((n_events > 0) && ! threaded)
+        buffer_printf(stage_data->log, "Machine '%s' has more than %zu (state, event) pairs, "
+                "its run is not threaded.\n", machine_name, CARTEUR_RUN_MAX_CELLS) ;
+
+    buffer_printf(out, "void %s_run(%s* state, const %s* events, size_t n, void* user) {\n"
+            , machine_name, states_enum_name, events_enum_name) ;
+    if (threaded) {
+        buffer_printf(out, "#if defined(__GNUC__)\n") ;
+        buffer_printf(out, "\tconst %s* const end = events + n ;\n", events_enum_name) ;
+
+        // Event tables. A pair declared twice keeps its first transition.
+        size_t* target = malloc(n_events * sizeof(size_t)) ;
+        for (size_t s = 0; s < n_states; ++ s) {
+            for (size_t ev = 0; ev < n_events; ++ ev) {
+                target[ev] = SIZE_MAX ;
+            }
+            for (size_t i = state_offsets[s + 1]; i > state_offsets[s]; -- i) {
+                const size_t t = state_index[i - 1] ;
+                target[(*array_transition_cget(stage_data->transitions, t))->event] = t ;
+            }
+            buffer_printf(out, "\tstatic void* const state_%zu_events[%zu] = {", s, n_events) ;
+            for (size_t ev = 0; ev < n_events; ++ ev) {
+                buffer_puts(out, (ev % 8 == 0) ? "\n\t\t" : " ") ;
+                if (target[ev] == SIZE_MAX) {
+                    buffer_puts(out, "&&state_") ;
+                    buffer_put_uint(out, s) ;
+                } else {
+                    buffer_puts(out, "&&transition_") ;
+                    buffer_put_uint(out, target[ev]) ;
+                }
+                buffer_puts(out, ",") ;
+            }
+            buffer_puts(out, "\n\t} ;\n") ;
+        }
+        free(target) ;
+        buffer_printf(out, "\tstatic void* const states[%zu] = {", n_states) ;
+        for (size_t s = 0; s < n_states; ++ s) {
+            buffer_puts(out, (s % 8 == 0) ? "\n\t\t&&state_" : " &&state_") ;
+            buffer_put_uint(out, s) ;
+            buffer_puts(out, ",") ;
+        }
+        buffer_puts(out, "\n\t} ;\n") ;
+        buffer_puts(out, "\tgoto *states[*state] ;\n") ;
+
+        // States, each followed by the transitions leaving it.
+        for (size_t s = 0; s < n_states; ++ s) {
+            buffer_printf(out, "state_%zu:\n", s) ;
+            buffer_puts(out, "\tif (events == end)\n\t\treturn ;\n") ;
+            buffer_printf(out, "\tgoto *state_%zu_events[*events ++] ;\n", s) ;
+            for (size_t i = state_offsets[s]; i < state_offsets[s + 1]; ++ i) {
+                const transition_t* ref = array_transition_cget(stage_data->transitions, state_index[i]) ;
+                if ((i > state_offsets[s])
+                    && ((*array_transition_cget(stage_data->transitions, state_index[i - 1]))->event
+                        == (*ref)->event))
+                    continue ;
+                buffer_printf(out, "transition_%zu:\n", state_index[i]) ;
+                buffer_printf(out, "\t%s(user) ;\n"
+                        , *array_cstr_get(stage_data->callbacks, (*ref)->callback)) ;
+                buffer_printf(out, "\t*state = %s ;\n"
+                        , *array_cstr_get(stage_data->states, (*ref)->to)) ;
+                buffer_printf(out, "\tgoto state_%zu ;\n", (*ref)->to) ;
+            }
+        }
+        buffer_printf(out, "#else\n") ;
+    }
+
+    // Switch loop.
+    buffer_puts(out, "\tfor (size_t i = 0; i < n; ++ i) {\n") ;
+    buffer_puts(out, "\t\tswitch (*state) {\n") ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        if (state_offsets[s] == state_offsets[s + 1])
+            continue ;
+        buffer_printf(out, "\t\tcase %s:\n", *array_cstr_get(stage_data->states, s)) ;
+        buffer_puts(out, "\t\t\tswitch (events[i]) {\n") ;
+        for (size_t i = state_offsets[s]; i < state_offsets[s + 1]; ++ i) {
+            const transition_t* ref = array_transition_cget(stage_data->transitions, state_index[i]) ;
+            if ((i > state_offsets[s])
+                && ((*array_transition_cget(stage_data->transitions, state_index[i - 1]))->event
+                    == (*ref)->event))
+                continue ;
+            buffer_printf(out, "\t\t\tcase %s:\n", *array_cstr_get(stage_data->events, (*ref)->event)) ;
+            buffer_printf(out, "\t\t\t\t%s(user) ;\n"
+                    , *array_cstr_get(stage_data->callbacks, (*ref)->callback)) ;
+            buffer_printf(out, "\t\t\t\t*state = %s ;\n\t\t\t\tbreak ;\n"
+                    , *array_cstr_get(stage_data->states, (*ref)->to)) ;
+        }
+        buffer_puts(out, "\t\t\tdefault:\n\t\t\t\tbreak ;\n\t\t\t}\n\t\t\tbreak ;\n") ;
+    }
+    buffer_puts(out, "\t\tdefault:\n\t\t\tbreak ;\n\t\t}\n\t}\n") ;
+    if (threaded)
+        buffer_puts(out, "#endif\n") ;
+    buffer_puts(out, "}\n\n") ;
+}
+
+///
+/// Thread-safe API, on top of the lookup. The state of an instance is an
+/// atomic integer, and a transition a compare-and-swap from the state that
+/// was looked up, retried when another thread changed it meanwhile.
+///
+/// The ordered instances keep a sequence number of their transitions in the
+/// upper half of the same word, so that the winner of a transition knows its
+/// rank, and stores its callback in that slot of a ring. Whoever holds the
+/// draining flag runs the published callbacks in order. After releasing the
+/// flag, a drainer checks the next slot again, so that a callback published
+/// meanwhile by a thread which could not get the flag is not left behind.
+///
+void generate_C_source_atomic(buffer_t* out, generation_stage_data_t* stage_data) {
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const char* states_enum_name = stage_data->parameters->states_enum_name ;
+    const char* events_enum_name = stage_data->parameters->events_enum_name ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    const char* state_type = C_smallest_uint(n_states) ;
+    const char* callback_type = C_smallest_uint(n_callbacks) ;
+
+    // Unordered.
+    buffer_printf(out, "int %s_post(%s_atomic_state* state, %s event, void* user) {\n"
+            , machine_name, machine_name, events_enum_name) ;
+    buffer_printf(out, "\t%s from = atomic_load_explicit(state, memory_order_acquire) ;\n"
+            , state_type) ;
+    buffer_printf(out, "\t%s callback ;\n", callback_type) ;
+    buffer_printf(out, "\tfor (;;) {\n") ;
+    buffer_printf(out, "\t\t%s next ;\n", states_enum_name) ;
+    buffer_printf(out, "\t\tcallback = %s_lookup((%s) from, event, &next) ;\n"
+            , machine_name, states_enum_name) ;
+    buffer_printf(out, "\t\tif (callback == 0)\n\t\t\treturn 0 ;\n") ;
+    buffer_printf(out, "\t\tif (atomic_compare_exchange_weak_explicit(state, &from, (%s) next\n"
+            "\t\t        , memory_order_acq_rel, memory_order_acquire))\n\t\t\tbreak ;\n"
+            , state_type) ;
+    buffer_printf(out, "\t}\n") ;
+    buffer_printf(out, "\t%s_callbacks[callback - 1](user) ;\n", machine_name) ;
+    buffer_printf(out, "\treturn 1 ;\n}\n\n") ;
+
+    // Ordered. A post waiting for room in the ring yields, since the thread it
+    // waits for may well be preempted on the same processor.
+    buffer_printf(out, "#if defined(__unix__) || defined(__APPLE__)\n#include <sched.h>\n"
+            "#define %s_YIELD() sched_yield()\n#else\n#define %s_YIELD() ((void) 0)\n"
+            "#endif\n\n", machine_name, machine_name) ;
+    buffer_printf(out, "void %s_ordered_init(%s_ordered* shared, %s state) {\n"
+            , machine_name, machine_name, states_enum_name) ;
+    buffer_printf(out, "\tatomic_init(&shared->word, (uint64_t) state) ;\n") ;
+    buffer_printf(out, "\tatomic_init(&shared->drained, 0) ;\n") ;
+    buffer_printf(out, "\tatomic_init(&shared->draining, 0) ;\n") ;
+    buffer_printf(out, "\tfor (size_t i = 0; i < %s_RING; ++ i) {\n", machine_name) ;
+    buffer_printf(out, "\t\tatomic_init(&shared->ring[i].tag, 0) ;\n\t}\n}\n\n") ;
+    buffer_printf(out, "%s %s_ordered_state(%s_ordered* shared) {\n"
+            , states_enum_name, machine_name, machine_name) ;
+    buffer_printf(out, "\treturn (%s) (uint32_t) atomic_load(&shared->word) ;\n}\n\n"
+            , states_enum_name) ;
+    buffer_printf(out, "static void %s_drain(%s_ordered* shared) {\n", machine_name, machine_name) ;
+    buffer_printf(out, "\tfor (;;) {\n") ;
+    buffer_printf(out, "\t\tif (atomic_exchange(&shared->draining, 1) != 0)\n\t\t\treturn ;\n") ;
+    buffer_printf(out, "\t\tuint32_t rank = atomic_load_explicit(&shared->drained, "
+            "memory_order_relaxed) ;\n") ;
+    buffer_printf(out, "\t\tfor (;;) {\n") ;
+    buffer_printf(out, "\t\t\t%s_ordered_slot* slot = &shared->ring[rank %% %s_RING] ;\n"
+            , machine_name, machine_name) ;
+    buffer_printf(out, "\t\t\tif (atomic_load_explicit(&slot->tag, memory_order_acquire) "
+            "!= rank + 1)\n\t\t\t\tbreak ;\n") ;
+    buffer_printf(out, "\t\t\t%s_callbacks[slot->callback - 1](slot->user) ;\n", machine_name) ;
+    buffer_printf(out, "\t\t\tatomic_store_explicit(&shared->drained, ++ rank, "
+            "memory_order_release) ;\n") ;
+    buffer_printf(out, "\t\t}\n") ;
+    buffer_printf(out, "\t\tatomic_store(&shared->draining, 0) ;\n") ;
+    buffer_printf(out, "\t\tif (atomic_load(&shared->ring[rank %% %s_RING].tag) != rank + 1)\n"
+            "\t\t\treturn ;\n", machine_name) ;
+    buffer_printf(out, "\t}\n}\n\n") ;
+    buffer_printf(out, "int %s_post_ordered(%s_ordered* shared, %s event, void* user) {\n"
+            , machine_name, machine_name, events_enum_name) ;
+    buffer_printf(out, "\tuint64_t word = atomic_load_explicit(&shared->word, memory_order_acquire) ;\n") ;
+    buffer_printf(out, "\t%s callback ;\n", callback_type) ;
+    buffer_printf(out, "\tfor (;;) {\n") ;
+    buffer_printf(out, "\t\t%s next ;\n", states_enum_name) ;
+    buffer_printf(out, "\t\tcallback = %s_lookup((%s) (uint32_t) word, event, &next) ;\n"
+            , machine_name, states_enum_name) ;
+    buffer_printf(out, "\t\tif (callback == 0)\n\t\t\treturn 0 ;\n") ;
+    buffer_printf(out, "\t\tconst uint64_t taken = (((word >> 32) + 1) << 32) | (uint64_t) next ;\n") ;
+    buffer_printf(out, "\t\tif (atomic_compare_exchange_weak_explicit(&shared->word, &word, taken\n"
+            "\t\t        , memory_order_acq_rel, memory_order_acquire))\n\t\t\tbreak ;\n") ;
+    buffer_printf(out, "\t}\n") ;
+    buffer_printf(out, "\tconst uint32_t rank = (uint32_t) (word >> 32) ;\n") ;
+    buffer_printf(out, "\twhile ((uint32_t) (rank - atomic_load(&shared->drained)) >= %s_RING) {\n"
+            "\t\t%s_drain(shared) ;\n\t\t%s_YIELD() ;\n\t}\n", machine_name, machine_name
+            , machine_name) ;
+    buffer_printf(out, "\t%s_ordered_slot* slot = &shared->ring[rank %% %s_RING] ;\n"
+            , machine_name, machine_name) ;
+    buffer_printf(out, "\tslot->callback = callback ;\n\tslot->user = user ;\n") ;
+    buffer_printf(out, "\tatomic_store(&slot->tag, rank + 1) ;\n") ;
+    buffer_printf(out, "\t%s_drain(shared) ;\n", machine_name) ;
+    buffer_printf(out, "\treturn 1 ;\n}\n\n") ;
+}
+
+///
+/// Standalone benchmark of the thread-safe API, posting events from 1 to N
+/// threads to a single instance, against a mutex around the non thread-safe
+/// step. It defines the callbacks itself, as counters.
+///
+void generate_C_atomic_benchmark(buffer_t* out, generation_stage_data_t* stage_data) {
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const char* states_enum_name = stage_data->parameters->states_enum_name ;
+    const char* events_enum_name = stage_data->parameters->events_enum_name ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    const bool dispatch = (stage_data->parameters->backend != CARTEUR_BACKEND_SWITCH) ;
+    buffer_printf(out, "// Benchmark generated by carteur. Build with\n"
+            "//     cc -O2 generated_%s_bench.c generated_%s.c -lpthread\n"
+            "// and run with the maximal number of threads as argument.\n\n"
+            , machine_name, machine_name) ;
+    buffer_printf(out, "#define _POSIX_C_SOURCE 200809L\n\n") ;
+    buffer_printf(out, "#include \"generated_%s.h\"\n\n", machine_name) ;
+    buffer_printf(out, "#include <pthread.h>\n#include <stdio.h>\n#include <stdlib.h>\n"
+            "#include <time.h>\n\n") ;
+    buffer_printf(out, "#define POSTS 1000000\n\n") ;
+    buffer_printf(out, "typedef struct bench_thread {\n"
+            "\tpthread_t thread ;\n\tint mode ;\n\tunsigned seed ;\n\tsize_t callbacks ;\n"
+            "} bench_thread ;\n\n") ;
+    for (size_t cb = 0; cb < n_callbacks; ++ cb) {
+        if (! callback_composite(stage_data, cb))
+            buffer_printf(out, "void %s(void* user) { ++ ((bench_thread*) user)->callbacks ; }\n"
+                    , *array_cstr_get(stage_data->callbacks, cb)) ;
+    }
+    buffer_printf(out, "\nstatic pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER ;\n") ;
+    buffer_printf(out, "static %s state ;\n", states_enum_name) ;
+    buffer_printf(out, "static %s_atomic_state atomic_state ;\n", machine_name) ;
+    buffer_printf(out, "static %s_ordered ordered ;\n\n", machine_name) ;
+    if (! dispatch) {
+        buffer_printf(out, "static void (* const handlers[%zu])(%s*, void*) = {\n"
+                , n_events, states_enum_name) ;
+        for (size_t ev = 0; ev < n_events; ++ ev) {
+            buffer_printf(out, "\t%s_handle_%s,\n", machine_name
+                    , *array_cstr_get(stage_data->events, ev)) ;
+        }
+        buffer_printf(out, "} ;\n\n") ;
+    }
+    buffer_printf(out, "static void* bench_run(void* userdata) {\n") ;
+    buffer_printf(out, "\tbench_thread* self = userdata ;\n") ;
+    buffer_printf(out, "\tunsigned x = self->seed ;\n") ;
+    buffer_printf(out, "\tfor (size_t i = 0; i < POSTS; ++ i) {\n") ;
+    buffer_printf(out, "\t\tx ^= x << 13 ; x ^= x >> 17 ; x ^= x << 5 ;\n") ;
+    buffer_printf(out, "\t\tconst %s event = (%s) (x %% %zu) ;\n"
+            , events_enum_name, events_enum_name, n_events) ;
+    buffer_printf(out, "\t\tswitch (self->mode) {\n") ;
+    buffer_printf(out, "\t\tcase 0:\n\t\t\tpthread_mutex_lock(&mutex) ;\n") ;
+    if (dispatch) {
+        buffer_printf(out, "\t\t\t%s_dispatch(&state, event, self) ;\n", machine_name) ;
+    } else {
+        buffer_printf(out, "\t\t\thandlers[event](&state, self) ;\n") ;
+    }
+    buffer_printf(out, "\t\t\tpthread_mutex_unlock(&mutex) ;\n\t\t\tbreak ;\n") ;
+    buffer_printf(out, "\t\tcase 1:\n\t\t\t%s_post(&atomic_state, event, self) ;\n\t\t\tbreak ;\n"
+            , machine_name) ;
+    buffer_printf(out, "\t\tdefault:\n\t\t\t%s_post_ordered(&ordered, event, self) ;\n"
+            "\t\t\tbreak ;\n\t\t}\n\t}\n\treturn NULL ;\n}\n\n", machine_name) ;
+    buffer_printf(out, "int main(int argc, char** argv) {\n") ;
+    buffer_printf(out, "\tconst int max_threads = (argc > 1) ? atoi(argv[1]) : 8 ;\n") ;
+    buffer_printf(out, "\tconst char* modes[3] = { \"mutex\", \"atomic\", \"ordered\" } ;\n") ;
+    buffer_printf(out, "\tbench_thread* threads = calloc((size_t) max_threads, sizeof(bench_thread)) ;\n") ;
+    buffer_printf(out, "\tprintf(\"threads\") ;\n") ;
+    buffer_printf(out, "\tfor (int mode = 0; mode < 3; ++ mode) {\n"
+            "\t\tprintf(\" %%14s\", modes[mode]) ;\n\t}\n") ;
+    buffer_printf(out, "\tprintf(\"   (millions of posts per second)\\n\") ;\n") ;
+    buffer_printf(out, "\tfor (int n = 1; n <= max_threads; n *= 2) {\n") ;
+    buffer_printf(out, "\t\tprintf(\"%%7d\", n) ;\n") ;
+    buffer_printf(out, "\t\tfor (int mode = 0; mode < 3; ++ mode) {\n") ;
+    buffer_printf(out, "\t\t\tstate = (%s) 0 ;\n", states_enum_name) ;
+    buffer_printf(out, "\t\t\tatomic_store(&atomic_state, 0) ;\n") ;
+    buffer_printf(out, "\t\t\t%s_ordered_init(&ordered, (%s) 0) ;\n", machine_name, states_enum_name) ;
+    buffer_printf(out, "\t\t\tstruct timespec start, end ;\n") ;
+    buffer_printf(out, "\t\t\tclock_gettime(CLOCK_MONOTONIC, &start) ;\n") ;
+    buffer_printf(out, "\t\t\tfor (int t = 0; t < n; ++ t) {\n") ;
+    buffer_printf(out, "\t\t\t\tthreads[t].mode = mode ;\n") ;
+    buffer_printf(out, "\t\t\t\tthreads[t].seed = 2463534242u + (unsigned) t ;\n") ;
+    buffer_printf(out, "\t\t\t\tpthread_create(&threads[t].thread, NULL, bench_run, &threads[t]) ;\n") ;
+    buffer_printf(out, "\t\t\t}\n") ;
+    buffer_printf(out, "\t\t\tfor (int t = 0; t < n; ++ t) {\n") ;
+    buffer_printf(out, "\t\t\t\tpthread_join(threads[t].thread, NULL) ;\n\t\t\t}\n") ;
+    buffer_printf(out, "\t\t\tclock_gettime(CLOCK_MONOTONIC, &end) ;\n") ;
+    buffer_printf(out, "\t\t\tconst double seconds = (double) (end.tv_sec - start.tv_sec)\n"
+            "\t\t\t                     + 1e-9 * (double) (end.tv_nsec - start.tv_nsec) ;\n") ;
+    buffer_printf(out, "\t\t\tprintf(\" %%14.2f\", 1e-6 * n * POSTS / seconds) ;\n") ;
+    buffer_printf(out, "\t\t\tfflush(stdout) ;\n") ;
+    buffer_printf(out, "\t\t}\n\t\tprintf(\"\\n\") ;\n\t}\n") ;
+    buffer_printf(out, "\tfree(threads) ;\n\treturn 0 ;\n}\n") ;
+}
+
+///
+/// Minimal perfect hash of a set of names, by hash and displace (as in CHD).
+/// Names are hashed once (FNV-1a), and each seed mixes that hash with a
+/// finaliser (fmix64, from MurmurHash3), so that names differing by a single
+/// byte still scatter. Names go to n buckets with the bucket seed. Buckets of
+/// several names, the biggest first, get the first seed d for which all
+/// their names go to free slots; their displacement is n + d. Then buckets
+/// of one name take a free slot s directly, which is their displacement.
+/// When a bucket finds no seed, the names are bucketed again with the next
+/// bucket seed. The generated lookup mirrors perfect_hash_mix, and checks the
+/// name it finds.
+///
+typedef struct perfect_hash_t {
+    size_t n ;
+    uint64_t bucket_seed ;
+    size_t max_displacement ;
+    size_t* displacements ;
+    size_t* slots ;
+} perfect_hash_t ;
+
+#define CARTEUR_PERFECT_HASH_BUCKET_SEEDS 16
+#define CARTEUR_PERFECT_HASH_SEEDS 65536
+
+static uint64_t perfect_hash_mix(uint64_t hash, const uint64_t seed)
+{
+    hash ^= seed * 0x9E3779B97F4A7C15ull ;
+    hash ^= hash >> 33 ;
+    hash *= 0xFF51AFD7ED558CCDull ;
+    hash ^= hash >> 33 ;
+    hash *= 0xC4CEB9FE1A85EC53ull ;
+    hash ^= hash >> 33 ;
+    return hash ;
+}
+
+///
+/// Place the n names with the given bucket seed, or return false if a
+/// bucket finds no seed within CARTEUR_PERFECT_HASH_SEEDS.
+///
+static bool perfect_hash_place(perfect_hash_t* ph, const uint64_t* hashes, const size_t n)
+{
+    // Buckets, as a CSR, then sorted by decreasing size.
+    size_t* bucket_offsets = calloc(n + 1, sizeof(size_t)) ;
+    size_t* bucket_names = malloc(n * sizeof(size_t)) ;
+    size_t* bucket_of = malloc(n * sizeof(size_t)) ;
+    for (size_t i = 0; i < n; ++ i) {
+        bucket_of[i] = perfect_hash_mix(hashes[i], ph->bucket_seed) % n ;
+        ++ bucket_offsets[bucket_of[i] + 1] ;
+    }
+    for (size_t b = 0; b < n; ++ b) {
+        bucket_offsets[b + 1] += bucket_offsets[b] ;
+    }
+    size_t* fill = calloc(n, sizeof(size_t)) ;
+    for (size_t i = 0; i < n; ++ i) {
+        bucket_names[bucket_offsets[bucket_of[i]] + fill[bucket_of[i]] ++] = i ;
+    }
+    free(fill) ;
+    free(bucket_of) ;
+    // Buckets sort as the rows of the compressed table, biggest first.
+    compressed_row_t* order = malloc(n * sizeof(compressed_row_t)) ;
+    for (size_t b = 0; b < n; ++ b) {
+        order[b].size = bucket_offsets[b + 1] - bucket_offsets[b] ;
+        order[b].state = b ;
+    }
+    qsort(order, n, sizeof(compressed_row_t), compressed_row_cmp_qsort) ;
+
+    bool* taken = calloc(n, sizeof(bool)) ;
+    size_t* tried = malloc(n * sizeof(size_t)) ;
+    bool placed = true ;
+    size_t o = 0 ;
+    for (; placed && (o < n) && (order[o].size > 1); ++ o) {
+        const size_t b = order[o].state ;
+        const size_t* members = &bucket_names[bucket_offsets[b]] ;
+        placed = false ;
+        for (uint64_t d = 1; (! placed) && (d <= CARTEUR_PERFECT_HASH_SEEDS); ++ d) {
+            size_t k = 0 ;
+            for (; k < order[o].size; ++ k) {
+                tried[k] = perfect_hash_mix(hashes[members[k]], d) % n ;
+                if (taken[tried[k]])
+                    break ;
+                taken[tried[k]] = true ;
+            }
+            if (k == order[o].size) {
+                for (k = 0; k < order[o].size; ++ k) {
+                    ph->slots[tried[k]] = members[k] ;
+                }
+                ph->displacements[b] = n + d ;
+                placed = true ;
+            }
+            while ((! placed) && (k > 0)) {
+                taken[tried[-- k]] = false ;
+            }
+        }
+    }
+    size_t slot = 0 ;
+    for (; placed && (o < n) && (order[o].size == 1); ++ o) {
+        while (taken[slot])
+            ++ slot ;
+        const size_t b = order[o].state ;
+        taken[slot] = true ;
+        ph->slots[slot] = bucket_names[bucket_offsets[b]] ;
+        ph->displacements[b] = slot ;
+    }
+    free(taken) ;
+    free(tried) ;
+    free(order) ;
+    free(bucket_offsets) ;
+    free(bucket_names) ;
+    return placed ;
+}
+
+///
+/// Place the n names. slots[s] is the position in names of the name in slot
+/// s. Names must be distinct. Returns false if no bucket seed works, which
+/// takes names whose FNV-1a hashes collide.
+///
+bool perfect_hash_init(perfect_hash_t* ph, const char* const* names, const size_t n)
+{
+    ph->n = n ;
+    ph->bucket_seed = 0 ;
+    ph->max_displacement = 0 ;
+    ph->displacements = calloc(n + 1, sizeof(size_t)) ;
+    ph->slots = malloc((n + 1) * sizeof(size_t)) ;
+    if (n == 0)
+        return true ;
+    uint64_t* hashes = malloc(n * sizeof(uint64_t)) ;
+    for (size_t i = 0; i < n; ++ i) {
+        hashes[i] = fnv1a(CARTEUR_FNV_OFFSET, names[i], strlen(names[i])) ;
+    }
+    bool placed = false ;
+    for (; (! placed) && (ph->bucket_seed < CARTEUR_PERFECT_HASH_BUCKET_SEEDS); ++ ph->bucket_seed) {
+        memset(ph->displacements, 0, n * sizeof(size_t)) ;
+        placed = perfect_hash_place(ph, hashes, n) ;
+    }
+    -- ph->bucket_seed ;
+    for (size_t b = 0; b < n; ++ b) {
+        if (ph->displacements[b] > ph->max_displacement)
+            ph->max_displacement = ph->displacements[b] ;
+    }
+    free(hashes) ;
+    return placed ;
+}
+
+void perfect_hash_clear(perfect_hash_t* ph)
+{
+    free(ph->displacements) ;
+    free(ph->slots) ;
+}
+
+///
+/// Emit the tables and the lookup of one set of names. The name of key k is
+/// names[k], and it stands for ids[k]. Fails when no perfect hash is found.
+///
+static bool generate_C_from_string
+    ( buffer_t* out
+    , generation_stage_data_t* stage_data
+    , const char* kind
+    , const char* const* names
+    , const size_t* ids
+    , const size_t n
+    , const size_t n_ids
+    )
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    buffer_printf(out, "int %s_%s_from_string(const char* name, size_t length) {\n"
+            , machine_name, kind) ;
+    if (n == 0) {
+        buffer_printf(out, "\t(void) name ;\n\t(void) length ;\n\treturn -1 ;\n}\n\n") ;
+        return true ;
+    }
+    perfect_hash_t ph ;
+    if (! perfect_hash_init(&ph, names, n)) {
+        buffer_printf(stage_data->log, "Machine '%s': no perfect hash of the %s names found.\n"
+                     , machine_name, kind) ;
+        perfect_hash_clear(&ph) ;
+        return false ;
+    }
+    size_t* values = malloc(n * sizeof(size_t)) ;
+    size_t max_length = 0 ;
+    buffer_printf(out, "\tstatic const char* const names[%zu] = {\n", n) ;
+    for (size_t s = 0; s < n; ++ s) {
+        buffer_printf(out, "\t\t\"%s\",\n", names[ph.slots[s]]) ;
+        values[s] = strlen(names[ph.slots[s]]) ;
+        if (values[s] > max_length)
+            max_length = values[s] ;
+    }
+    buffer_printf(out, "\t} ;\n") ;
+    const char* vectors[3] = { "lengths", "ids", "displacements" } ;
+    const size_t max_values[3] = { max_length, n_ids, ph.max_displacement } ;
+    for (size_t v = 0; v < 3; ++ v) {
+        if (v == 1) {
+            for (size_t s = 0; s < n; ++ s) {
+                values[s] = ids[ph.slots[s]] ;
+            }
+        } else if (v == 2) {
+            memcpy(values, ph.displacements, n * sizeof(size_t)) ;
+        }
+        buffer_printf(out, "\tstatic const %s %s[%zu] = {"
+                , C_smallest_uint(max_values[v]), vectors[v], n) ;
+        for (size_t i = 0; i < n; ++ i) {
+            buffer_puts(out, (i % 16 == 0) ? "\n\t\t" : " ") ;
+            buffer_put_uint(out, values[i]) ;
+            buffer_puts(out, ",") ;
+        }
+        buffer_puts(out, "\n\t} ;\n") ;
+    }
+    free(values) ;
+    buffer_printf(out, "\tconst uint64_t hash = %s_name_hash(name, length) ;\n", machine_name) ;
+    buffer_printf(out, "\tconst size_t value = displacements[%s_name_mix(hash, %lluull) %% %zu] ;\n"
+            , machine_name, (unsigned long long) ph.bucket_seed, n) ;
+    buffer_printf(out, "\tconst size_t slot = (value < %zu) ? value\n"
+            "\t                  : (size_t) (%s_name_mix(hash, value - %zu) %% %zu) ;\n"
+            , n, machine_name, n, n) ;
+    buffer_printf(out, "\tif ((lengths[slot] != length) || (memcmp(names[slot], name, length) != 0))\n"
+            "\t\treturn -1 ;\n") ;
+    buffer_printf(out, "\treturn (int) ids[slot] ;\n}\n\n") ;
+    perfect_hash_clear(&ph) ;
+    return true ;
+}
+
+///
+/// Lookups of events and states by name. States merged by the minimisation
+/// are found too, when their names are kept as aliases.
+///
+bool generate_C_source_from_string(buffer_t* out, generation_stage_data_t* stage_data) {
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_aliases = stage_data->parameters->state_aliases
+                           ? array_cstr_size(stage_data->state_aliases) : 0 ;
+    buffer_printf(out, "#include <string.h>\n\n") ;
+    buffer_printf(out, "static inline uint64_t %s_name_hash(const char* name, size_t length) {\n"
+            , machine_name) ;
+    buffer_printf(out, "\tuint64_t hash = %lluull ;\n", (unsigned long long) CARTEUR_FNV_OFFSET) ;
+    buffer_printf(out, "\tfor (size_t i = 0; i < length; ++ i) {\n"
+            "\t\thash ^= (unsigned char) name[i] ;\n"
+            "\t\thash *= 1099511628211ull ;\n\t}\n") ;
+    buffer_printf(out, "\treturn hash ;\n}\n\n") ;
+    buffer_printf(out, "static inline uint64_t %s_name_mix(uint64_t hash, uint64_t seed) {\n"
+            , machine_name) ;
+    buffer_printf(out, "\thash ^= seed * 0x9E3779B97F4A7C15ull ;\n"
+            "\thash ^= hash >> 33 ;\n"
+            "\thash *= 0xFF51AFD7ED558CCDull ;\n"
+            "\thash ^= hash >> 33 ;\n"
+            "\thash *= 0xC4CEB9FE1A85EC53ull ;\n"
+            "\thash ^= hash >> 33 ;\n"
+            "\treturn hash ;\n}\n\n") ;
+
+    const char** names = malloc((n_states + n_aliases + n_events + 1) * sizeof(const char*)) ;
+    size_t* ids = malloc((n_states + n_aliases + n_events + 1) * sizeof(size_t)) ;
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        names[ev] = *array_cstr_cget(stage_data->events, ev) ;
+        ids[ev] = ev ;
+    }
+    bool ok = generate_C_from_string(out, stage_data, "event", names, ids, n_events, n_events) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        names[s] = *array_cstr_cget(stage_data->states, s) ;
+        ids[s] = s ;
+    }
+    for (size_t a = 0; a < n_aliases; ++ a) {
+        names[n_states + a] = *array_cstr_cget(stage_data->state_aliases, a) ;
+        ids[n_states + a] = *array_size_cget(stage_data->state_alias_targets, a) ;
+    }
+    ok = ok && generate_C_from_string(out, stage_data, "state", names, ids, n_states + n_aliases, n_states) ;
+    free(names) ;
+    free(ids) ;
+    return ok ;
+}
+
+///
+/// The bitsets of the events enabled in each state, one row per state.
+///
+void generate_C_source_enabled_events(buffer_t* out, generation_stage_data_t* stage_data) {
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_words = enabled_events_words(array_cstr_size(stage_data->events)) ;
+    uint64_t* words = enabled_events_bitsets(stage_data, n_words) ;
+    buffer_printf(out, "const uint64_t %s_enabled_events_table[%zu][%zu] = {\n"
+            , stage_data->parameters->machine_name, (n_states > 0) ? n_states : 1, n_words) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        buffer_puts(out, "\t{") ;
+        for (size_t w = 0; w < n_words; ++ w) {
+            buffer_printf(out, "%s0x%016llxull", (w == 0) ? " " : ", "
+                         , (unsigned long long) words[s * n_words + w]) ;
+        }
+        buffer_printf(out, " }, // %s\n", *array_cstr_get(stage_data->states, s)) ;
+    }
+    if (n_states == 0)
+        buffer_puts(out, "\t{ 0 },\n") ;
+    buffer_printf(out, "} ;\n\n") ;
+    free(words) ;
+}
+
+///
+/// Define the callbacks of composed machines, in the part of the source all
+/// the shards share.
+///
+static void generate_C_composites(buffer_t* out, generation_stage_data_t* stage_data)
+{
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    bool any = false ;
+    for (size_t cb = 0; cb < n_callbacks; ++ cb) {
+        if (! callback_composite(stage_data, cb))
+            continue ;
+        const size_t* offsets = array_size_cget(stage_data->callback_part_offsets, 0) ;
+        buffer_printf(out, "static inline void %s(void* user) {\n"
+                , *array_cstr_get(stage_data->callbacks, cb)) ;
+        for (size_t p = offsets[cb]; p < offsets[cb + 1]; ++ p) {
+            const size_t part = *array_size_cget(stage_data->callback_parts, p) ;
+            buffer_printf(out, "\t%s(user) ;\n", *array_cstr_get(stage_data->callbacks, part)) ;
+        }
+        buffer_printf(out, "}\n") ;
+        any = true ;
+    }
+    if (any)
+        buffer_printf(out, "\n") ;
+}
+
+///
+/// ... Returns false when a part of the source cannot be built.
+///
+bool generate_C_source
+    ( array_buffer_t out
+    , generation_stage_data_t* stage_data
+    , const size_t jobs
+    )
+{
+    buffer_t* head = array_buffer_push_new(out) ;
+    buffer_init(head) ;
+    buffer_printf(head, "#include \"generated_%s.h\"\n\n"
+                 , stage_data->parameters->machine_name) ;
+    if (stage_data->profile_total > 0) {
+        buffer_printf(head, "#if defined(__GNUC__)\n"
+                      "#define CARTEUR_EXPECT(x, value) __builtin_expect((x), (value))\n"
+                      "#define CARTEUR_COLD __attribute__((cold))\n"
+                      "#else\n"
+                      "#define CARTEUR_EXPECT(x, value) (x)\n"
+                      "#define CARTEUR_COLD\n"
+                      "#endif\n\n") ;
+    }
+    generate_C_composites(head, stage_data) ;
+    if (stage_data->parameters->backend == CARTEUR_BACKEND_SWITCH) {
+        if (stage_data->parameters->instrument)
+            buffer_printf(head, "extern uint64_t %s_profile_counts[] ;\n\n"
+                         , stage_data->parameters->machine_name) ;
+        const size_t first = array_buffer_size(out) ;
+        const size_t n_events = array_cstr_size(stage_data->events) ;
+        array_buffer_resize(out, first + n_events) ;
+        for (size_t ev = 0; ev < n_events; ++ ev) {
+            buffer_init(array_buffer_get(out, first + ev)) ;
+        }
+        if (n_events > 0)
+            generate_C_source_switch(array_buffer_get(out, first), stage_data, jobs) ;
+    }
+    buffer_t* tail = array_buffer_push_new(out) ;
+    buffer_init(tail) ;
+    if ((stage_data->parameters->backend == CARTEUR_BACKEND_SWITCH)
+        && stage_data->parameters->instrument)
+        generate_C_profile_switch(tail, stage_data) ;
+    if (C_needs_tables(stage_data->parameters))
+        generate_C_source_table(tail, stage_data) ;
+    if (stage_data->parameters->broadcast)
+        generate_C_source_broadcast(tail, stage_data) ;
+    if (stage_data->parameters->packed)
+        generate_C_source_packed(tail, stage_data) ;
+    if (stage_data->parameters->atomic)
+        generate_C_source_atomic(tail, stage_data) ;
+    if (stage_data->parameters->run)
+        generate_C_source_run(tail, stage_data) ;
+    bool ok = true ;
+    if (stage_data->parameters->from_string)
+        ok = generate_C_source_from_string(tail, stage_data) ;
+    if (stage_data->parameters->enabled_events)
+        generate_C_source_enabled_events(tail, stage_data) ;
+    return ok ;
+}
+
+///
+/// Split the events in n_shards contiguous ranges holding about the same
+/// number of transitions. Shard k gets the events in [cuts[k], cuts[k + 1]).
+///
+static void shard_events
+    ( generation_stage_data_t* stage_data
+    , const size_t n_shards
+    , size_t* cuts
+    )
+{
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t* event_offsets = array_size_cget(stage_data->event_offsets, 0) ;
+    const size_t n_transitions = event_offsets[n_events] ;
+    size_t ev = 0 ;
+    cuts[0] = 0 ;
+    for (size_t k = 1; k < n_shards; ++ k) {
+        const size_t target = (size_t) ((double) n_transitions * k / n_shards) ;
+        while ((ev < n_events) && (event_offsets[ev] < target))
+            ++ ev ;
+        cuts[k] = ev ;
+    }
+    cuts[n_shards] = n_events ;
+}
+
+///
+/// Name of an output file: generated_<machine>.<extension>, or
+/// generated_<machine>_<shard>.<extension> for the shards after the first.
+///
+static const char* output_path
+    ( buffer_t* path
+    , const char* machine_name
+    , const size_t shard
+    , const char* extension
+    )
+{
+    path->size = 0 ;
+    buffer_printf(path, "generated_%s", machine_name) ;
+    if (shard > 0)
+        buffer_printf(path, "_%zu", shard) ;
+    buffer_printf(path, ".%s", extension) ;
+    buffer_append(path, "", 1) ;
+    return path->data ;
+}
+
+static const char* output_bench_path(buffer_t* path, const char* machine_name)
+{
+    path->size = 0 ;
+    buffer_printf(path, "generated_%s_bench.c", machine_name) ;
+    buffer_append(path, "", 1) ;
+    return path->data ;
+}
+
+///
+/// Whether the hash file of the machine holds the given hash.
+///
+static bool output_hash_matches(buffer_t* path, const char* machine_name, const uint64_t hash)
+{
+    char expected[24] ;
+    snprintf(expected, sizeof(expected), "%016llx\n", (unsigned long long) hash) ;
+    input_t previous ;
+    bool same = false ;
+    if (input_open(&previous, output_path(path, machine_name, 0, "hash"))) {
+        same = (previous.size == strlen(expected))
+            && (memcmp(previous.data, expected, previous.size) == 0) ;
+        input_close(&previous) ;
     }
+    return same ;
+}
+
+///
+/// Write the hash file, once the outputs are written.
+///
+static bool output_hash_write
+    ( buffer_t* log
+    , buffer_t* path
+    , const char* machine_name
+    , const uint64_t hash
+    )
+{
+    buffer_t hash_line ;
+    buffer_init(&hash_line) ;
+    buffer_printf(&hash_line, "%016llx\n", (unsigned long long) hash) ;
+    const buffer_t* files[1] = { &hash_line } ;
+    const bool ok = buffers_write(log, output_path(path, machine_name, 0, "hash"), files, 1) ;
+    buffer_clear(&hash_line) ;
+    return ok ;
+}
 
-    else if (strcmp(name, "events_enum_name") == 0) {
-        string_t copy ;
-        string_init_set(copy, value) ;
-        free(machine->parameters->events_enum_name) ;
-        machine->parameters->events_enum_name = string_clear_get_str(copy) ;
+///
+/// Whether the outputs of a previous run are all there, and were generated
+/// from a machine and options of the same hash (see generation_hash). The
+/// hash is stored in generated_<machine>.hash.
+///
+bool generate_C_up_to_date(generation_stage_data_t* stage_data, const uint64_t hash)
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    buffer_t path ;
+    buffer_init(&path) ;
+    bool same = output_hash_matches(&path, machine_name, hash) ;
+    same = same && (access(output_path(&path, machine_name, 0, "h"), F_OK) == 0) ;
+    for (size_t k = 0; same && (k < stage_data->parameters->source_shards); ++ k) {
+        same = (access(output_path(&path, machine_name, k, "c"), F_OK) == 0) ;
     }
+    if (same && stage_data->parameters->atomic_benchmark)
+        same = (access(output_bench_path(&path, machine_name), F_OK) == 0) ;
+    buffer_clear(&path) ;
+    return same ;
+}
 
-    // Unknown name, error in the file.
-    else {
-        return 0 ;  /* unknown section/name, error */
+///
+/// Remove the shards from first on, and the atomic benchmark unless it is
+/// generated, left by a previous run with other options. They would define
+/// the same symbols again in builds taking every generated_<machine>*.c.
+/// Shards are numbered without gaps, so the first missing one ends them.
+///
+static bool generate_C_remove_stale
+    ( buffer_t* log
+    , buffer_t* path
+    , const char* machine_name
+    , size_t first
+    , const bool atomic_benchmark
+    )
+{
+    bool ok = true ;
+    for (; access(output_path(path, machine_name, first, "c"), F_OK) == 0; ++ first) {
+        if (unlink(path->data) != 0) {
+            buffer_printf(log, "Cannot remove '%s'.\n", path->data) ;
+            ok = false ;
+            break ;
+        }
+    }
+    if (! atomic_benchmark && (access(output_bench_path(path, machine_name), F_OK) == 0)
+        && (unlink(path->data) != 0)) {
+        buffer_printf(log, "Cannot remove '%s'.\n", path->data) ;
+        ok = false ;
     }
+    return ok ;
+}
 
-    return 1 ;
+///
+/// Format the header and the source in memory, then write each file with a
+/// single writev (barring partial writes). With source_shards = K, the
+/// handlers are spread over K files, balanced by transition count. The first
+/// one also holds everything else, and all of them include the same header.
+/// Shards beyond K from a previous run are removed. The hash is written
+/// last, once all the outputs are.
+///
+bool generate_C
+    ( generation_stage_data_t* stage_data
+    , const size_t jobs
+    , const uint64_t hash
+    )
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    const size_t n_shards = stage_data->parameters->source_shards ;
+    buffer_t header ;
+    buffer_init(&header) ;
+    generate_C_header(&header, stage_data) ;
+    array_buffer_t source ;
+    array_buffer_init(source) ;
+    const bool built = generate_C_source(source, stage_data, jobs) ;
+
+    // The source is made of a head, one buffer per handler, and a tail.
+    const size_t n_buffers = array_buffer_size(source) ;
+    const buffer_t* head = array_buffer_get(source, 0) ;
+    const buffer_t* tail = array_buffer_get(source, n_buffers - 1) ;
+    const size_t n_handlers = n_buffers - 2 ;
+    size_t* cuts = malloc((n_shards + 1) * sizeof(size_t)) ;
+    if (n_handlers > 0) {
+        shard_events(stage_data, n_shards, cuts) ;
+    } else {
+        for (size_t k = 0; k <= n_shards; ++ k) {
+            cuts[k] = 0 ;
+        }
+    }
+
+    buffer_t path ;
+    buffer_init(&path) ;
+    const buffer_t** files = malloc(n_buffers * sizeof(buffer_t*)) ;
+    files[0] = &header ;
+    bool ok = built && buffers_write(stage_data->log, output_path(&path, machine_name, 0, "h"), files, 1) ;
+    for (size_t k = 0; ok && (k < n_shards); ++ k) {
+        size_t n_files = 0 ;
+        files[n_files ++] = head ;
+        for (size_t ev = cuts[k]; ev < cuts[k + 1]; ++ ev) {
+            files[n_files ++] = array_buffer_get(source, 1 + ev) ;
+        }
+        if (k == 0)
+            files[n_files ++] = tail ;
+        ok = buffers_write(stage_data->log, output_path(&path, machine_name, k, "c"), files, n_files) ;
+    }
+    if (ok && stage_data->parameters->atomic_benchmark) {
+        buffer_t bench ;
+        buffer_init(&bench) ;
+        generate_C_atomic_benchmark(&bench, stage_data) ;
+        files[0] = &bench ;
+        ok = buffers_write(stage_data->log, output_bench_path(&path, machine_name), files, 1) ;
+        buffer_clear(&bench) ;
+    }
+    if (ok)
+        ok = generate_C_remove_stale(stage_data->log, &path, machine_name, n_shards
+                                    , stage_data->parameters->atomic_benchmark) ;
+    if (ok)
+        ok = output_hash_write(stage_data->log, &path, machine_name, hash) ;
+    free(files) ;
+    free(cuts) ;
+
+    buffer_clear(&path) ;
+    buffer_clear(&header) ;
+    for (size_t i = 0; i < n_buffers; ++ i) {
+        buffer_clear(array_buffer_get(source, i)) ;
+    }
+    array_buffer_clear(source) ;
+    return ok ;
 }
 
-// ................................................................... STAGE 2
+// ............................................................... STAGE 3 C++
 
 ///
-/// Contains dull stores for states, events and callbacks names. This time,
-/// the mapping is from integer to string.
-///
-/// This is for stage 3, but the goal of stage 2 is precisely to change the
-/// representation from stage 1 to the one in stage 3.
+/// The C++ backend emits a single header, with enum classes and a class
+/// template over a user Context type. Callbacks are member functions of the
+/// context, called directly, so that the compiler can inline them into the
+/// handlers and the dispatcher. The tables, when the backend uses them, are
+/// constexpr members. Machines start in their first start state, if any.
 ///
-typedef struct generation_stage_data_t {
-    parameters_t* parameters ;
-    array_char_ptr_t states ;
-    array_char_ptr_t events ;
-    array_char_ptr_t callbacks ;
-    array_transition_t transitions ;
-} generation_stage_data_t ;
+static const char* CPP_smallest_uint(const size_t max_value)
+{
+    switch (smallest_uint_size(max_value)) {
+    case 1:
+        return "std::uint8_t" ;
+    case 2:
+        return "std::uint16_t" ;
+    case 4:
+        return "std::uint32_t" ;
+    default:
+        return "std::uint64_t" ;
+    }
+}
 
 ///
-/// Turn a mapping (string -> integer) into an array of strings, such that
-/// the mapping is reversed.
+/// Emit a constexpr array member.
 ///
-void fill_array_from_dictionnary
-    ( array_char_ptr_t dest
-    , const dict_string_t src
+static void generate_CPP_vector
+    ( buffer_t* out
+    , const char* vector_name
+    , const char* type
+    , const size_t* values
+    , const size_t n
     )
 {
-    const size_t n = dict_string_size(src) ;
-    array_char_ptr_init(dest) ;
-    array_char_ptr_resize(dest, n) ;
-    dict_string_it_t it ;
-    dict_string_it(it, src) ;
+    buffer_printf(out, "\tstatic constexpr %s %s[%zu] = {", type, vector_name, (n > 0) ? n : 1) ;
     for (size_t i = 0; i < n; ++ i) {
-        const dict_string_itref_t* ref = dict_string_cref(it) ;
-        string_t copy ;
-        string_init_set(copy, ref->key) ;
-        array_char_ptr_set_at(dest, ref->value, string_clear_get_str(copy)) ;
-        dict_string_next(it) ;
+        buffer_puts(out, (i % 16 == 0) ? "\n\t\t" : " ") ;
+        buffer_put_uint(out, values[i]) ;
+        buffer_puts(out, ",") ;
+    }
+    buffer_puts(out, (n > 0) ? "\n\t} ;\n" : " 0 } ;\n") ;
+}
+
+static void generate_CPP_enum
+    ( buffer_t* out
+    , const char* enum_name
+    , array_cstr_t names
+    )
+{
+    buffer_printf(out, "enum class %s : %s {\n", enum_name
+                 , CPP_smallest_uint(array_cstr_size(names))) ;
+    for (size_t i = 0; i < array_cstr_size(names); ++ i) {
+        buffer_printf(out, "\t%s,\n", *array_cstr_get(names, i)) ;
     }
 }
 
 ///
-/// General function that embodies the whole second stage. It turns maps into
-/// arrays for stage 3, and possibly perform graph analysis.
+/// Call a callback as a member of the context, or the callbacks of composed
+/// machines it runs, in a row.
 ///
-void transform_graph
-    ( parsing_stage_data_t* parsing
-    , generation_stage_data_t* generation
-    )
+static void generate_CPP_call(buffer_t* out, generation_stage_data_t* stage_data, const size_t cb)
 {
-    fill_array_from_dictionnary(generation->states, parsing->states) ;
-    fill_array_from_dictionnary(generation->events, parsing->events) ;
-    fill_array_from_dictionnary(generation->callbacks, parsing->callbacks) ;
-    array_transition_init_move(generation->transitions, parsing->transitions) ;
-    array_transition_special_sort(generation->transitions, transition_cmp_qsort) ;
-    // This seems to trigger a fault when used on a 2-sized array. See l.814 of m-array.h FIXME...
-    //array_transition_special_stable_sort(generation->transitions) ;
-#if defined(CARTEUR_GRAPH_ANALYSIS)
-    // TODO
-#endif
+    if (! callback_composite(stage_data, cb)) {
+        buffer_printf(out, "\t\t\tcontext.%s() ;\n", *array_cstr_get(stage_data->callbacks, cb)) ;
+        return ;
+    }
+    const size_t* offsets = array_size_cget(stage_data->callback_part_offsets, 0) ;
+    for (size_t p = offsets[cb]; p < offsets[cb + 1]; ++ p) {
+        const size_t part = *array_size_cget(stage_data->callback_parts, p) ;
+        buffer_printf(out, "\t\t\tcontext.%s() ;\n", *array_cstr_get(stage_data->callbacks, part)) ;
+    }
 }
 
-// ................................................................... STAGE 3
+void generate_CPP_header(buffer_t* out, generation_stage_data_t* stage_data)
+{
+    const parameters_t* parameters = stage_data->parameters ;
+    const char* machine_name = parameters->machine_name ;
+    const char* states_enum_name = parameters->states_enum_name ;
+    const char* events_enum_name = parameters->events_enum_name ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    buffer_printf(out, "// File generated by carteur.\n\n") ;
+    buffer_printf(out, "#pragma once\n\n") ;
+    buffer_printf(out, "#include <cstddef>\n#include <cstdint>\n\n") ;
+
+    // Emit the enums.
+    if (parameters->declare_states) {
+        generate_CPP_enum(out, states_enum_name, stage_data->states) ;
+        if (parameters->state_aliases) {
+            for (size_t a = 0; a < array_cstr_size(stage_data->state_aliases); ++ a) {
+                const size_t target = *array_size_cget(stage_data->state_alias_targets, a) ;
+                buffer_printf(out, "\t%s = %s,\n"
+                             , *array_cstr_get(stage_data->state_aliases, a)
+                             , *array_cstr_get(stage_data->states, target)) ;
+            }
+        }
+        buffer_printf(out, "} ;\n\n") ;
+    }
+    // The class always takes events (dispatch, run), so their enum is
+    // always emitted.
+    generate_CPP_enum(out, events_enum_name, stage_data->events) ;
+    buffer_printf(out, "} ;\n\n") ;
+
+    // Emit the top of the class.
+    size_t initial = 0 ;
+    if (! array_size_empty_p(stage_data->start_states))
+        initial = *array_size_cget(stage_data->start_states, 0) ;
+    buffer_printf(out, "// Calls the callbacks as members of Context, as in context.%s().\n"
+            , (n_callbacks > 0) ? *array_cstr_get(stage_data->callbacks, 0) : "callback") ;
+    buffer_printf(out, "template <typename Context>\nclass %s {\npublic:\n", machine_name) ;
+    buffer_printf(out, "\tstatic constexpr std::size_t n_states = %zu ;\n", n_states) ;
+    buffer_printf(out, "\tstatic constexpr std::size_t n_events = %zu ;\n\n", n_events) ;
+    buffer_printf(out, "\tconstexpr %s() noexcept = default ;\n", machine_name) ;
+    buffer_printf(out, "\tconstexpr explicit %s(%s initial) noexcept : state_(initial) {}\n\n"
+            , machine_name, states_enum_name) ;
+    buffer_printf(out, "\tconstexpr %s state() const noexcept { return state_ ; }\n"
+            , states_enum_name) ;
+    buffer_printf(out, "\tvoid set_state(%s to) noexcept { state_ = to ; }\n\n"
+            , states_enum_name) ;
+
+    // Emit the handlers. A pair declared twice keeps its first transition.
+    const size_t* event_offsets = array_size_cget(stage_data->event_offsets, 0) ;
+    size_t* seen = calloc(n_states + 1, sizeof(size_t)) ;
+    buffer_printf(out, "\t// The handlers and the dispatcher return whether a transition was taken.\n\n") ;
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        buffer_printf(out, "\tbool handle_%s(Context& context) {\n"
+                , *array_cstr_get(stage_data->events, ev)) ;
+        buffer_printf(out, "\t\tswitch (state_) {\n") ;
+        for (size_t i = event_offsets[ev]; i < event_offsets[ev + 1]; ++ i) {
+            const transition_t* ref = array_transition_cget(stage_data->transitions, i) ;
+            if (seen[(*ref)->from] == ev + 1)
+                continue ;
+            seen[(*ref)->from] = ev + 1 ;
+            buffer_printf(out, "\t\tcase %s::%s:\n", states_enum_name
+                    , *array_cstr_get(stage_data->states, (*ref)->from)) ;
+            generate_CPP_call(out, stage_data, (*ref)->callback) ;
+            buffer_printf(out, "\t\t\tstate_ = %s::%s ;\n\t\t\treturn true ;\n", states_enum_name
+                    , *array_cstr_get(stage_data->states, (*ref)->to)) ;
+        }
+        buffer_printf(out, "\t\tdefault:\n\t\t\treturn false ;\n\t\t}\n\t}\n\n") ;
+    }
+    free(seen) ;
+
+    // Emit the dispatcher, over the handlers or the tables.
+    const bool tables = (parameters->backend != CARTEUR_BACKEND_SWITCH) ;
+    bool use_compressed = false ;
+    compressed_table_t compressed ;
+    if (tables) {
+        compressed_table_init(&compressed, stage_data) ;
+        use_compressed = table_use_compressed(stage_data, &compressed) ;
+    }
+    buffer_printf(out, "\tbool dispatch(%s event, Context& context) {\n", events_enum_name) ;
+    if (tables) {
+        buffer_printf(out, "\t\tconst std::size_t cell = cell_of(state_, event) ;\n") ;
+        buffer_printf(out, "\t\tif (cell == no_cell)\n\t\t\treturn false ;\n") ;
+        buffer_printf(out, "\t\tcall(callback_index_[cell], context) ;\n") ;
+        buffer_printf(out, "\t\tstate_ = static_cast<%s>(next_state_[cell]) ;\n", states_enum_name) ;
+        buffer_printf(out, "\t\treturn true ;\n") ;
+    } else {
+        buffer_printf(out, "\t\tswitch (event) {\n") ;
+        for (size_t ev = 0; ev < n_events; ++ ev) {
+            const char* ev_name = *array_cstr_get(stage_data->events, ev) ;
+            buffer_printf(out, "\t\tcase %s::%s:\n\t\t\treturn handle_%s(context) ;\n"
+                    , events_enum_name, ev_name, ev_name) ;
+        }
+        buffer_printf(out, "\t\tdefault:\n\t\t\treturn false ;\n\t\t}\n") ;
+    }
+    buffer_printf(out, "\t}\n\n") ;
+    buffer_printf(out, "\tvoid run(const %s* events, std::size_t n, Context& context) {\n"
+            "\t\tfor (std::size_t i = 0; i < n; ++ i) {\n"
+            "\t\t\tdispatch(events[i], context) ;\n\t\t}\n\t}\n\n", events_enum_name) ;
+    const size_t n_words = enabled_events_words(n_events) ;
+    if (parameters->enabled_events) {
+        buffer_printf(out, "\t// Events having a transition from a state, event e being bit e %% 64\n"
+                      "\t// of word e / 64.\n") ;
+        buffer_printf(out, "\tstatic constexpr std::size_t event_words = %zu ;\n\n", n_words) ;
+        buffer_printf(out, "\tstatic constexpr const std::uint64_t* enabled_events(%s from) noexcept {\n"
+                      "\t\treturn enabled_events_ + std::size_t(from) * event_words ;\n\t}\n\n"
+                , states_enum_name) ;
+        buffer_printf(out, "\tstatic constexpr bool can_handle(%s from, %s event) noexcept {\n"
+                      "\t\treturn (enabled_events(from)[std::size_t(event) / 64]\n"
+                      "\t\t\t>> (std::size_t(event) %% 64)) & 1 ;\n\t}\n\n"
+                , states_enum_name, events_enum_name) ;
+    }
+
+    // Emit the tables and their lookups.
+    if (tables) {
+        const char* state_type = CPP_smallest_uint(n_states) ;
+        buffer_printf(out, "\t// Next state of a pair, at compile time if need be.\n") ;
+        buffer_printf(out, "\tstatic constexpr %s next(%s from, %s event) noexcept {\n"
+                , states_enum_name, states_enum_name, events_enum_name) ;
+        buffer_printf(out, "\t\tconst std::size_t cell = cell_of(from, event) ;\n") ;
+        buffer_printf(out, "\t\treturn (cell == no_cell) ? from : static_cast<%s>(next_state_[cell]) ;\n"
+                , states_enum_name) ;
+        buffer_printf(out, "\t}\n\nprivate:\n") ;
+        buffer_printf(out, "\tstatic constexpr std::size_t no_cell = ~std::size_t(0) ;\n\n") ;
+        if (use_compressed) {
+            generate_CPP_vector(out, "base_", CPP_smallest_uint(compressed.max_base)
+                               , compressed.base, n_states) ;
+            generate_CPP_vector(out, "check_", state_type, compressed.check, compressed.length) ;
+            generate_CPP_vector(out, "next_state_", state_type, compressed.next, compressed.length) ;
+            for (size_t i = 0; i < compressed.length; ++ i) {
+                compressed.callback[i] -= (compressed.callback[i] > 0) ;
+            }
+            generate_CPP_vector(out, "callback_index_", CPP_smallest_uint(n_callbacks)
+                               , compressed.callback, compressed.length) ;
+            buffer_printf(out, "\n\tstatic constexpr std::size_t cell_of(%s from, %s event) noexcept {\n"
+                    , states_enum_name, events_enum_name) ;
+            buffer_printf(out, "\t\tconst std::size_t cell = std::size_t(base_[std::size_t(from)]) "
+                    "+ std::size_t(event) ;\n") ;
+            buffer_printf(out, "\t\treturn (check_[cell] == std::size_t(from)) ? cell : no_cell ;\n\t}\n\n") ;
+        } else {
+            // Cells without transition are flagged by an out of range callback.
+            dense_table_t table ;
+            dense_table_init(&table, stage_data) ;
+            for (size_t i = 0; i < n_states * n_events; ++ i) {
+                table.callback[i] = (table.callback[i] > 0) ? table.callback[i] - 1 : n_callbacks ;
+            }
+            generate_CPP_vector(out, "next_state_", state_type, table.next, n_states * n_events) ;
+            generate_CPP_vector(out, "callback_index_", CPP_smallest_uint(n_callbacks)
+                               , table.callback, n_states * n_events) ;
+            dense_table_clear(&table) ;
+            buffer_printf(out, "\n\tstatic constexpr std::size_t cell_of(%s from, %s event) noexcept {\n"
+                    , states_enum_name, events_enum_name) ;
+            buffer_printf(out, "\t\tconst std::size_t cell = std::size_t(from) * n_events "
+                    "+ std::size_t(event) ;\n") ;
+            buffer_printf(out, "\t\treturn (callback_index_[cell] != %zu) ? cell : no_cell ;\n\t}\n\n"
+                    , n_callbacks) ;
+        }
+        compressed_table_clear(&compressed) ;
+
+        // The callbacks are known here, so the switch calls them directly.
+        buffer_printf(out, "\tstatic void call(std::size_t callback, Context& context) {\n") ;
+        buffer_printf(out, "\t\tswitch (callback) {\n") ;
+        for (size_t cb = 0; cb < n_callbacks; ++ cb) {
+            buffer_printf(out, "\t\tcase %zu:\n", cb) ;
+            generate_CPP_call(out, stage_data, cb) ;
+            buffer_printf(out, "\t\t\tbreak ;\n") ;
+        }
+        buffer_printf(out, "\t\tdefault:\n\t\t\tbreak ;\n\t\t}\n\t}\n\n") ;
+    } else {
+        buffer_printf(out, "private:\n") ;
+    }
+
+    // Emit the bitsets, one row per state.
+    if (parameters->enabled_events) {
+        uint64_t* words = enabled_events_bitsets(stage_data, n_words) ;
+        buffer_printf(out, "\tstatic constexpr std::uint64_t enabled_events_[%zu] = {"
+                , (n_states > 0) ? n_states * n_words : 1) ;
+        for (size_t i = 0; i < n_states * n_words; ++ i) {
+            buffer_printf(out, "%s0x%016llxull,", (i % 4 == 0) ? "\n\t\t" : " "
+                         , (unsigned long long) words[i]) ;
+        }
+        buffer_puts(out, (n_states > 0) ? "\n\t} ;\n\n" : " 0 } ;\n\n") ;
+        free(words) ;
+    }
+
+    // Emit the bottom of the class.
+    if (n_states > 0) {
+        buffer_printf(out, "\t%s state_ = %s::%s ;\n", states_enum_name, states_enum_name
+                , *array_cstr_get(stage_data->states, initial)) ;
+    } else {
+        buffer_printf(out, "\t%s state_ {} ;\n", states_enum_name) ;
+    }
+    buffer_printf(out, "} ;\n") ;
+}
+
+bool generate_CPP_up_to_date(generation_stage_data_t* stage_data, const uint64_t hash)
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    buffer_t path ;
+    buffer_init(&path) ;
+    bool same = output_hash_matches(&path, machine_name, hash) ;
+    same = same && (access(output_path(&path, machine_name, 0, "hpp"), F_OK) == 0) ;
+    buffer_clear(&path) ;
+    return same ;
+}
 
 ///
-/// ...
+/// Options of the C backend the C++ one, or the binary one, has no
+/// counterpart for. The blobs have no generated code at all.
 ///
-void generate_C_header(FILE* file, generation_stage_data_t* stage_data) {
+static void generate_check_options(generation_stage_data_t* stage_data, const char* language)
+{
+    const parameters_t* parameters = stage_data->parameters ;
+    const bool binary = (parameters->language == CARTEUR_LANGUAGE_BINARY) ;
+    const char* names[10] =
+        { "batch", "broadcast", "packed", "instrument", "from_string", "atomic"
+        , "atomic_benchmark", "source_shards", "run", "enabled_events" } ;
+    const bool set[10] =
+        { parameters->batch
+        , parameters->broadcast
+        , parameters->packed
+        , parameters->instrument
+        , parameters->from_string
+        , parameters->atomic
+        , parameters->atomic_benchmark
+        , parameters->source_shards > 1
+        , binary && parameters->run
+        , binary && parameters->enabled_events
+        } ;
+    for (size_t i = 0; i < 10; ++ i) {
+        if (set[i])
+            buffer_printf(stage_data->log, "Machine '%s': %s is not supported in %s, ignoring it.\n"
+                         , parameters->machine_name, names[i], language) ;
+    }
+}
+
+bool generate_CPP(generation_stage_data_t* stage_data, const uint64_t hash)
+{
     const char* machine_name = stage_data->parameters->machine_name ;
-    const char* states_enum_name = stage_data->parameters->states_enum_name ;
-    fprintf(file, "// File generated by carteur.\n\n") ;
-    fprintf(file, "#pragma once\n\n") ;
+    generate_check_options(stage_data, "C++") ;
+    buffer_t header ;
+    buffer_init(&header) ;
+    generate_CPP_header(&header, stage_data) ;
+    buffer_t path ;
+    buffer_init(&path) ;
+    const buffer_t* files[1] = { &header } ;
+    bool ok = buffers_write(stage_data->log, output_path(&path, machine_name, 0, "hpp"), files, 1) ;
+    if (ok)
+        ok = output_hash_write(stage_data->log, &path, machine_name, hash) ;
+    buffer_clear(&path) ;
+    buffer_clear(&header) ;
+    return ok ;
+}
 
-    // Emit an enum of all states.
-    if (stage_data->parameters->declare_states) {
-        fprintf(file, "typedef enum {\n") ;
-        const size_t n_states = array_char_ptr_size(stage_data->states) ;
-        for (size_t s = 0; s < n_states; ++ s) {
-            fprintf(file, "\t%s,\n", *array_char_ptr_get(stage_data->states, s));
+// ............................................................ STAGE 3 BINARY
+
+///
+/// The binary backend writes the machine as a blob, which the runtime in
+/// src/runtime maps and dispatches events from (see carteur_runtime.h for
+/// the format). The transitions are sorted by event then by state, so that
+/// the runtime finds one by a binary search, and a pair keeps its first
+/// transition, as in the other backends.
+///
+
+///
+/// Append a 32-bit word, little-endian whatever the host.
+///
+static void buffer_put_word(buffer_t* out, const uint32_t word)
+{
+    const char bytes[4] =
+        { (char) (word & 0xFF)
+        , (char) ((word >> 8) & 0xFF)
+        , (char) ((word >> 16) & 0xFF)
+        , (char) ((word >> 24) & 0xFF)
+        } ;
+    buffer_append(out, bytes, 4) ;
+}
+
+static void buffer_put_words(buffer_t* out, const uint32_t* words, const size_t n)
+{
+    for (size_t i = 0; i < n; ++ i) {
+        buffer_put_word(out, words[i]) ;
+    }
+}
+
+bool generate_BIN_up_to_date(generation_stage_data_t* stage_data, const uint64_t hash)
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    buffer_t path ;
+    buffer_init(&path) ;
+    bool same = output_hash_matches(&path, machine_name, hash) ;
+    same = same && (access(output_path(&path, machine_name, 0, "bin"), F_OK) == 0) ;
+    buffer_clear(&path) ;
+    return same ;
+}
+
+///
+/// Format the blob in memory, then write it to generated_<machine>.bin.
+///
+bool generate_BIN(generation_stage_data_t* stage_data, const uint64_t hash)
+{
+    const char* machine_name = stage_data->parameters->machine_name ;
+    generate_check_options(stage_data, "binary blobs") ;
+    const size_t n_states = array_cstr_size(stage_data->states) ;
+    const size_t n_events = array_cstr_size(stage_data->events) ;
+    const size_t n_callbacks = array_cstr_size(stage_data->callbacks) ;
+    const size_t* state_offsets = array_size_cget(stage_data->state_offsets, 0) ;
+    const size_t* state_index = array_transition_empty_p(stage_data->transitions)
+                              ? NULL : array_size_cget(stage_data->state_index, 0) ;
+
+    // Transitions, by event then by state. Rows are sorted by event, so the
+    // transitions of a pair are next to each other, the first declared first.
+    uint32_t* event_offsets = calloc(n_events + 1, sizeof(uint32_t)) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        size_t previous = SIZE_MAX ;
+        for (size_t i = state_offsets[s]; i < state_offsets[s + 1]; ++ i) {
+            const size_t ev = (*array_transition_cget(stage_data->transitions, state_index[i]))->event ;
+            event_offsets[ev + 1] += (ev != previous) ;
+            previous = ev ;
+        }
+    }
+    for (size_t ev = 0; ev < n_events; ++ ev) {
+        event_offsets[ev + 1] += event_offsets[ev] ;
+    }
+    const size_t n_transitions = event_offsets[n_events] ;
+    uint32_t* transitions = malloc((3 * n_transitions + 1) * sizeof(uint32_t)) ;
+    uint32_t* fill = calloc(n_events + 1, sizeof(uint32_t)) ;
+    for (size_t s = 0; s < n_states; ++ s) {
+        size_t previous = SIZE_MAX ;
+        for (size_t i = state_offsets[s]; i < state_offsets[s + 1]; ++ i) {
+            const transition_t* ref = array_transition_cget(stage_data->transitions, state_index[i]) ;
+            if ((*ref)->event == previous)
+                continue ;
+            previous = (*ref)->event ;
+            uint32_t* t = transitions + 3 * (size_t) (event_offsets[previous] + fill[previous] ++) ;
+            t[0] = (uint32_t) (*ref)->from ;
+            t[1] = (uint32_t) (*ref)->to ;
+            t[2] = (uint32_t) (*ref)->callback ;
         }
-        fprintf(file, "} %s ;\n\n", stage_data->parameters->states_enum_name) ;
     }
+    free(fill) ;
 
-    // Emit an enum of all events.
-    if (stage_data->parameters->declare_events) {
-        fprintf(file, "typedef enum {\n") ;
-        const size_t n_events = array_char_ptr_size(stage_data->events) ;
-        for (size_t s = 0; s < n_events; ++ s) {
-            fprintf(file, "\t%s,\n", *array_char_ptr_get(stage_data->events, s));
+    // Callbacks are their own single part, but for those of composed machines.
+    const bool composed = ! array_size_empty_p(stage_data->callback_part_offsets) ;
+    const size_t n_parts = composed ? array_size_size(stage_data->callback_parts) : n_callbacks ;
+    uint32_t* part_offsets = malloc((n_callbacks + 1) * sizeof(uint32_t)) ;
+    uint32_t* parts = malloc((n_parts + 1) * sizeof(uint32_t)) ;
+    for (size_t cb = 0; cb <= n_callbacks; ++ cb) {
+        part_offsets[cb] = (uint32_t) (composed ? *array_size_cget(stage_data->callback_part_offsets, cb) : cb) ;
+    }
+    for (size_t p = 0; p < n_parts; ++ p) {
+        parts[p] = (uint32_t) (composed ? *array_size_cget(stage_data->callback_parts, p) : p) ;
+    }
+
+    // Names, and the pool they point into, padded to a word.
+    const size_t n_names = n_states + n_events + n_callbacks ;
+    uint32_t* name_offsets = malloc((n_names + 1) * sizeof(uint32_t)) ;
+    buffer_t pool ;
+    buffer_init(&pool) ;
+    array_cstr_t* tables[3] = { &stage_data->states, &stage_data->events, &stage_data->callbacks } ;
+    size_t n = 0 ;
+    for (size_t t = 0; t < 3; ++ t) {
+        for (size_t i = 0; i < array_cstr_size(*tables[t]); ++ i) {
+            const char* name = *array_cstr_cget(*tables[t], i) ;
+            name_offsets[n ++] = (uint32_t) pool.size ;
+            buffer_append(&pool, name, strlen(name) + 1) ;
         }
-        fprintf(file, "} %s ;\n\n", stage_data->parameters->events_enum_name) ;
     }
+    do {
+        buffer_append(&pool, "", 1) ;
+    } while (pool.size % 4 != 0) ;
 
-    // Emit one signature per event.
-    const size_t n_events = array_char_ptr_size(stage_data->events) ;
-    for (size_t ev = 0; ev < n_events; ++ ev) {
-        const char* ev_name = *array_char_ptr_get(stage_data->events, ev) ;
-        fprintf(file, "void %s_handle_%s(%s* state, void* user) ;\n"
-                , machine_name, ev_name, states_enum_name) ;
+    const size_t n_end_words = (n_states + 31) / 32 ;
+    uint32_t* end_states = calloc(n_end_words + 1, sizeof(uint32_t)) ;
+    for (size_t i = 0; i < array_size_size(stage_data->end_states); ++ i) {
+        const size_t s = *array_size_cget(stage_data->end_states, i) ;
+        end_states[s / 32] |= (uint32_t) 1 << (s % 32) ;
     }
-    fprintf(file, "\n") ;
+
+    // The header, the sections following each other in its order.
+    uint32_t header[CARTEUR_BLOB_HEADER_WORDS] = { 0 } ;
+    size_t offset = sizeof(header) ;
+    header[CARTEUR_BLOB_MAGIC_WORD] = CARTEUR_BLOB_MAGIC ;
+    header[CARTEUR_BLOB_VERSION_WORD] = CARTEUR_BLOB_VERSION ;
+    header[CARTEUR_BLOB_HEADER_SIZE] = (uint32_t) sizeof(header) ;
+    header[CARTEUR_BLOB_STATES] = (uint32_t) n_states ;
+    header[CARTEUR_BLOB_EVENTS] = (uint32_t) n_events ;
+    header[CARTEUR_BLOB_CALLBACKS] = (uint32_t) n_callbacks ;
+    header[CARTEUR_BLOB_TRANSITIONS] = (uint32_t) n_transitions ;
+    header[CARTEUR_BLOB_PARTS] = (uint32_t) n_parts ;
+    header[CARTEUR_BLOB_START] = array_size_empty_p(stage_data->start_states)
+                               ? 0 : (uint32_t) *array_size_cget(stage_data->start_states, 0) ;
+    const size_t sizes[7] =
+        { 4 * (n_events + 1)
+        , 4 * 3 * n_transitions
+        , 4 * (n_callbacks + 1)
+        , 4 * n_parts
+        , 4 * n_names
+        , 4 * n_end_words
+        , pool.size
+        } ;
+    for (size_t i = 0; i < 7; ++ i) {
+        header[CARTEUR_BLOB_EVENT_OFFSETS + i] = (uint32_t) offset ;
+        offset += sizes[i] ;
+    }
+    header[CARTEUR_BLOB_SIZE] = (uint32_t) offset ;
+
+    bool ok = (offset <= UINT32_MAX) ;
+    if (! ok)
+        buffer_printf(stage_data->log, "Machine '%s': too big for a binary blob.\n", machine_name) ;
+    buffer_t blob ;
+    buffer_init(&blob) ;
+    buffer_put_words(&blob, header, CARTEUR_BLOB_HEADER_WORDS) ;
+    buffer_put_words(&blob, event_offsets, n_events + 1) ;
+    buffer_put_words(&blob, transitions, 3 * n_transitions) ;
+    buffer_put_words(&blob, part_offsets, n_callbacks + 1) ;
+    buffer_put_words(&blob, parts, n_parts) ;
+    buffer_put_words(&blob, name_offsets, n_names) ;
+    buffer_put_words(&blob, end_states, n_end_words) ;
+    buffer_append(&blob, pool.data, pool.size) ;
+    buffer_t path ;
+    buffer_init(&path) ;
+    const buffer_t* files[1] = { &blob } ;
+    if (ok)
+        ok = buffers_write(stage_data->log, output_path(&path, machine_name, 0, "bin"), files, 1) ;
+    if (ok)
+        ok = output_hash_write(stage_data->log, &path, machine_name, hash) ;
+    buffer_clear(&path) ;
+    buffer_clear(&blob) ;
+    buffer_clear(&pool) ;
+    free(end_states) ;
+    free(name_offsets) ;
+    free(parts) ;
+    free(part_offsets) ;
+    free(transitions) ;
+    free(event_offsets) ;
+    return ok ;
 }
 
+// ...................................................................... MAIN
+
 ///
-/// ...
+/// Output of --stats: lines in the log (--stats), or a JSON object per
+/// machine on stdout (--stats=json).
 ///
-void generate_C_source(FILE* file, generation_stage_data_t* stage_data) {
-    const char* machine_name = stage_data->parameters->machine_name ;
-    const char* states_enum_name = stage_data->parameters->states_enum_name ;
-    fprintf(file, "#include \"generated_%s.h\"\n\n", machine_name) ;
-
-    array_transition_it_t it ;
-    array_transition_it(it, stage_data->transitions) ;
-    bool transitions_available = ! array_transition_end_p(it) ;
-
-    // Consume all transitions. The outer loop handles event changes, and thus
-    // generates the head and bottom of each handler function. The inner loop
-    // consumes all transitions related to the same event (hence the order
-    // requirement) to produce the different cases.
-    while (transitions_available) {
-        const transition_t* ref = array_transition_cref(it) ;
-        char* event = *array_char_ptr_get(stage_data->events, (*ref)->event) ;
-        const size_t current_event = (*ref)->event ;
-        const char* callback = NULL ;
-        const char* from     = NULL ;
-        const char* to       = NULL ;
-
-        // Emit top of function.
-        fprintf(file, "void %s_handle_%s(%s* state, void* user) {\n",
-                machine_name, event, states_enum_name) ;
-        fprintf(file, "\tswitch (*state) {\n") ;
-
-        // Emit cases.
-        bool same_event = true ;
-        while (same_event) {
-            // Get names for the current transition t.
-            callback = *array_char_ptr_get(stage_data->callbacks, (*ref)->callback) ;
-            from = *array_char_ptr_get(stage_data->states, (*ref)->from) ;
-            to   = *array_char_ptr_get(stage_data->states, (*ref)->to) ;
-            fprintf(file, "\tcase %s:\n", from) ;
-            fprintf(file, "\t\t%s(user)\n", callback) ;
-            fprintf(file, "\t\t*state = %s\n", to) ;
-            fprintf(file, "\t\tbreak\n") ;
-
-            // Decide if the event will be the same or not.
-            array_transition_next(it) ;
-            if (array_transition_end_p(it)) {
-                transitions_available = false ;
-                break ;
-            }
-            ref = array_transition_cref(it) ;
-            same_event = (current_event == (*ref)->event) ;
-        }
+typedef enum stats_format_t {
+    CARTEUR_STATS_NONE = 0,
+    CARTEUR_STATS_TEXT = 1,
+    CARTEUR_STATS_JSON = 2,
+} stats_format_t ;
 
-        // Emit bottom of function.
-        // TODO Give the (default) option to raise an error.
-        fprintf(file, "\tdefault:\n\t\t// IMPOSSIBLE\n") ;
-        fprintf(file, "\t}\n}\n\n") ;
+///
+/// One machine file to process, and its outcome. Each machine has its own
+/// parameters, names, and log, so that several can be processed at once.
+/// The JSON statistics are kept apart from the log, in report. Jobs run by
+/// a pool claim the name of their machine there before generating it.
+///
+typedef struct machine_job_t {
+    const char* path ;
+    size_t jobs ;
+    bool force ;
+    stats_format_t stats ;
+    int status ;
+    buffer_t log ;
+    buffer_t report ;
+    struct machine_pool_t* pool ;
+    char* name ;
+} machine_job_t ;
+
+///
+/// Workers of the pool take the next unprocessed machine until there is
+/// none left.
+///
+typedef struct machine_pool_t {
+    machine_job_t* jobs ;
+    size_t n_jobs ;
+    size_t next ;
+    pthread_mutex_t lock ;
+} machine_pool_t ;
+
+///
+/// Claim the name of the machine of a job, so that no two jobs write the
+/// same outputs. Returns the path of the job which claimed it first, if
+/// any, in which case the job must not generate its machine.
+///
+static const char* machine_pool_claim(machine_pool_t* pool, machine_job_t* job, const char* name)
+{
+    const char* other = NULL ;
+    pthread_mutex_lock(&pool->lock) ;
+    for (size_t j = 0; (other == NULL) && (j < pool->n_jobs); ++ j) {
+        if ((pool->jobs[j].name != NULL) && (strcmp(pool->jobs[j].name, name) == 0))
+            other = pool->jobs[j].path ;
+    }
+    if (other == NULL) {
+        job->name = malloc(strlen(name) + 1) ;
+        strcpy(job->name, name) ;
     }
+    pthread_mutex_unlock(&pool->lock) ;
+    return other ;
 }
 
 ///
-/// ...
+/// Clocks and allocation counters, sampled between the stages. The CPU time
+/// is that of the whole process, threads included, and so are the counters:
+/// when several machines are processed at once, they mix theirs.
 ///
-void generate_C(generation_stage_data_t* stage_data) {
-    FILE* h_file = fopen("generated_" CARTEUR_DEFAULT_MACHINE_NAME ".h", "w") ;
-    FILE* c_file = fopen("generated_" CARTEUR_DEFAULT_MACHINE_NAME ".c", "w") ;
-    generate_C_header(h_file, stage_data) ;
-    generate_C_source(c_file, stage_data) ;
-    fclose(h_file) ;
-    fclose(c_file) ;
+typedef struct stats_sample_t {
+    double wall ;
+    double cpu ;
+    uint64_t allocations ;
+    uint64_t allocated ;
+    uint64_t frees ;
+} stats_sample_t ;
+
+static double clock_seconds(const clockid_t clock)
+{
+    struct timespec now ;
+    clock_gettime(clock, &now) ;
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9 ;
 }
 
-// ...................................................................... MAIN
+static void stats_sample(stats_sample_t* sample)
+{
+    sample->wall = clock_seconds(CLOCK_MONOTONIC) ;
+    sample->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID) ;
+    sample->allocations = atomic_load_explicit(&stats_allocations, memory_order_relaxed) ;
+    sample->allocated = atomic_load_explicit(&stats_allocated, memory_order_relaxed) ;
+    sample->frees = atomic_load_explicit(&stats_frees, memory_order_relaxed) ;
+}
 
-int main()
+///
+/// Peak resident set size of the process so far, in bytes (Linux counts
+/// ru_maxrss in KiB, macOS in bytes).
+///
+static uint64_t stats_peak_rss(void)
 {
-    //int err ;
+    struct rusage usage ;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0 ;
+#if defined(__APPLE__)
+    return (uint64_t) usage.ru_maxrss ;
+#else
+    return (uint64_t) usage.ru_maxrss * 1024 ;
+#endif
+}
+
+///
+/// Shape of the generated machine. The event fan-out is the largest number
+/// of transitions on an event, that is of cases in a switch handler, and the
+/// state fan-out the largest number of transitions out of a state. The
+/// density is that of the dense (state x event) table.
+///
+typedef struct stats_shape_t {
+    size_t states ;
+    size_t events ;
+    size_t callbacks ;
+    size_t transitions ;
+    size_t event_fan_out ;
+    size_t state_fan_out ;
+    double density ;
+} stats_shape_t ;
+
+static size_t stats_max_range(const array_size_t offsets)
+{
+    size_t max = 0 ;
+    for (size_t i = 1; i < array_size_size(offsets); ++ i) {
+        const size_t range = *array_size_cget(offsets, i) - *array_size_cget(offsets, i - 1) ;
+        if (range > max)
+            max = range ;
+    }
+    return max ;
+}
+
+static void stats_shape(const generation_stage_data_t* stage_data, stats_shape_t* shape)
+{
+    shape->states = array_cstr_size(stage_data->states) ;
+    shape->events = array_cstr_size(stage_data->events) ;
+    shape->callbacks = array_cstr_size(stage_data->callbacks) ;
+    shape->transitions = array_transition_size(stage_data->transitions) ;
+    shape->event_fan_out = stats_max_range(stage_data->event_offsets) ;
+    shape->state_fan_out = stats_max_range(stage_data->state_offsets) ;
+    const double cells = (double) shape->states * (double) shape->events ;
+    shape->density = (cells > 0) ? (double) shape->transitions / cells : 0 ;
+}
+
+static void buffer_put_json_string(buffer_t* out, const char* str)
+{
+    buffer_puts(out, "\"") ;
+    for (const char* c = str; *c != '\0'; ++ c) {
+        if ((*c == '"') || (*c == '\\'))
+            buffer_printf(out, "\\%c", *c) ;
+        else if ((unsigned char) *c < 0x20)
+            buffer_printf(out, "\\u%04x", (unsigned) (unsigned char) *c) ;
+        else
+            buffer_append(out, c, 1) ;
+    }
+    buffer_puts(out, "\"") ;
+}
+
+///
+/// Write the statistics of a machine, given the samples taken before and
+/// after each stage, as text in its log or as JSON in its report.
+///
+static void stats_report
+    ( machine_job_t* job
+    , const char* machine_name
+    , const stats_sample_t samples[4]
+    , const stats_shape_t* shape
+    )
+{
+    static const char* stages[3] = { "parse", "transform", "generate" } ;
+    const uint64_t peak_rss = stats_peak_rss() ;
+    if (job->stats == CARTEUR_STATS_TEXT) {
+        for (size_t i = 0; i < 3; ++ i) {
+            buffer_printf(&job->log, "Machine '%s': %s %.6f s, CPU %.6f s, %llu allocations"
+                          " (%llu bytes), %llu frees.\n"
+                         , machine_name, stages[i], samples[i + 1].wall - samples[i].wall
+                         , samples[i + 1].cpu - samples[i].cpu
+                         , (unsigned long long) (samples[i + 1].allocations - samples[i].allocations)
+                         , (unsigned long long) (samples[i + 1].allocated - samples[i].allocated)
+                         , (unsigned long long) (samples[i + 1].frees - samples[i].frees)) ;
+        }
+        buffer_printf(&job->log, "Machine '%s': peak RSS %llu KiB.\n"
+                     , machine_name, (unsigned long long) (peak_rss / 1024)) ;
+        buffer_printf(&job->log, "Machine '%s': %zu states, %zu events, %zu callbacks, %zu transitions,"
+                      " density %.4f, fan-out %zu per event, %zu per state.\n"
+                     , machine_name, shape->states, shape->events, shape->callbacks
+                     , shape->transitions, shape->density, shape->event_fan_out
+                     , shape->state_fan_out) ;
+        return ;
+    }
+    buffer_t* out = &job->report ;
+    buffer_puts(out, "{\"path\": ") ;
+    buffer_put_json_string(out, job->path) ;
+    buffer_puts(out, ", \"machine\": ") ;
+    buffer_put_json_string(out, machine_name) ;
+    buffer_printf(out, ", \"status\": %d, \"stages\": {", job->status) ;
+    for (size_t i = 0; i < 3; ++ i) {
+        buffer_printf(out, "%s\"%s\": {\"wall\": %.9f, \"cpu\": %.9f, \"allocations\": %llu"
+                      ", \"bytes\": %llu, \"frees\": %llu}"
+                     , (i == 0) ? "" : ", ", stages[i], samples[i + 1].wall - samples[i].wall
+                     , samples[i + 1].cpu - samples[i].cpu
+                     , (unsigned long long) (samples[i + 1].allocations - samples[i].allocations)
+                     , (unsigned long long) (samples[i + 1].allocated - samples[i].allocated)
+                     , (unsigned long long) (samples[i + 1].frees - samples[i].frees)) ;
+    }
+    buffer_printf(out, "}, \"peak_rss\": %llu, \"shape\": {\"states\": %zu, \"events\": %zu"
+                  ", \"callbacks\": %zu, \"transitions\": %zu, \"density\": %.6f"
+                  ", \"event_fan_out\": %zu, \"state_fan_out\": %zu}}\n"
+                 , (unsigned long long) peak_rss, shape->states, shape->events
+                 , shape->callbacks, shape->transitions, shape->density
+                 , shape->event_fan_out, shape->state_fan_out) ;
+}
+
+///
+/// Run the three stages on one machine file. The exit code is left in
+/// job->status, and the messages in job->log.
+///
+void process_machine(machine_job_t* job)
+{
+    input_t input ;
+    if (! input_open(&input, job->path)) {
+        buffer_printf(&job->log, "Cannot read '%s'.\n", job->path) ;
+        job->status = 1 ;
+        return ;
+    }
     parameters_t params ;
     parameters_init(&params) ;
+    arena_t names ;
+    arena_init(&names) ;
     parsing_stage_data_t parsing_stage_data ;
     parsing_stage_data.parameters = &params ;
+    parsing_stage_data.log = &job->log ;
+    parsing_stage_data.status = 0 ;
 
 #if defined(CARTEUR_GRAPH_ANALYSIS)
     err = igraph_empty(&machine.graph, 0, true) ;
     if (err != IGRAPH_SUCCESS) {
-        fprintf(stderr, "Failed to initialise graph.\n") ;
-        return 1 ;
+        buffer_printf(&job->log, "Failed to initialise graph.\n") ;
+        job->status = 1 ;
+        return ;
     }
 #endif
 
-    dict_string_init(parsing_stage_data.states) ;
-    dict_string_init(parsing_stage_data.events) ;
-    dict_string_init(parsing_stage_data.callbacks) ;
+    symbol_table_init(&parsing_stage_data.states, &names) ;
+    symbol_table_init(&parsing_stage_data.events, &names) ;
+    symbol_table_init(&parsing_stage_data.callbacks, &names) ;
     array_transition_init(parsing_stage_data.transitions) ;
+    array_size_init(parsing_stage_data.start_states) ;
+    array_size_init(parsing_stage_data.end_states) ;
+    array_component_init(parsing_stage_data.components) ;
+    array_token_init(parsing_stage_data.compose) ;
     
     // Stage 1 - Parsing.
-    ini_parse("test.ini", parser_handler, &parsing_stage_data) ;
+    stats_sample_t samples[4] ;
+    stats_sample(&samples[0]) ;
+    // Faulty lines are skipped so that all of them get reported, but the
+    // machine is not generated.
+    if ((parse_input_parallel(&parsing_stage_data, &input, job->jobs) > 0)
+        && (parsing_stage_data.status == 0))
+        parsing_stage_data.status = 4 ;
+    stats_sample(&samples[1]) ;
 
     /*
-    dict_string_it_t it ;
-    printf("States :\n") ;
-    dict_string_it(it, parsing_stage_data.states) ;
-    while (! dict_string_end_p(it)) {
-        const dict_string_itref_t* ref = dict_string_cref(it) ;
-        printf("(%zu) %s\n", ref->value, string_get_cstr(ref->key)) ;
-        dict_string_next(it) ;
-    }
-    printf("\nEvents :\n") ;
-    dict_string_it(it, parsing_stage_data.events) ;
-    while (! dict_string_end_p(it)) {
-        const dict_string_itref_t* ref = dict_string_cref(it) ;
-        printf("(%zu) %s\n", ref->value, string_get_cstr(ref->key)) ;
-        dict_string_next(it) ;
-    }
-    printf("\nCallbacks :\n") ;
-    dict_string_it(it, parsing_stage_data.callbacks) ;
-    while (! dict_string_end_p(it)) {
-        const dict_string_itref_t* ref = dict_string_cref(it) ;
-        printf("(%zu) %s\n", ref->value, string_get_cstr(ref->key)) ;
-        dict_string_next(it) ;
+    const symbol_table_t* tables[3] =
+        { &parsing_stage_data.states
+        , &parsing_stage_data.events
+        , &parsing_stage_data.callbacks
+        } ;
+    const char* titles[3] = { "States", "Events", "Callbacks" } ;
+    for (size_t t = 0; t < 3; ++ t) {
+        printf("%s :\n", titles[t]) ;
+        for (size_t i = 0; i < symbol_table_size(tables[t]); ++ i) {
+            printf("(%zu) %s\n", i, *array_cstr_get(tables[t]->names, i)) ;
+        }
+        printf("\n") ;
     }
     printf("\nTransitions :\n") ;
     const size_t n_transitions =
@@ -607,7 +6136,18 @@ int main()
     // Stage 2 - Optimisation.
     generation_stage_data_t generation_data ;
     generation_data.parameters = &params ;
+    generation_data.log = &job->log ;
     transform_graph(&parsing_stage_data, &generation_data) ;
+    job->status = parsing_stage_data.status ;
+    if ((job->status == 0) && (job->pool != NULL)) {
+        const char* other = machine_pool_claim(job->pool, job, params.machine_name) ;
+        if (other != NULL) {
+            buffer_printf(&job->log, "Machine '%s': already generated from '%s', skipped.\n"
+                         , params.machine_name, other) ;
+            job->status = 1 ;
+        }
+    }
+    stats_sample(&samples[2]) ;
 
     /*
     printf("\nTransitions (sorted) :\n") ;
@@ -617,20 +6157,45 @@ int main()
     }
     */
 
-    // Clear stage 1 dictionnaries as they aren't required anymore.
-    dict_string_clear(parsing_stage_data.callbacks) ;
-    dict_string_clear(parsing_stage_data.events) ;
-    dict_string_clear(parsing_stage_data.states) ;
+    // The input isn't required anymore, the names were interned.
+    input_close(&input) ;
 
-    // Stage 3 - Generation.
-    generate_C(&generation_data) ;
+    // Stage 3 - Generation, unless the outputs are up to date.
+    if (job->status == 0) {
+        const uint64_t hash = generation_hash(&generation_data) ;
+        switch (params.language) {
+        case CARTEUR_LANGUAGE_C:
+            if (job->force || ! generate_C_up_to_date(&generation_data, hash)) {
+                if (! generate_C(&generation_data, job->jobs, hash))
+                    job->status = 1 ;
+            }
+            break ;
+        case CARTEUR_LANGUAGE_CPP:
+            if (job->force || ! generate_CPP_up_to_date(&generation_data, hash)) {
+                if (! generate_CPP(&generation_data, hash))
+                    job->status = 1 ;
+            }
+            break ;
+        case CARTEUR_LANGUAGE_BINARY:
+            if (job->force || ! generate_BIN_up_to_date(&generation_data, hash)) {
+                if (! generate_BIN(&generation_data, hash))
+                    job->status = 1 ;
+            }
+            break ;
+        }
+    }
+    stats_sample(&samples[3]) ;
+    if (job->stats != CARTEUR_STATS_NONE) {
+        stats_shape_t shape ;
+        stats_shape(&generation_data, &shape) ;
+        stats_report(job, params.machine_name, samples, &shape) ;
+    }
     
     // After - Cleaning.
-    array_transition_clear(generation_data.transitions) ;
-    array_char_ptr_clear(generation_data.states) ;
-    array_char_ptr_clear(generation_data.events) ;
-    array_char_ptr_clear(generation_data.callbacks) ;
+    generation_stage_data_clear(&generation_data) ;
+    arena_clear(&names) ;
 
+    free(params.profile) ;
     free(params.machine_name) ;
     free(params.states_enum_name) ;
     free(params.events_enum_name) ;
@@ -638,7 +6203,156 @@ int main()
 #if defined(CARTEUR_GRAPH_ANALYSIS)
     igraph_destroy(&parsing_stage_data.graph) ;
 #endif
+}
 
-    return 0 ;
+static void* machine_pool_worker(void* userdata)
+{
+    machine_pool_t* pool = *(machine_pool_t**) userdata ;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock) ;
+        const size_t j = pool->next ++ ;
+        pthread_mutex_unlock(&pool->lock) ;
+        if (j >= pool->n_jobs)
+            break ;
+        process_machine(&pool->jobs[j]) ;
+    }
+    return NULL ;
+}
+
+ARRAY_DEF(array_path, char*, M_PTR_OPLIST)
+
+///
+/// Add the paths listed in a manifest, one per line. Blank lines and lines
+/// starting with '#' are ignored.
+///
+static bool read_manifest(const char* manifest, array_path_t paths)
+{
+    input_t input ;
+    if (! input_open(&input, manifest)) {
+        fprintf(stderr, "Cannot read '%s'.\n", manifest) ;
+        return false ;
+    }
+    size_t begin = 0 ;
+    while (begin < input.size) {
+        const char* eol = memchr(input.data + begin, '\n', input.size - begin) ;
+        size_t end = (eol == NULL) ? input.size : (size_t) (eol - input.data) ;
+        const size_t next = end + 1 ;
+        while ((begin < end) && ((input.data[begin] == ' ') || (input.data[begin] == '\t')))
+            ++ begin ;
+        while ((end > begin) && ((input.data[end - 1] == ' ') || (input.data[end - 1] == '\t')
+                                 || (input.data[end - 1] == '\r')))
+            -- end ;
+        if ((end > begin) && (input.data[begin] != '#')) {
+            char* path = malloc(end - begin + 1) ;
+            memcpy(path, input.data + begin, end - begin) ;
+            path[end - begin] = '\0' ;
+            array_path_push_back(paths, path) ;
+        }
+        begin = next ;
+    }
+    input_close(&input) ;
+    return true ;
 }
 
+static char* path_copy(const char* path)
+{
+    char* copy = malloc(strlen(path) + 1) ;
+    strcpy(copy, path) ;
+    return copy ;
+}
+
+///
+/// carteur [-j N] [-f] [--stats[=json]] [-m manifest] [machine.ini...]
+///
+/// Several machines are processed concurrently, on N workers, each machine
+/// being processed sequentially. A single machine uses the N threads itself.
+/// Messages are printed once everything is done, in the order of the
+/// machines, prefixed with their path when there are several. The exit code
+/// is the highest of those of the machines.
+///
+int main(int argc, char** argv)
+{
+    //int err ;
+    size_t jobs = 1 ;
+    bool force = false ;
+    stats_format_t stats = CARTEUR_STATS_NONE ;
+    array_path_t paths ;
+    array_path_init(paths) ;
+    int status = 0 ;
+    for (int i = 1; i < argc; ++ i) {
+        if (((strcmp(argv[i], "-j") == 0) || (strcmp(argv[i], "--jobs") == 0))
+            && (i + 1 < argc)) {
+            jobs = strtoul(argv[++ i], NULL, 10) ;
+        } else if ((strcmp(argv[i], "-f") == 0) || (strcmp(argv[i], "--force") == 0)) {
+            force = true ;
+        } else if ((strcmp(argv[i], "--stats") == 0) || (strcmp(argv[i], "--stats=text") == 0)) {
+            stats = CARTEUR_STATS_TEXT ;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            stats = CARTEUR_STATS_JSON ;
+        } else if (((strcmp(argv[i], "-m") == 0) || (strcmp(argv[i], "--manifest") == 0))
+                   && (i + 1 < argc)) {
+            if (! read_manifest(argv[++ i], paths))
+                status = 1 ;
+        } else {
+            array_path_push_back(paths, path_copy(argv[i])) ;
+        }
+    }
+    if (array_path_empty_p(paths) && (status == 0))
+        array_path_push_back(paths, path_copy("test.ini")) ;
+    if (jobs == 0)
+        jobs = 1 ;
+
+    const size_t n_machines = array_path_size(paths) ;
+    machine_job_t* machines = calloc(n_machines, sizeof(machine_job_t)) ;
+    for (size_t m = 0; m < n_machines; ++ m) {
+        machines[m].path = *array_path_get(paths, m) ;
+        machines[m].jobs = (n_machines > 1) ? 1 : jobs ;
+        machines[m].force = force ;
+        machines[m].stats = stats ;
+        machines[m].status = 0 ;
+        buffer_init(&machines[m].log) ;
+        buffer_init(&machines[m].report) ;
+    }
+    if (n_machines == 1) {
+        process_machine(&machines[0]) ;
+    } else if (n_machines > 1) {
+        const size_t n_workers = (jobs < n_machines) ? jobs : n_machines ;
+        machine_pool_t pool = { .jobs = machines, .n_jobs = n_machines, .next = 0 } ;
+        pthread_mutex_init(&pool.lock, NULL) ;
+        for (size_t m = 0; m < n_machines; ++ m) {
+            machines[m].pool = &pool ;
+        }
+        machine_pool_t** workers = malloc(n_workers * sizeof(machine_pool_t*)) ;
+        for (size_t w = 0; w < n_workers; ++ w) {
+            workers[w] = &pool ;
+        }
+        threads_run(workers, sizeof(machine_pool_t*), n_workers, machine_pool_worker) ;
+        free(workers) ;
+        pthread_mutex_destroy(&pool.lock) ;
+    }
+
+    // Report.
+    for (size_t m = 0; m < n_machines; ++ m) {
+        machine_job_t* job = &machines[m] ;
+        size_t begin = 0 ;
+        while (begin < job->log.size) {
+            const char* eol = memchr(job->log.data + begin, '\n', job->log.size - begin) ;
+            const size_t end = (eol == NULL) ? job->log.size : (size_t) (eol - job->log.data) ;
+            if (n_machines > 1)
+                fprintf(stderr, "%s: ", job->path) ;
+            fprintf(stderr, "%.*s\n", (int) (end - begin), job->log.data + begin) ;
+            begin = end + 1 ;
+        }
+        if (job->report.size > 0)
+            fwrite(job->report.data, 1, job->report.size, stdout) ;
+        if (job->status > status)
+            status = job->status ;
+        buffer_clear(&job->log) ;
+        buffer_clear(&job->report) ;
+        free(job->name) ;
+        free(*array_path_get(paths, m)) ;
+    }
+    free(machines) ;
+    array_path_clear(paths) ;
+    return status ;
+}
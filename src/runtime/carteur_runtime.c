@@ -0,0 +1,275 @@
+//
+// This is part of the source code of the carteur state machine generator.
+// The code is under the BSD-3 license (see LICENSE).
+//
+// Hugo RENS <hugo.rens@univ-tlse3.fr>
+//
+
+// The blob is mapped in memory, which is POSIX.
+#define _POSIX_C_SOURCE 200809L
+
+#include "carteur_runtime.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// ................................................................... LOADING
+
+///
+/// The section at the byte offset given by the header word index, of n
+/// words, or NULL if it does not fit in the blob.
+///
+static const uint32_t* blob_section
+    ( const uint32_t* words
+    , const size_t size
+    , const unsigned index
+    , const uint64_t n
+    )
+{
+    const uint64_t offset = words[index] ;
+    if ((offset % 4 != 0) || (offset > size) || (n > (size - offset) / 4))
+        return NULL ;
+    return words + offset / 4 ;
+}
+
+carteur_status carteur_open(carteur_machine* machine, const void* data, size_t size)
+{
+    memset(machine, 0, sizeof(carteur_machine)) ;
+    const uint32_t* words = data ;
+    if ((data == NULL) || ((uintptr_t) data % 4 != 0) || (size % 4 != 0)
+        || (size < CARTEUR_BLOB_HEADER_WORDS * 4))
+        return CARTEUR_ERROR_FORMAT ;
+    if (words[CARTEUR_BLOB_MAGIC_WORD] != CARTEUR_BLOB_MAGIC)
+        return CARTEUR_ERROR_FORMAT ;
+    if (words[CARTEUR_BLOB_VERSION_WORD] != CARTEUR_BLOB_VERSION)
+        return CARTEUR_ERROR_VERSION ;
+    if ((words[CARTEUR_BLOB_HEADER_SIZE] < CARTEUR_BLOB_HEADER_WORDS * 4)
+        || (words[CARTEUR_BLOB_SIZE] != size))
+        return CARTEUR_ERROR_FORMAT ;
+
+    const uint64_t n_states = words[CARTEUR_BLOB_STATES] ;
+    const uint64_t n_events = words[CARTEUR_BLOB_EVENTS] ;
+    const uint64_t n_callbacks = words[CARTEUR_BLOB_CALLBACKS] ;
+    const uint64_t n_transitions = words[CARTEUR_BLOB_TRANSITIONS] ;
+    const uint64_t n_parts = words[CARTEUR_BLOB_PARTS] ;
+    machine->event_offsets = blob_section(words, size, CARTEUR_BLOB_EVENT_OFFSETS, n_events + 1) ;
+    machine->transitions = blob_section(words, size, CARTEUR_BLOB_TRANSITION_TABLE, 3 * n_transitions) ;
+    machine->part_offsets = blob_section(words, size, CARTEUR_BLOB_PART_OFFSETS, n_callbacks + 1) ;
+    machine->parts = blob_section(words, size, CARTEUR_BLOB_PART_TABLE, n_parts) ;
+    machine->name_offsets = blob_section(words, size, CARTEUR_BLOB_NAME_OFFSETS
+                                        , n_states + n_events + n_callbacks) ;
+    machine->end_states = blob_section(words, size, CARTEUR_BLOB_END_STATES, (n_states + 31) / 32) ;
+    const uint32_t* names = blob_section(words, size, CARTEUR_BLOB_NAME_POOL, 1) ;
+    if ((machine->event_offsets == NULL) || (machine->transitions == NULL)
+        || (machine->part_offsets == NULL) || (machine->parts == NULL)
+        || (machine->name_offsets == NULL) || (machine->end_states == NULL) || (names == NULL))
+        return CARTEUR_ERROR_FORMAT ;
+
+    // The pool runs to the end of the blob, and ends with a nul, so that
+    // names in it are terminated.
+    if (((const char*) words)[size - 1] != '\0')
+        return CARTEUR_ERROR_FORMAT ;
+    if ((machine->event_offsets[n_events] != n_transitions)
+        || (machine->part_offsets[n_callbacks] != n_parts)
+        || ((n_states > 0) && (words[CARTEUR_BLOB_START] >= n_states)))
+        return CARTEUR_ERROR_FORMAT ;
+
+    machine->words = words ;
+    machine->size = size ;
+    machine->n_states = (uint32_t) n_states ;
+    machine->n_events = (uint32_t) n_events ;
+    machine->n_callbacks = (uint32_t) n_callbacks ;
+    machine->start = words[CARTEUR_BLOB_START] ;
+    machine->names = (const char*) names ;
+    return CARTEUR_OK ;
+}
+
+carteur_status carteur_map(carteur_machine* machine, const char* path)
+{
+    memset(machine, 0, sizeof(carteur_machine)) ;
+    const int fd = open(path, O_RDONLY) ;
+    if (fd < 0)
+        return CARTEUR_ERROR_IO ;
+    struct stat st ;
+    if (fstat(fd, &st) != 0) {
+        close(fd) ;
+        return CARTEUR_ERROR_IO ;
+    }
+    if (st.st_size < CARTEUR_BLOB_HEADER_WORDS * 4) {
+        close(fd) ;
+        return CARTEUR_ERROR_FORMAT ;
+    }
+    const size_t size = (size_t) st.st_size ;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) ;
+    close(fd) ;
+    if (data == MAP_FAILED)
+        return CARTEUR_ERROR_IO ;
+    const carteur_status status = carteur_open(machine, data, size) ;
+    if (status != CARTEUR_OK) {
+        munmap(data, size) ;
+        return status ;
+    }
+    machine->mapped = 1 ;
+    return CARTEUR_OK ;
+}
+
+void carteur_close(carteur_machine* machine)
+{
+    if (machine->mapped)
+        munmap((void*) machine->words, machine->size) ;
+    memset(machine, 0, sizeof(carteur_machine)) ;
+}
+
+carteur_status carteur_check(const carteur_machine* machine)
+{
+    const uint32_t n_transitions = machine->event_offsets[machine->n_events] ;
+    for (uint32_t ev = 0; ev < machine->n_events; ++ ev) {
+        const uint32_t begin = machine->event_offsets[ev] ;
+        const uint32_t end = machine->event_offsets[ev + 1] ;
+        if ((begin > end) || (end > n_transitions))
+            return CARTEUR_ERROR_FORMAT ;
+        for (uint32_t i = begin; i < end; ++ i) {
+            const uint32_t* t = machine->transitions + 3 * (size_t) i ;
+            if ((t[0] >= machine->n_states) || (t[1] >= machine->n_states)
+                || (t[2] >= machine->n_callbacks) || ((i > begin) && (t[-3] >= t[0])))
+                return CARTEUR_ERROR_FORMAT ;
+        }
+    }
+    const uint32_t n_parts = machine->part_offsets[machine->n_callbacks] ;
+    for (uint32_t cb = 0; cb < machine->n_callbacks; ++ cb) {
+        if (machine->part_offsets[cb] > machine->part_offsets[cb + 1])
+            return CARTEUR_ERROR_FORMAT ;
+    }
+    for (uint32_t p = 0; p < n_parts; ++ p) {
+        if (machine->parts[p] >= machine->n_callbacks)
+            return CARTEUR_ERROR_FORMAT ;
+    }
+    const size_t pool = machine->size - (size_t) (machine->names - (const char*) machine->words) ;
+    const size_t n_names = (size_t) machine->n_states + machine->n_events + machine->n_callbacks ;
+    for (size_t i = 0; i < n_names; ++ i) {
+        if (machine->name_offsets[i] >= pool)
+            return CARTEUR_ERROR_FORMAT ;
+    }
+    return CARTEUR_OK ;
+}
+
+const char* carteur_strerror(carteur_status status)
+{
+    switch (status) {
+    case CARTEUR_OK:
+        return "success" ;
+    case CARTEUR_ERROR_IO:
+        return "cannot map the blob" ;
+    case CARTEUR_ERROR_FORMAT:
+        return "not a valid blob" ;
+    case CARTEUR_ERROR_VERSION:
+        return "unsupported blob version" ;
+    }
+    return "unknown error" ;
+}
+
+// ..................................................................... NAMES
+
+///
+/// Name at index i of the name offsets, NULL if it lies out of the pool.
+///
+static const char* machine_name_at(const carteur_machine* machine, const size_t i)
+{
+    const size_t pool = machine->size - (size_t) (machine->names - (const char*) machine->words) ;
+    const uint32_t offset = machine->name_offsets[i] ;
+    return (offset < pool) ? machine->names + offset : NULL ;
+}
+
+static int64_t machine_find_name
+    ( const carteur_machine* machine
+    , const size_t first
+    , const uint32_t n
+    , const char* name
+    )
+{
+    for (uint32_t i = 0; i < n; ++ i) {
+        const char* candidate = machine_name_at(machine, first + i) ;
+        if ((candidate != NULL) && (strcmp(candidate, name) == 0))
+            return i ;
+    }
+    return -1 ;
+}
+
+const char* carteur_state_name(const carteur_machine* machine, uint32_t state)
+{
+    return (state < machine->n_states) ? machine_name_at(machine, state) : NULL ;
+}
+
+const char* carteur_event_name(const carteur_machine* machine, uint32_t event)
+{
+    return (event < machine->n_events)
+         ? machine_name_at(machine, (size_t) machine->n_states + event) : NULL ;
+}
+
+const char* carteur_callback_name(const carteur_machine* machine, uint32_t callback)
+{
+    return (callback < machine->n_callbacks)
+         ? machine_name_at(machine, (size_t) machine->n_states + machine->n_events + callback) : NULL ;
+}
+
+int64_t carteur_state_from_name(const carteur_machine* machine, const char* name)
+{
+    return machine_find_name(machine, 0, machine->n_states, name) ;
+}
+
+int64_t carteur_event_from_name(const carteur_machine* machine, const char* name)
+{
+    return machine_find_name(machine, machine->n_states, machine->n_events, name) ;
+}
+
+int64_t carteur_callback_from_name(const carteur_machine* machine, const char* name)
+{
+    return machine_find_name(machine, (size_t) machine->n_states + machine->n_events
+                            , machine->n_callbacks, name) ;
+}
+
+// .................................................................. DISPATCH
+
+int carteur_is_end(const carteur_machine* machine, uint32_t state)
+{
+    return (state < machine->n_states)
+        && ((machine->end_states[state / 32] >> (state % 32)) & 1) ;
+}
+
+int carteur_dispatch
+    ( const carteur_machine* machine
+    , uint32_t* state
+    , uint32_t event
+    , const carteur_callback* callbacks
+    , void* user
+    )
+{
+    if (event >= machine->n_events)
+        return 0 ;
+    const uint32_t* transitions = machine->transitions ;
+    uint32_t low = machine->event_offsets[event] ;
+    uint32_t high = machine->event_offsets[event + 1] ;
+    const uint32_t end = high ;
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2 ;
+        if (transitions[3 * (size_t) middle] < *state)
+            low = middle + 1 ;
+        else
+            high = middle ;
+    }
+    if ((low == end) || (transitions[3 * (size_t) low] != *state))
+        return 0 ;
+    const uint32_t* t = transitions + 3 * (size_t) low ;
+    if (callbacks != NULL) {
+        for (uint32_t p = machine->part_offsets[t[2]]; p < machine->part_offsets[t[2] + 1]; ++ p) {
+            const carteur_callback callback = callbacks[machine->parts[p]] ;
+            if (callback != NULL)
+                callback(user) ;
+        }
+    }
+    *state = t[1] ;
+    return 1 ;
+}
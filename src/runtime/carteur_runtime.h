@@ -0,0 +1,163 @@
+//
+// This is part of the source code of the carteur state machine generator.
+// The code is under the BSD-3 license (see LICENSE).
+//
+// Hugo RENS <hugo.rens@univ-tlse3.fr>
+//
+
+//
+// Runtime for the machines carteur writes as binary blobs (language =
+// binary). A blob is mapped as is and events are dispatched straight from
+// it, without parsing nor allocating. The format is defined here, and used
+// by carteur to write the blobs.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ................................................................... FORMAT
+
+///
+/// A blob is a sequence of little-endian 32-bit words. It starts with a
+/// header of CARTEUR_BLOB_HEADER_WORDS words, indexed by the constants
+/// below, followed by the sections the header gives the offsets of, in
+/// bytes from the start of the blob. Nothing else refers to an address, so
+/// that a blob can be mapped anywhere.
+///
+/// - event offsets, n_events + 1 words: the transitions on event e are
+///   those from event_offsets[e] to event_offsets[e + 1] excluded
+/// - transitions, 3 words each (from, to, callback), sorted by event then
+///   by state, at most one per pair
+/// - callback part offsets, n_callbacks + 1 words, and callback parts: the
+///   callback c runs the callbacks in parts, from part_offsets[c] to
+///   part_offsets[c + 1] excluded, which is itself but for the callbacks of
+///   composed machines
+/// - name offsets, n_states + n_events + n_callbacks words, into the name
+///   pool, of the states, then of the events, then of the callbacks
+/// - end states, a bitset of (n_states + 31) / 32 words
+/// - name pool, nul-terminated names, padded to a word
+///
+/// Blobs of another version are rejected. Sections may be added at the end
+/// of the header without changing the version.
+///
+#define CARTEUR_BLOB_MAGIC 0x52545243u /* "CRTR" */
+#define CARTEUR_BLOB_VERSION 1u
+
+enum {
+    CARTEUR_BLOB_MAGIC_WORD,
+    CARTEUR_BLOB_VERSION_WORD,
+    CARTEUR_BLOB_HEADER_SIZE,
+    CARTEUR_BLOB_SIZE,
+    CARTEUR_BLOB_STATES,
+    CARTEUR_BLOB_EVENTS,
+    CARTEUR_BLOB_CALLBACKS,
+    CARTEUR_BLOB_TRANSITIONS,
+    CARTEUR_BLOB_PARTS,
+    CARTEUR_BLOB_START,
+    CARTEUR_BLOB_EVENT_OFFSETS,
+    CARTEUR_BLOB_TRANSITION_TABLE,
+    CARTEUR_BLOB_PART_OFFSETS,
+    CARTEUR_BLOB_PART_TABLE,
+    CARTEUR_BLOB_NAME_OFFSETS,
+    CARTEUR_BLOB_END_STATES,
+    CARTEUR_BLOB_NAME_POOL,
+    CARTEUR_BLOB_HEADER_WORDS
+} ;
+
+// .................................................................. RUNTIME
+
+typedef enum carteur_status {
+    CARTEUR_OK = 0,
+    CARTEUR_ERROR_IO = 1,
+    CARTEUR_ERROR_FORMAT = 2,
+    CARTEUR_ERROR_VERSION = 3,
+} carteur_status ;
+
+///
+/// A machine, as views into its blob. Filled by carteur_open or carteur_map,
+/// it does not own anything but the mapping of carteur_map.
+///
+typedef struct carteur_machine {
+    const uint32_t* words ;
+    size_t size ;
+    int mapped ;
+    uint32_t n_states ;
+    uint32_t n_events ;
+    uint32_t n_callbacks ;
+    uint32_t start ;
+    const uint32_t* event_offsets ;
+    const uint32_t* transitions ;
+    const uint32_t* part_offsets ;
+    const uint32_t* parts ;
+    const uint32_t* name_offsets ;
+    const uint32_t* end_states ;
+    const char* names ;
+} carteur_machine ;
+
+///
+/// Callbacks provided by the user, indexed by callback. Entries may be NULL,
+/// and so may be the table.
+///
+typedef void (*carteur_callback)(void* user) ;
+
+///
+/// Use the blob of size bytes at data, which must be 4-byte aligned and
+/// outlive the machine. Only the header is checked, in constant time.
+///
+carteur_status carteur_open(carteur_machine* machine, const void* data, size_t size) ;
+
+///
+/// Map the blob at path read-only, and use it.
+///
+carteur_status carteur_map(carteur_machine* machine, const char* path) ;
+
+///
+/// Unmap the blob, if carteur_map mapped it.
+///
+void carteur_close(carteur_machine* machine) ;
+
+///
+/// Check all the indices of the blob, in linear time, for blobs that may
+/// have been corrupted. Dispatching from a blob failing it is undefined.
+///
+carteur_status carteur_check(const carteur_machine* machine) ;
+
+const char* carteur_strerror(carteur_status status) ;
+
+///
+/// Names of the states, events and callbacks, NULL when out of range.
+///
+const char* carteur_state_name(const carteur_machine* machine, uint32_t state) ;
+const char* carteur_event_name(const carteur_machine* machine, uint32_t event) ;
+const char* carteur_callback_name(const carteur_machine* machine, uint32_t callback) ;
+
+///
+/// State, event or callback of the given name, or -1. These compare the
+/// names one by one, and are meant for binding callbacks and events once,
+/// after loading.
+///
+int64_t carteur_state_from_name(const carteur_machine* machine, const char* name) ;
+int64_t carteur_event_from_name(const carteur_machine* machine, const char* name) ;
+int64_t carteur_callback_from_name(const carteur_machine* machine, const char* name) ;
+
+///
+/// Whether the state is an end state.
+///
+int carteur_is_end(const carteur_machine* machine, uint32_t state) ;
+
+///
+/// Take the transition from *state on event, if there is one, running its
+/// callbacks (callbacks[part] for each of its parts) before the state
+/// changes, as the generated dispatchers do. Returns whether a transition
+/// was taken. The transition is found by a binary search among those of the
+/// event.
+///
+int carteur_dispatch
+    ( const carteur_machine* machine
+    , uint32_t* state
+    , uint32_t event
+    , const carteur_callback* callbacks
+    , void* user
+    ) ;